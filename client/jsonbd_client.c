@@ -0,0 +1,782 @@
+/*
+ * Client side decoder of jsonbd compressed data.
+ *
+ * It walks binary jsonb containers (see src/include/utils/jsonb.h in
+ * PostgreSQL) and prints them as JSON text, replacing encoded key ids with
+ * keys from the dictionary. The client should have the same byte order
+ * as the server.
+ */
+
+#include "jsonbd_client.h"
+#include "jsonbd_codec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* jsonb container and JEntry format, copied from PostgreSQL */
+#define JB_CMASK				0x0FFFFFFF
+#define JB_FSCALAR				0x10000000
+#define JB_FOBJECT				0x20000000
+#define JB_FARRAY				0x40000000
+
+#define JENTRY_OFFLENMASK		0x0FFFFFFF
+#define JENTRY_TYPEMASK			0x70000000
+#define JENTRY_HAS_OFF			0x80000000
+
+#define JENTRY_ISSTRING			0x00000000
+#define JENTRY_ISNUMERIC		0x10000000
+#define JENTRY_ISBOOL_FALSE		0x20000000
+#define JENTRY_ISBOOL_TRUE		0x30000000
+#define JENTRY_ISNULL			0x40000000
+#define JENTRY_ISCONTAINER		0x50000000
+
+/* numeric format */
+#define NUMERIC_SIGN_MASK		0xC000
+#define NUMERIC_NEG				0x4000
+#define NUMERIC_SHORT			0x8000
+#define NUMERIC_NAN				0xC000
+#define NUMERIC_SHORT_SIGN_MASK			0x2000
+#define NUMERIC_SHORT_DSCALE_MASK		0x1F80
+#define NUMERIC_SHORT_DSCALE_SHIFT		7
+#define NUMERIC_SHORT_WEIGHT_SIGN_MASK	0x0040
+#define NUMERIC_SHORT_WEIGHT_MASK		0x003F
+#define NUMERIC_DSCALE_MASK		0x3FFF
+
+/* size of varlena header and custom compressed varlena header */
+#define VARHDRSZ				4
+#define VARHDRSZ_CUSTOM_COMPRESSED	12
+
+/* length of the hash in references to subdocuments */
+#define SUBDOC_HASH_LEN			32
+
+#define INTALIGN(len)			(((uintptr_t) (len) + 3) & ~((uintptr_t) 3))
+
+typedef struct
+{
+	char	   *key;
+	size_t		keylen;
+} dict_entry;
+
+struct jsonbd_dict
+{
+	dict_entry *entries;	/* indexed by id */
+	uint32_t	size;
+	uint32_t	maxid;
+};
+
+typedef struct
+{
+	char	   *data;
+	size_t		len;
+	size_t		cap;
+} outbuf;
+
+typedef struct
+{
+	const jsonbd_dict *dict;
+	const char *start;		/* bounds of the datum */
+	const char *end;
+	int			compressed;	/* keys are encoded ids */
+	outbuf		out;
+} decoder;
+
+typedef struct
+{
+	const char *key;
+	size_t		keylen;
+	int			index;		/* index of the value, -1 for elided nulls */
+} pair;
+
+static jsonbd_result decode_container(decoder *d, const char *ptr);
+
+jsonbd_dict *
+jsonbd_dict_create(void)
+{
+	return (jsonbd_dict *) calloc(1, sizeof(jsonbd_dict));
+}
+
+void
+jsonbd_dict_free(jsonbd_dict *dict)
+{
+	uint32_t	i;
+
+	if (dict == NULL)
+		return;
+
+	for (i = 0; i < dict->size; i++)
+		free(dict->entries[i].key);
+
+	free(dict->entries);
+	free(dict);
+}
+
+jsonbd_result
+jsonbd_dict_add(jsonbd_dict *dict, uint32_t id, const char *key, size_t keylen)
+{
+	dict_entry *entry;
+
+	if (id >= dict->size)
+	{
+		uint32_t	newsize = dict->size ? dict->size : 1024;
+		dict_entry *entries;
+
+		while (newsize <= id)
+			newsize *= 2;
+
+		entries = (dict_entry *) realloc(dict->entries,
+										 sizeof(dict_entry) * newsize);
+		if (entries == NULL)
+			return JSONBD_ERR_NOMEM;
+
+		memset(entries + dict->size, 0,
+			   sizeof(dict_entry) * (newsize - dict->size));
+		dict->entries = entries;
+		dict->size = newsize;
+	}
+
+	entry = &dict->entries[id];
+	free(entry->key);
+	entry->key = (char *) malloc(keylen + 1);
+	if (entry->key == NULL)
+		return JSONBD_ERR_NOMEM;
+
+	memcpy(entry->key, key, keylen);
+	entry->key[keylen] = '\0';
+	entry->keylen = keylen;
+
+	if (id > dict->maxid)
+		dict->maxid = id;
+
+	return JSONBD_OK;
+}
+
+uint32_t
+jsonbd_dict_maxid(const jsonbd_dict *dict)
+{
+	return dict->maxid;
+}
+
+static uint32_t
+read_uint32(const char *ptr)
+{
+	uint32_t	val;
+
+	memcpy(&val, ptr, sizeof(val));
+	return val;
+}
+
+static uint16_t
+read_uint16(const char *ptr)
+{
+	uint16_t	val;
+
+	memcpy(&val, ptr, sizeof(val));
+	return val;
+}
+
+static int
+out_append(outbuf *out, const char *data, size_t len)
+{
+	if (out->len + len + 1 > out->cap)
+	{
+		size_t		newcap = out->cap ? out->cap : 256;
+		char	   *newdata;
+
+		while (out->len + len + 1 > newcap)
+			newcap *= 2;
+
+		newdata = (char *) realloc(out->data, newcap);
+		if (newdata == NULL)
+			return 0;
+
+		out->data = newdata;
+		out->cap = newcap;
+	}
+
+	memcpy(out->data + out->len, data, len);
+	out->len += len;
+	out->data[out->len] = '\0';
+	return 1;
+}
+
+#define OUT(d, s, l) \
+	do { \
+		if (!out_append(&(d)->out, (s), (l))) \
+			return JSONBD_ERR_NOMEM; \
+	} while (0)
+
+/* Same escaping as escape_json in PostgreSQL */
+static jsonbd_result
+out_string(decoder *d, const char *str, size_t len)
+{
+	size_t		i;
+
+	OUT(d, "\"", 1);
+	for (i = 0; i < len; i++)
+	{
+		unsigned char c = (unsigned char) str[i];
+		char		esc[8];
+
+		switch (c)
+		{
+			case '\b': OUT(d, "\\b", 2); break;
+			case '\f': OUT(d, "\\f", 2); break;
+			case '\n': OUT(d, "\\n", 2); break;
+			case '\r': OUT(d, "\\r", 2); break;
+			case '\t': OUT(d, "\\t", 2); break;
+			case '"': OUT(d, "\\\"", 2); break;
+			case '\\': OUT(d, "\\\\", 2); break;
+			default:
+				if (c < ' ')
+				{
+					snprintf(esc, sizeof(esc), "\\u%04x", (int) c);
+					OUT(d, esc, 6);
+				}
+				else
+					OUT(d, (const char *) &str[i], 1);
+		}
+	}
+	OUT(d, "\"", 1);
+
+	return JSONBD_OK;
+}
+
+/* Print numeric like get_str_from_var in PostgreSQL */
+static jsonbd_result
+out_numeric(decoder *d, const char *ptr)
+{
+	const char *data;
+	size_t		len;
+	uint16_t	header;
+	int			weight,
+				dscale,
+				neg,
+				ndigits,
+				i,
+				pos;
+	char		buf[8];
+
+	if ((unsigned char) ptr[0] & 0x01)
+	{
+		len = ((unsigned char) ptr[0] >> 1) - 1;
+		data = ptr + 1;
+	}
+	else
+	{
+		len = (read_uint32(ptr) >> 2) - VARHDRSZ;
+		data = ptr + VARHDRSZ;
+	}
+
+	if (len < sizeof(uint16_t) || data + len > d->end)
+		return JSONBD_ERR_FORMAT;
+
+	header = read_uint16(data);
+	if ((header & NUMERIC_SIGN_MASK) == NUMERIC_NAN)
+	{
+		OUT(d, "NaN", 3);
+		return JSONBD_OK;
+	}
+	else if ((header & NUMERIC_SIGN_MASK) == NUMERIC_SHORT)
+	{
+		neg = (header & NUMERIC_SHORT_SIGN_MASK) != 0;
+		dscale = (header & NUMERIC_SHORT_DSCALE_MASK) >> NUMERIC_SHORT_DSCALE_SHIFT;
+		weight = (header & NUMERIC_SHORT_WEIGHT_SIGN_MASK ?
+				  ~NUMERIC_SHORT_WEIGHT_MASK : 0) |
+				 (header & NUMERIC_SHORT_WEIGHT_MASK);
+		data += sizeof(uint16_t);
+		len -= sizeof(uint16_t);
+	}
+	else
+	{
+		if (len < 2 * sizeof(uint16_t))
+			return JSONBD_ERR_FORMAT;
+
+		neg = (header & NUMERIC_SIGN_MASK) == NUMERIC_NEG;
+		dscale = header & NUMERIC_DSCALE_MASK;
+		weight = (int16_t) read_uint16(data + sizeof(uint16_t));
+		data += 2 * sizeof(uint16_t);
+		len -= 2 * sizeof(uint16_t);
+	}
+	ndigits = len / sizeof(uint16_t);
+
+	if (neg)
+		OUT(d, "-", 1);
+
+	if (weight < 0)
+		OUT(d, "0", 1);
+
+	for (pos = 0; pos <= weight; pos++)
+	{
+		int		dig = pos < ndigits ? read_uint16(data + pos * 2) : 0;
+		int		n = snprintf(buf, sizeof(buf), pos == 0 ? "%d" : "%04d", dig);
+
+		OUT(d, buf, n);
+	}
+
+	if (dscale > 0)
+	{
+		OUT(d, ".", 1);
+		for (i = 0, pos = weight + 1; i < dscale; i += 4, pos++)
+		{
+			int		dig = (pos >= 0 && pos < ndigits) ?
+							read_uint16(data + pos * 2) : 0;
+
+			snprintf(buf, sizeof(buf), "%04d", dig);
+			OUT(d, buf, dscale - i < 4 ? dscale - i : 4);
+		}
+	}
+
+	return JSONBD_OK;
+}
+
+static uint32_t
+entry_offset(const char *children, int index)
+{
+	uint32_t	offset = 0;
+	int			i;
+
+	for (i = index - 1; i >= 0; i--)
+	{
+		uint32_t	entry = read_uint32(children + i * 4);
+
+		offset += entry & JENTRY_OFFLENMASK;
+		if (entry & JENTRY_HAS_OFF)
+			break;
+	}
+
+	return offset;
+}
+
+static uint32_t
+entry_length(const char *children, int index, uint32_t offset)
+{
+	uint32_t	entry = read_uint32(children + index * 4);
+
+	if (entry & JENTRY_HAS_OFF)
+		return (entry & JENTRY_OFFLENMASK) - offset;
+
+	return entry & JENTRY_OFFLENMASK;
+}
+
+static jsonbd_result
+decode_value(decoder *d, const char *children, const char *base, int index)
+{
+	uint32_t	entry,
+				offset,
+				len;
+
+	if (index < 0)
+	{
+		OUT(d, "null", 4);
+		return JSONBD_OK;
+	}
+
+	entry = read_uint32(children + index * 4);
+	offset = entry_offset(children, index);
+	len = entry_length(children, index, offset);
+
+	if (base + offset + len > d->end)
+		return JSONBD_ERR_FORMAT;
+
+	switch (entry & JENTRY_TYPEMASK)
+	{
+		case JENTRY_ISSTRING:
+			return out_string(d, base + offset, len);
+		case JENTRY_ISNUMERIC:
+			return out_numeric(d, base + INTALIGN(offset));
+		case JENTRY_ISBOOL_FALSE:
+			OUT(d, "false", 5);
+			return JSONBD_OK;
+		case JENTRY_ISBOOL_TRUE:
+			OUT(d, "true", 4);
+			return JSONBD_OK;
+		case JENTRY_ISNULL:
+			OUT(d, "null", 4);
+			return JSONBD_OK;
+		case JENTRY_ISCONTAINER:
+			return decode_container(d, base + INTALIGN(offset));
+		default:
+			return JSONBD_ERR_FORMAT;
+	}
+}
+
+/* jsonb sorts keys by length first, then bytewise */
+static int
+pair_cmp(const void *a, const void *b)
+{
+	const pair *pa = (const pair *) a;
+	const pair *pb = (const pair *) b;
+
+	if (pa->keylen != pb->keylen)
+		return pa->keylen > pb->keylen ? 1 : -1;
+
+	return memcmp(pa->key, pb->key, pa->keylen);
+}
+
+static jsonbd_result
+lookup_key(decoder *d, uint32_t id, pair *p)
+{
+	if (id >= d->dict->size || d->dict->entries[id].key == NULL)
+		return JSONBD_ERR_NOKEY;
+
+	p->key = d->dict->entries[id].key;
+	p->keylen = d->dict->entries[id].keylen;
+	return JSONBD_OK;
+}
+
+static jsonbd_result
+decode_key(decoder *d, const char *children, const char *base, int index,
+		   pair *p)
+{
+	uint32_t	offset = entry_offset(children, index);
+	uint32_t	len = entry_length(children, index, offset);
+	unsigned char idbuf[JSONBD_VARBYTE_MAXLEN] = {0};
+	uint32_t	id;
+
+	if (base + offset + len > d->end)
+		return JSONBD_ERR_FORMAT;
+
+	if (!d->compressed)
+	{
+		p->key = base + offset;
+		p->keylen = len;
+		return JSONBD_OK;
+	}
+
+	/* only references to subdocuments and templates have empty keys */
+	if (len == 0)
+		return JSONBD_ERR_SUBDOC;
+
+	if (len > JSONBD_VARBYTE_MAXLEN)
+		return JSONBD_ERR_FORMAT;
+
+	memcpy(idbuf, base + offset, len);
+	id = decode_varbyte(idbuf);
+	return lookup_key(d, id, p);
+}
+
+/*
+ * All key ids of the object are in the key at 'first', see jsonbd_codec.h.
+ * Pairs before it have no ids.
+ */
+static jsonbd_result
+decode_stream_keys(decoder *d, const char *children, const char *base,
+				   uint32_t first, uint32_t count, pair *pairs)
+{
+	uint32_t	offset = entry_offset(children, first);
+	uint32_t	len = entry_length(children, first, offset);
+	uint32_t   *ids,
+				i;
+	jsonbd_result res = JSONBD_OK;
+
+	if (base + offset + len > d->end)
+		return JSONBD_ERR_FORMAT;
+
+	ids = (uint32_t *) malloc(sizeof(uint32_t) * count);
+	if (ids == NULL)
+		return JSONBD_ERR_NOMEM;
+
+	if (decode_stream((const unsigned char *) base + offset, len, ids,
+					  count - first) != 0)
+		res = JSONBD_ERR_FORMAT;
+
+	for (i = 0; i < count - first && res == JSONBD_OK; i++)
+	{
+		res = lookup_key(d, ids[i], &pairs[i]);
+		pairs[i].index = count + first + i;
+	}
+
+	free(ids);
+	return res;
+}
+
+static int
+is_stream(decoder *d, const char *children, const char *base, uint32_t index)
+{
+	uint32_t	offset = entry_offset(children, index);
+	uint32_t	len = entry_length(children, index, offset);
+
+	return d->compressed && len > 0 && base + offset < d->end &&
+		(unsigned char) base[offset] == JSONBD_STREAM_MARKER;
+}
+
+/*
+ * The first pair with an empty key and a string value keeps the list of
+ * ids of keys with null values, see elide_nulls in jsonbd.c. Other first
+ * pairs with empty keys are references to subdocuments and templates.
+ */
+static jsonbd_result
+get_null_keys(decoder *d, const char *children, const char *base,
+			  uint32_t count, const unsigned char **list, uint32_t *len)
+{
+	uint32_t	entry = read_uint32(children + count * 4);
+	uint32_t	offset = entry_offset(children, count);
+
+	*len = entry_length(children, count, offset);
+	if ((entry & JENTRY_TYPEMASK) != JENTRY_ISSTRING ||
+		(count == 1 && *len == SUBDOC_HASH_LEN))
+		return JSONBD_ERR_SUBDOC;
+
+	if (base + offset + *len > d->end)
+		return JSONBD_ERR_FORMAT;
+
+	*list = (const unsigned char *) base + offset;
+	return JSONBD_OK;
+}
+
+static jsonbd_result
+decode_null_keys(decoder *d, const unsigned char *list, uint32_t len,
+				 int n, pair *pairs)
+{
+	uint32_t   *ids;
+	int			i;
+	jsonbd_result res = JSONBD_OK;
+
+	ids = (uint32_t *) malloc(sizeof(uint32_t) * n);
+	if (ids == NULL)
+		return JSONBD_ERR_NOMEM;
+
+	decode_varbyte_list(list, len, ids);
+	for (i = 0; i < n && res == JSONBD_OK; i++)
+	{
+		res = lookup_key(d, ids[i], &pairs[i]);
+		pairs[i].index = -1;
+	}
+
+	free(ids);
+	return res;
+}
+
+/*
+ * The only key of the object could be the path of key ids of a collapsed
+ * chain of objects, see collapse_path in jsonbd.c. Returns the number of
+ * ids in the key.
+ */
+static int
+path_length(decoder *d, const char *children, const char *base,
+			uint32_t count)
+{
+	uint32_t	offset = entry_offset(children, 0);
+	uint32_t	len = entry_length(children, 0, offset);
+
+	if (!d->compressed || count != 1 || len == 0 ||
+		base + offset + len > d->end ||
+		(unsigned char) base[offset] == JSONBD_STREAM_MARKER)
+		return 0;
+
+	return decode_varbyte_list((const unsigned char *) base + offset, len,
+							   NULL);
+}
+
+static jsonbd_result
+decode_path(decoder *d, const char *children, const char *base, int n)
+{
+	uint32_t	offset = entry_offset(children, 0);
+	uint32_t   *ids;
+	pair		p;
+	int			i;
+	jsonbd_result res = JSONBD_OK;
+
+	ids = (uint32_t *) malloc(sizeof(uint32_t) * n);
+	if (ids == NULL)
+		return JSONBD_ERR_NOMEM;
+
+	decode_varbyte_list((const unsigned char *) base + offset,
+						entry_length(children, 0, offset), ids);
+
+	for (i = 0; i < n && res == JSONBD_OK; i++)
+	{
+		if ((res = lookup_key(d, ids[i], &p)) != JSONBD_OK)
+			break;
+		else if (!out_append(&d->out, "{", 1))
+			res = JSONBD_ERR_NOMEM;
+		else if ((res = out_string(d, p.key, p.keylen)) != JSONBD_OK)
+			break;
+		else if (!out_append(&d->out, ": ", 2))
+			res = JSONBD_ERR_NOMEM;
+	}
+
+	free(ids);
+	if (res != JSONBD_OK)
+		return res;
+
+	if ((res = decode_value(d, children, base, 1)) != JSONBD_OK)
+		return res;
+
+	for (i = 0; i < n; i++)
+		OUT(d, "}", 1);
+
+	return JSONBD_OK;
+}
+
+static jsonbd_result
+decode_container(decoder *d, const char *ptr)
+{
+	uint32_t		header,
+					count,
+					i;
+	const char	   *children,
+				   *base;
+	jsonbd_result	res = JSONBD_OK;
+
+	if (ptr + 4 > d->end)
+		return JSONBD_ERR_FORMAT;
+
+	header = read_uint32(ptr);
+	count = header & JB_CMASK;
+	children = ptr + 4;
+
+	if (header & JB_FOBJECT)
+	{
+		pair		   *pairs;
+		const unsigned char *list = NULL;
+		uint32_t		listlen = 0,
+						first = 0,
+						npairs = count;
+		int				nnulls = 0,
+						npath;
+
+		base = children + count * 2 * 4;
+		if (base > d->end)
+			return JSONBD_ERR_FORMAT;
+
+		if ((npath = path_length(d, children, base, count)) > 1)
+			return decode_path(d, children, base, npath);
+
+		/* keys of null values are elided to the first pair */
+		if (d->compressed && count > 0 &&
+			entry_length(children, 0, entry_offset(children, 0)) == 0)
+		{
+			res = get_null_keys(d, children, base, count, &list, &listlen);
+			if (res != JSONBD_OK)
+				return res;
+
+			nnulls = decode_varbyte_list(list, listlen, NULL);
+			if (nnulls < 0)
+				return JSONBD_ERR_FORMAT;
+
+			first = 1;
+			npairs = count - 1 + nnulls;
+		}
+
+		pairs = (pair *) malloc(sizeof(pair) * (npairs ? npairs : 1));
+		if (pairs == NULL)
+			return JSONBD_ERR_NOMEM;
+
+		if (count > first && is_stream(d, children, base, first))
+			res = decode_stream_keys(d, children, base, first, count, pairs);
+		else
+		{
+			for (i = first; i < count && res == JSONBD_OK; i++)
+			{
+				res = decode_key(d, children, base, i, &pairs[i - first]);
+				pairs[i - first].index = count + i;
+			}
+		}
+
+		if (res == JSONBD_OK && nnulls > 0)
+			res = decode_null_keys(d, list, listlen, nnulls,
+								   pairs + count - first);
+
+		if (res == JSONBD_OK)
+		{
+			if (d->compressed)
+				qsort(pairs, npairs, sizeof(pair), pair_cmp);
+
+			if (!out_append(&d->out, "{", 1))
+				res = JSONBD_ERR_NOMEM;
+
+			for (i = 0; i < npairs && res == JSONBD_OK; i++)
+			{
+				if (i > 0 && !out_append(&d->out, ", ", 2))
+					res = JSONBD_ERR_NOMEM;
+				else if ((res = out_string(d, pairs[i].key, pairs[i].keylen)) != JSONBD_OK)
+					break;
+				else if (!out_append(&d->out, ": ", 2))
+					res = JSONBD_ERR_NOMEM;
+				else
+					res = decode_value(d, children, base, pairs[i].index);
+			}
+
+			if (res == JSONBD_OK && !out_append(&d->out, "}", 1))
+				res = JSONBD_ERR_NOMEM;
+		}
+
+		free(pairs);
+		return res;
+	}
+	else if (header & JB_FARRAY)
+	{
+		base = children + count * 4;
+		if (base > d->end)
+			return JSONBD_ERR_FORMAT;
+
+		/* raw scalar is stored as one element array */
+		if (header & JB_FSCALAR)
+			return count == 1 ? decode_value(d, children, base, 0) :
+								JSONBD_ERR_FORMAT;
+
+		OUT(d, "[", 1);
+		for (i = 0; i < count; i++)
+		{
+			if (i > 0)
+				OUT(d, ", ", 2);
+
+			if ((res = decode_value(d, children, base, i)) != JSONBD_OK)
+				return res;
+		}
+		OUT(d, "]", 1);
+		return JSONBD_OK;
+	}
+
+	return JSONBD_ERR_FORMAT;
+}
+
+jsonbd_result
+jsonbd_decode(const jsonbd_dict *dict, const char *data, size_t len,
+			  char **json, size_t *jsonlen)
+{
+	decoder			d;
+	uint32_t		header;
+	size_t			hdrsz;
+	jsonbd_result	res;
+
+	if (len < VARHDRSZ)
+		return JSONBD_ERR_FORMAT;
+
+	/* exported datums have 4 bytes varlena header, compressed or not */
+	header = read_uint32(data);
+	if ((header & 0x03) == 0x02)
+	{
+		hdrsz = VARHDRSZ_CUSTOM_COMPRESSED;
+		d.compressed = 1;
+	}
+	else if ((header & 0x03) == 0x00)
+	{
+		hdrsz = VARHDRSZ;
+		d.compressed = 0;
+	}
+	else
+		return JSONBD_ERR_FORMAT;
+
+	if (len < hdrsz || (header >> 2) != len)
+		return JSONBD_ERR_FORMAT;
+
+	d.dict = dict;
+	d.start = data;
+	d.end = data + len;
+	d.out.data = NULL;
+	d.out.len = d.out.cap = 0;
+
+	res = decode_container(&d, data + hdrsz);
+	if (res != JSONBD_OK)
+	{
+		free(d.out.data);
+		return res;
+	}
+
+	*json = d.out.data;
+	*jsonlen = d.out.len;
+	return JSONBD_OK;
+}
@@ -0,0 +1,41 @@
+#ifndef JSONBD_CLIENT_H
+#define JSONBD_CLIENT_H
+
+/*
+ * Client side decoder of jsonbd compressed data.
+ *
+ * Compressed datums are fetched by jsonbd_export(), the dictionary of their
+ * compression options by jsonbd_export_dictionary(acoid, since), which
+ * returns only keys with ids greater than 'since', so the dictionary can be
+ * updated incrementally using jsonbd_dict_maxid().
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct jsonbd_dict jsonbd_dict;
+
+typedef enum
+{
+	JSONBD_OK = 0,
+	JSONBD_ERR_NOMEM,
+	JSONBD_ERR_FORMAT,		/* corrupted or unsupported data */
+	JSONBD_ERR_NOKEY,		/* key id is not in the dictionary */
+	JSONBD_ERR_SUBDOC		/* reference to a subdocument or a template */
+} jsonbd_result;
+
+extern jsonbd_dict *jsonbd_dict_create(void);
+extern void jsonbd_dict_free(jsonbd_dict *dict);
+extern jsonbd_result jsonbd_dict_add(jsonbd_dict *dict, uint32_t id,
+									 const char *key, size_t keylen);
+extern uint32_t jsonbd_dict_maxid(const jsonbd_dict *dict);
+
+/*
+ * Decode exported datum to JSON text. On success *json is malloc'd
+ * and should be freed by the caller. The dictionary is not changed, so
+ * it can be used by several threads at once.
+ */
+extern jsonbd_result jsonbd_decode(const jsonbd_dict *dict, const char *data,
+								   size_t len, char **json, size_t *jsonlen);
+
+#endif
@@ -0,0 +1,166 @@
+/*
+ * Command line decoder of exported datums, used by tests.
+ *
+ *	jsonbd_decode DICTIONARY < DATUMS
+ *
+ * Each line of DICTIONARY is a key id and the key in hex, like
+ *	SELECT id, encode(convert_to(key, 'UTF8'), 'hex')
+ *		FROM jsonbd_export_dictionary(<acoid>)
+ * Each line of the input is an exported datum in hex, like
+ *	SELECT encode(jsonbd_export(a), 'hex') FROM t
+ * Decoded JSON is printed line by line, "error <code>" for datums that
+ * could not be decoded.
+ */
+
+#include "jsonbd_client.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int
+hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* Decode hex string in place, returns the length or -1 on bad input */
+static long
+hex_decode(char *str)
+{
+	size_t	len = strcspn(str, "\r\n"),
+			i;
+
+	if (len % 2 != 0)
+		return -1;
+
+	for (i = 0; i < len; i += 2)
+	{
+		int		hi = hex_value(str[i]),
+				lo = hex_value(str[i + 1]);
+
+		if (hi < 0 || lo < 0)
+			return -1;
+		str[i / 2] = (char) (hi << 4 | lo);
+	}
+
+	return (long) (len / 2);
+}
+
+/* Read a whole line, *buf is reallocated if needed */
+static long
+read_line(FILE *f, char **buf, size_t *cap)
+{
+	size_t	len = 0;
+
+	for (;;)
+	{
+		if (*cap - len < 2)
+		{
+			*cap = *cap ? *cap * 2 : 1024;
+			*buf = realloc(*buf, *cap);
+			if (*buf == NULL)
+				return -1;
+		}
+
+		if (fgets(*buf + len, (int) (*cap - len), f) == NULL)
+			return len > 0 ? (long) len : -1;
+
+		len += strlen(*buf + len);
+		if ((*buf)[len - 1] == '\n')
+			return (long) len;
+	}
+}
+
+static int
+load_dictionary(jsonbd_dict *dict, const char *path)
+{
+	FILE	   *f = fopen(path, "r");
+	char	   *buf = NULL;
+	size_t		cap = 0;
+	int			res = 0;
+
+	if (f == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+
+	while (read_line(f, &buf, &cap) >= 0)
+	{
+		char		   *key;
+		unsigned long	id = strtoul(buf, &key, 10);
+		long			keylen;
+
+		if (*key != ' ' && *key != '\t')
+		{
+			res = -1;
+			break;
+		}
+
+		keylen = hex_decode(++key);
+		if (keylen < 0 ||
+			jsonbd_dict_add(dict, (uint32_t) id, key, (size_t) keylen) != JSONBD_OK)
+		{
+			res = -1;
+			break;
+		}
+	}
+
+	if (res != 0)
+		fprintf(stderr, "%s: bad dictionary line: %s", path, buf);
+
+	free(buf);
+	fclose(f);
+	return res;
+}
+
+int
+main(int argc, char **argv)
+{
+	jsonbd_dict	   *dict;
+	char		   *buf = NULL;
+	size_t			cap = 0;
+
+	if (argc != 2)
+	{
+		fprintf(stderr, "usage: %s DICTIONARY < DATUMS\n", argv[0]);
+		return 2;
+	}
+
+	dict = jsonbd_dict_create();
+	if (dict == NULL || load_dictionary(dict, argv[1]) != 0)
+		return 1;
+
+	while (read_line(stdin, &buf, &cap) >= 0)
+	{
+		long			len = hex_decode(buf);
+		char		   *json;
+		size_t			jsonlen;
+		jsonbd_result	res;
+
+		if (len < 0)
+			res = JSONBD_ERR_FORMAT;
+		else
+			res = jsonbd_decode(dict, buf, (size_t) len, &json, &jsonlen);
+
+		if (res == JSONBD_OK)
+		{
+			fwrite(json, 1, jsonlen, stdout);
+			free(json);
+			putchar('\n');
+		}
+		else
+			printf("error %d\n", (int) res);
+	}
+
+	free(buf);
+	jsonbd_dict_free(dict);
+	return 0;
+}
@@ -2,14 +2,190 @@ CREATE OR REPLACE FUNCTION jsonbd_compression_handler(INTERNAL)
 RETURNS COMPRESSION_AM_HANDLER AS 'MODULE_PATHNAME', 'jsonbd_compression_handler'
 LANGUAGE C STRICT;
 
+/*
+ * keys are searched by their 64-bit hashes, the key itself is checked on
+ * the found tuple, so lookups don't compare texts with collations.
+ *
+ * Keys are not unique: workers add a key under an exclusive lock of the
+ * keys index, but a key added concurrently by a worker and by a bulk load
+ * gets two ids (see jsonbd_bulk.c). Both ids are used by data, so both
+ * pairs are kept; ids are unique, and lookups by key take any of them.
+ *
+ * Each dictionary is stored in its own partition (segment) created by
+ * workers on the first insert, so a dictionary has its own small indexes
+ * and can be dropped with the compression options. Dictionaries are stored
+ * in the default partition when the segment could not be created without
+ * waiting for locks.
+ */
 CREATE TABLE jsonbd_dictionary(
 	acoid	OID NOT NULL,
 	id		INT4 NOT NULL,
-	key		TEXT NOT NULL
-);
+	key		TEXT NOT NULL,
+	keyhash	INT8 NOT NULL
+) PARTITION BY LIST (acoid);
 
 CREATE UNIQUE INDEX jsonbd_dict_on_id ON jsonbd_dictionary(acoid, id);
-CREATE UNIQUE INDEX jsonbd_dict_on_key ON jsonbd_dictionary(acoid, key);
+CREATE INDEX jsonbd_dict_on_key ON jsonbd_dictionary(acoid, keyhash);
+CREATE TABLE jsonbd_dictionary_default PARTITION OF jsonbd_dictionary DEFAULT;
+
+/*
+ * named dictionaries and dictionaries inherited from other compression
+ * options, dictid is acoid of the options that created the dictionary
+ */
+CREATE TABLE jsonbd_dictionaries(
+	dictid	OID NOT NULL PRIMARY KEY,
+	parent	OID NOT NULL DEFAULT 0,
+	maxid	INT4 NOT NULL DEFAULT 0,
+	name	TEXT UNIQUE
+);
+
+/* compression options attached to named dictionaries */
+CREATE TABLE jsonbd_attachments(
+	acoid	OID NOT NULL PRIMARY KEY,
+	dictid	OID NOT NULL
+);
+
+/*
+ * key statistics of jsonbd columns collected by ANALYZE: average number
+ * of occurrences of the key per row and the number of its distinct values
+ * in the sample
+ */
+CREATE TABLE jsonbd_statistics(
+	relid		OID NOT NULL,
+	attnum		INT2 NOT NULL,
+	acoid		OID NOT NULL,
+	key			TEXT NOT NULL,
+	frequency	FLOAT4 NOT NULL,
+	ndistinct	FLOAT4 NOT NULL,
+	PRIMARY KEY (relid, attnum, key)
+);
+
+/*
+ * subdocuments deduplicated by compression options with 'dedup' option,
+ * addressed by SHA-256 of their binary representation and shared by all
+ * compression options
+ */
+CREATE TABLE jsonbd_subdocs(
+	hash	BYTEA NOT NULL PRIMARY KEY,
+	doc		JSONB NOT NULL
+);
+
+/*
+ * templates of documents of compression options with 'templates' option,
+ * objects are saved as differences from templates
+ */
+CREATE TABLE jsonbd_templates(
+	acoid	OID NOT NULL,
+	id		INT4 NOT NULL,
+	doc		JSONB NOT NULL,
+	PRIMARY KEY (acoid, id)
+);
 
 CREATE ACCESS METHOD jsonbd
 	TYPE COMPRESSION HANDLER jsonbd_compression_handler;
+
+/*
+ * Export and import of compressed data without decompression.
+ * Compressed datums are exported with jsonbd_export and the dictionary
+ * of their compression options with jsonbd_export_dictionary. On restore
+ * the dictionary is loaded by jsonbd_import_dictionary, which creates
+ * translation of key ids for the session, then jsonbd_import translates
+ * ids of compressed datums to ids of the target compression options.
+ */
+CREATE FUNCTION jsonbd_export(JSONB)
+RETURNS BYTEA AS 'MODULE_PATHNAME', 'jsonbd_export'
+LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+/*
+ * 'since' allows to get incremental snapshots of the dictionary,
+ * only keys with greater ids are returned
+ */
+CREATE FUNCTION jsonbd_export_dictionary(acoid OID, since INT4 DEFAULT 0)
+RETURNS TABLE(id INT4, key TEXT) AS $$
+	WITH RECURSIVE chain(dictid, maxid) AS (
+		SELECT COALESCE((SELECT a.dictid FROM @extschema@.jsonbd_attachments a
+						 WHERE a.acoid = $1), $1), 2147483647
+		UNION ALL
+		SELECT d.parent, LEAST(c.maxid, d.maxid)
+		FROM chain c JOIN @extschema@.jsonbd_dictionaries d ON d.dictid = c.dictid
+		WHERE d.parent <> 0
+	)
+	SELECT d.id, d.key
+	FROM chain c JOIN @extschema@.jsonbd_dictionary d
+		ON d.acoid = c.dictid AND d.id <= c.maxid AND d.id > $2
+	ORDER BY d.id
+$$ LANGUAGE SQL STABLE PARALLEL SAFE;
+
+CREATE FUNCTION jsonbd_import_dictionary(srcoid OID, acoid OID, ids INT4[], keys TEXT[])
+RETURNS INT4 AS 'MODULE_PATHNAME', 'jsonbd_import_dictionary'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+CREATE FUNCTION jsonbd_import(BYTEA, acoid OID)
+RETURNS JSONB AS 'MODULE_PATHNAME', 'jsonbd_import'
+LANGUAGE C STRICT VOLATILE PARALLEL RESTRICTED;
+
+/* imported datums are trusted after validation, keep it to privileged roles */
+REVOKE ALL ON FUNCTION jsonbd_import_dictionary(OID, OID, INT4[], TEXT[]) FROM PUBLIC;
+REVOKE ALL ON FUNCTION jsonbd_import(BYTEA, OID) FROM PUBLIC;
+
+/*
+ * Write the dictionary of compression options to an immutable file mapped
+ * by backends, returns the number of frozen keys
+ */
+CREATE FUNCTION jsonbd_freeze(acoid OID)
+RETURNS INT4 AS 'MODULE_PATHNAME', 'jsonbd_freeze'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+REVOKE ALL ON FUNCTION jsonbd_freeze(OID) FROM PUBLIC;
+
+/*
+ * Compress and decompress the samples with compression options, returns
+ * time spent in each stage
+ */
+CREATE FUNCTION jsonbd_bench(samples JSONB[], iterations INT4, acoid OID)
+RETURNS TABLE(stage TEXT, total_ms FLOAT8, avg_us FLOAT8)
+AS 'MODULE_PATHNAME', 'jsonbd_bench'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+REVOKE ALL ON FUNCTION jsonbd_bench(JSONB[], INT4, OID) FROM PUBLIC;
+
+/*
+ * Add the template to compression options, returns its id. Compression
+ * options have at most 16 templates, which never change.
+ */
+CREATE FUNCTION jsonbd_add_template(acoid OID, doc JSONB)
+RETURNS INT4 AS 'MODULE_PATHNAME', 'jsonbd_add_template'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+/*
+ * Build a template from sample documents and add it to compression options.
+ * The template contains top-level pairs present in at least half
+ * of the samples, with the most frequent value of each key.
+ */
+CREATE FUNCTION jsonbd_learn_template(acoid OID, samples JSONB[])
+RETURNS INT4 AS $$
+	SELECT @extschema@.jsonbd_add_template($1,
+		COALESCE(pg_catalog.jsonb_object_agg(t.key, t.value), '{}'))
+	FROM (
+		SELECT DISTINCT ON (e.key) e.key, e.value, count(*) AS c
+		FROM pg_catalog.unnest($2) s(doc),
+			 pg_catalog.jsonb_each(CASE WHEN pg_catalog.jsonb_typeof(s.doc) = 'object'
+									THEN s.doc ELSE '{}' END) e
+		GROUP BY e.key, e.value
+		ORDER BY e.key, count(*) DESC
+	) t
+	WHERE t.c * 2 >= pg_catalog.array_length($2, 1)
+$$ LANGUAGE SQL STRICT VOLATILE PARALLEL UNSAFE;
+
+/*
+ * Remove subdocuments that are not referenced by rows of jsonb columns,
+ * returns the number of removed ones. All tables with jsonb columns are locked
+ * against writes until the end of the transaction. Rows deleted but still
+ * visible to older transactions are not checked.
+ */
+CREATE FUNCTION jsonbd_gc_subdocs()
+RETURNS INT8 AS 'MODULE_PATHNAME', 'jsonbd_gc_subdocs'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+REVOKE ALL ON FUNCTION jsonbd_gc_subdocs() FROM PUBLIC;
+
+/* templates change how columns are stored, the owner of the table adds them */
+REVOKE ALL ON FUNCTION jsonbd_add_template(OID, JSONB) FROM PUBLIC;
+REVOKE ALL ON FUNCTION jsonbd_learn_template(OID, JSONB[]) FROM PUBLIC;
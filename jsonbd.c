@@ -1,30 +1,48 @@
 #include "jsonbd.h"
+#include "jsonbd_codec.h"
 #include "jsonbd_utils.h"
 
 #include "postgres.h"
 #include "fmgr.h"
 
 #include "access/cmapi.h"
+#include "access/hash.h"
 #include "access/htup_details.h"
 #include "access/sysattr.h"
+#include "access/tuptoaster.h"
 #include "access/xact.h"
 #include "catalog/indexing.h"
 #include "catalog/pg_attribute.h"
 #include "catalog/pg_type.h"
+#include "commands/defrem.h"
 #include "executor/spi.h"
+#include "funcapi.h"
 #include "miscadmin.h"
+#include "portability/instr_time.h"
+#include "storage/dsm.h"
 #include "storage/ipc.h"
+#include "storage/lmgr.h"
 #include "storage/shm_toc.h"
+#include "storage/spin.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/fmgroids.h"
 #include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
 #include "utils/jsonb.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/pg_crc.h"
+#include "utils/tuplestore.h"
 
 PG_MODULE_MAGIC;
 PG_FUNCTION_INFO_V1(jsonbd_compression_handler);
+PG_FUNCTION_INFO_V1(jsonbd_export);
+PG_FUNCTION_INFO_V1(jsonbd_import_dictionary);
+PG_FUNCTION_INFO_V1(jsonbd_import);
+PG_FUNCTION_INFO_V1(jsonbd_bench);
+PG_FUNCTION_INFO_V1(jsonbd_gc_subdocs);
 
 /* we use one buffer for whole transaction to avoid extra allocations */
 typedef struct
@@ -32,31 +50,126 @@ typedef struct
 	char	   *buf;		/* keys */
 	int			buflen;
 	uint32	   *idsbuf;		/* key ids */
+	char	  **keysbuf;	/* pointers to keys sent to workers */
+	uint32	   *lensbuf;	/* and their lengths */
+	int		   *posbuf;		/* and their positions in the object */
 	int			idslen;
 
 	MemoryContext	item_mcxt;
 } CompressionThroughBuffers;
 
+/* translation of key ids between dictionaries, used by import */
+typedef struct
+{
+	Oid		srcoid;		/* compression options of exported data */
+	Oid		acoid;		/* target compression options */
+} TranslationKey;
+
+typedef struct
+{
+	TranslationKey	key;
+	HTAB		   *ids;
+} TranslationEntry;
+
+typedef struct
+{
+	uint32	srcid;
+	uint32	id;
+} TranslatedId;
+
+/* options parsed by cminitstate */
+typedef struct
+{
+	Oid				 acoid;
+	jsonbd_options	*opts;
+} OptionsEntry;
+
+/* stages of compression and decompression measured by jsonbd_bench */
+typedef enum
+{
+	JSONBD_STAGE_ITERATE,
+	JSONBD_STAGE_KEYS,
+	JSONBD_STAGE_IPC,
+	JSONBD_STAGE_ENCODE,
+	JSONBD_STAGE_PACK,
+	JSONBD_STAGE_DECODE,
+	JSONBD_STAGE_LOOKUP,
+	JSONBD_STAGE_SORT,
+	JSONBD_STAGE_BUILD,
+	JSONBD_STAGE_COUNT
+} jsonbd_stage;
+
+static const char *stage_names[JSONBD_STAGE_COUNT] = {
+	"iterate", "keys", "ipc", "encode", "pack",
+	"decode", "lookup", "sort", "build"
+};
+
+/*
+ * Add time since the previous lap to the stage, only while jsonbd_bench
+ * is running
+ */
+#define BENCH_LAP(stage) \
+	do { \
+		if (bench_timings) \
+		{ \
+			instr_time	now; \
+			INSTR_TIME_SET_CURRENT(now); \
+			INSTR_TIME_ACCUM_DIFF(bench_timings[(stage)], now, bench_lap); \
+			bench_lap = now; \
+		} \
+	} while (0)
+
+/* callback called for every object when a jsonb tree is built */
+typedef void (*object_callback) (JsonbValue *obj, void *arg);
+
+/* encoded keys are never empty, see jsonbd_subdocs.c */
+#define IS_SUBDOC_REF(obj) \
+	((obj)->val.object.nPairs == 1 && \
+	 (obj)->val.object.pairs[0].key.val.string.len == 0 && \
+	 (obj)->val.object.pairs[0].value.type == jbvString && \
+	 (obj)->val.object.pairs[0].value.val.string.len == JSONBD_SUBDOC_HASH_LEN)
+
+/* keys of null values elided from the object, see elide_nulls */
+#define HAS_NULL_KEYS(obj) \
+	((obj)->val.object.nPairs >= 1 && \
+	 (obj)->val.object.pairs[0].key.val.string.len == 0 && \
+	 (obj)->val.object.pairs[0].value.type == jbvString)
+
+/* difference from a template, see jsonbd_templates.c */
+#define IS_TEMPLATE_DELTA(obj) \
+	((obj)->val.object.nPairs >= 1 && \
+	 (obj)->val.object.pairs[0].key.val.string.len == 0 && \
+	 (obj)->val.object.pairs[0].value.type == jbvArray)
+
 /* local */
 static MemoryContext compression_mcxt = NULL;
 static CompressionThroughBuffers *compression_buffers = NULL;
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 static shm_toc *toc = NULL;
+static HTAB *translations = NULL;
+static HTAB *options_cache = NULL;
+static int	spin_budget = JSONBD_MIN_SPINS;
+static dsm_segment *request_seg = NULL;
+static instr_time *bench_timings = NULL;
+static instr_time bench_lap;
 
 /* global */
 void   *workers_data = NULL;
 int		jsonbd_nworkers = -1;
 int		jsonbd_queue_size = 0;
+int		jsonbd_max_spins = 0;
 Size	jsonbd_total_queue_size = 0;
 
 static void init_memory_context(bool);
 static void memory_reset_callback(void *arg);
-static void encode_varbyte(uint32 val, unsigned char *ptr, int *len);
 static char *packJsonbValue(JsonbValue *val, int header_size, int *len);
 static void setup_guc_variables(void);
 static char *jsonbd_worker_get_keys(Oid cmoptoid, uint32 *ids, int nkeys, size_t *buflen);
-static void jsonbd_worker_get_key_ids(Oid cmoptoid, char *buf, int buflen, uint32 *idsbuf, int nkeys);
-static uint32 decode_varbyte(unsigned char *ptr);
+static void jsonbd_worker_get_key_ids(Oid cmoptoid, char **keys, uint32 *lens,
+									  uint32 *idsbuf, int nkeys);
+static void jsonbd_worker_attach(jsonbd_options *opts, bool attach);
+static void *jsonbd_cminitstate(Oid acoid, List *options);
+static bool container_is_valid(const char *ptr, Size len);
 
 static size_t
 jsonbd_get_queue_size(void)
@@ -165,12 +278,23 @@ jsonbd_shmem_startup_hook(void)
 	}
 	else toc = shm_toc_attach(JSONBD_SHM_MQ_MAGIC, workers_data);
 
+	jsonbd_shared_cache_startup();
+	if (jsonbd_nworkers)
+	{
+		jsonbd_frozen_startup();
+		jsonbd_bulk_startup();
+		jsonbd_subdocs_startup();
+	}
+
 	LWLockRelease(AddinShmemInitLock);
 }
 
 void
 _PG_init(void)
 {
+	StaticAssertStmt(sizeof(jsonbd_compressed_header) == VARHDRSZ_CUSTOM_COMPRESSED,
+					 "jsonbd compressed header differs from PostgreSQL one");
+
 	if (!process_shared_preload_libraries_in_progress)
 	{
 		ereport(ERROR,
@@ -179,6 +303,10 @@ _PG_init(void)
 	}
 
 	setup_guc_variables();
+	jsonbd_codec_init();
+	jsonbd_stats_init();
+	jsonbd_templates_init();
+	jsonbd_subdocs_init();
 
 	prev_shmem_startup_hook = shmem_startup_hook;
 	shmem_startup_hook = jsonbd_shmem_startup_hook;
@@ -188,6 +316,12 @@ _PG_init(void)
 		/* jsonbd workers and one lwlock for launcher */
 		RequestNamedLWLockTranche(JSONBD_LWLOCKS_TRANCHE, MAX_JSONBD_WORKERS + 1);
 		RequestAddinShmemSpace(jsonbd_shmem_size());
+		jsonbd_shared_cache_request();
+		jsonbd_frozen_request();
+		jsonbd_frozen_init();
+		jsonbd_bulk_request();
+		jsonbd_subdocs_request();
+		jsonbd_bulk_init();
 		jsonbd_register_launcher();
 	}
 	else elog(LOG, "jsonbd: workers are disabled");
@@ -209,6 +343,46 @@ setup_guc_variables(void)
 							NULL,
 							NULL);
 
+	DefineCustomIntVariable("jsonbd.shared_cache_size",
+							"Count of keys cached in shared memory",
+							"Keys from the cache are used by all backends, "
+							"including parallel workers, without asking workers",
+							&jsonbd_shared_cache_size,
+							65536,
+							0, /* if zero then no cache */
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("jsonbd.max_spins",
+							"Maximum count of spins while waiting for a worker response",
+							"The backend spins before sleeping on its latch, "
+							"the count of spins adapts to response times",
+							&jsonbd_max_spins,
+							1000,
+							0, /* if zero then no spinning */
+							1000000,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("jsonbd.bulk_load",
+							 "Resolve keys in the backend during bulk loads",
+							 "The dictionary is loaded by the backend, new keys "
+							 "are registered when the transaction commits",
+							 &jsonbd_bulk_load,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
 	DefineCustomIntVariable("jsonbd.queue_size",
 							"Size of queue used for communication with workers (kilobytes)",
 							NULL,
@@ -280,8 +454,105 @@ keys_callback(char *res, size_t reslen, void *arg)
 	return true;
 }
 
+static bool
+attach_callback(char *res, size_t reslen, void *arg)
+{
+	if (reslen != sizeof(Oid))
+		return false;
+
+	*((Oid *) arg) = *((Oid *) res);
+	return true;
+}
+
+/*
+ * Receive a response from a worker. Warm workers answer in microseconds,
+ * so we spin on the queue for a while before sleeping on the latch. If
+ * the response came while spinning, the budget grows, otherwise it halves,
+ * so slow requests (like ones creating new keys) don't waste CPU.
+ */
+static shm_mq_result
+jsonbd_receive(shm_mq_handle *mqh, Size *reslen, void **res)
+{
+	int				i;
+	int				budget = Min(spin_budget, jsonbd_max_spins);
+	shm_mq_result	resmq;
+
+	for (i = 0; i < budget; i++)
+	{
+		resmq = shm_mq_receive(mqh, reslen, res, true);
+		if (resmq != SHM_MQ_WOULD_BLOCK)
+		{
+			spin_budget = Min(spin_budget + spin_budget / 2 + 1,
+							  jsonbd_max_spins);
+			return resmq;
+		}
+
+		pg_spin_delay();
+	}
+
+	spin_budget = Max(spin_budget / 2, JSONBD_MIN_SPINS);
+	return shm_mq_receive(mqh, reslen, res, false);
+}
+
+/*
+ * Requests larger than the queue are copied to a DSM segment and only
+ * a reference to it is sent, so the message doesn't go through the ring
+ * in many pieces. The segment is kept for next requests and grows to
+ * the largest request seen by the backend.
+ */
+static shm_mq_iovec *
+jsonbd_prepare_request(Oid cmoptoid, shm_mq_iovec *iov, int *iov_len,
+					   jsonbd_large_message *msg)
+{
+	int				i;
+	Size			len = 0;
+	char		   *ptr;
+	shm_mq_iovec   *res;
+	static int		nkeys = 0;
+	static JsonbcCommand cmd = JSONBD_CMD_LARGE;
+
+	for (i = 0; i < *iov_len; i++)
+		len += iov[i].len;
+
+	if (len <= JSONBD_INLINE_MESSAGE_MAX)
+		return iov;
+
+	if (request_seg == NULL || dsm_segment_map_length(request_seg) < len)
+	{
+		if (request_seg)
+			dsm_detach(request_seg);
+
+		request_seg = dsm_create(Max(len, 2 * JSONBD_INLINE_MESSAGE_MAX), 0);
+		dsm_pin_mapping(request_seg);
+	}
+
+	ptr = dsm_segment_address(request_seg);
+	for (i = 0; i < *iov_len; i++)
+	{
+		memcpy(ptr, iov[i].data, iov[i].len);
+		ptr += iov[i].len;
+	}
+
+	msg->kind = JSONBD_MSG_LARGE;
+	msg->handle = dsm_segment_handle(request_seg);
+	msg->len = len;
+
+	res = (shm_mq_iovec *) palloc(sizeof(shm_mq_iovec) * 4);
+	res[0].data = (void *) &nkeys;
+	res[0].len = sizeof(nkeys);
+	res[1].data = (void *) iov[1].data;		/* cmoptoid */
+	res[1].len = sizeof(Oid);
+	res[2].data = (void *) &cmd;
+	res[2].len = sizeof(cmd);
+	res[3].data = (void *) msg;
+	res[3].len = sizeof(jsonbd_large_message);
+	*iov_len = 4;
+
+	return res;
+}
+
 static void
-jsonbd_communicate(shm_mq_iovec *iov, int iov_len,
+jsonbd_communicate(Oid cmoptoid, shm_mq_iovec *iov, int iov_len,
 		bool (*callback)(char *, size_t, void *), void *callback_arg)
 {
 	int					i,
@@ -298,10 +569,15 @@ jsonbd_communicate(shm_mq_iovec *iov, int iov_len,
 
 	char			   *res;
 	Size				reslen;
+	bool				attach_failed = false;
+	jsonbd_large_message msg;
 
 	if (jsonbd_nworkers <= 0)
 		elog(ERROR, "jsonbd workers are not available");
 
+	/* should be done before the worker is waiting for us */
+	iov = jsonbd_prepare_request(cmoptoid, iov, &iov_len, &msg);
+
 	hdr = shm_toc_lookup(toc, 0, false);
 
 begin:
@@ -309,12 +585,17 @@ begin:
 	 * find some not busy worker,
 	 * the backend can intercept a worker that just started by another
 	 * backend, that's ok
+	 *
+	 * Requests for the same dictionary go to the same preferred worker,
+	 * so caches of workers cover different dictionaries. Other workers
+	 * are used only if the preferred one is busy.
 	 */
 	while (true)
 	{
 		for (i = 0; i < hdr->workers_ready; i++)
 		{
-			bool locked;
+			bool	locked;
+			int		preferred;
 
 			wd = shm_toc_lookup(toc, i + 1, false);
 			if (wd->dboid != MyDatabaseId)
@@ -324,14 +605,16 @@ begin:
 			 * we found first worker for our database, next 'jsonbd_nworkers'
 			 * workers should be ours
 			 */
-			locked = LWLockConditionalAcquire(wd->lock, LW_EXCLUSIVE);
-			if (locked)
-				goto comm;
-
-			for (j = i; j < (i + jsonbd_nworkers); j++)
+			preferred = i + DatumGetUInt32(hash_uint32((uint32) cmoptoid)) %
+				jsonbd_nworkers;
+			for (j = 0; j < jsonbd_nworkers; j++)
 			{
-				wd = shm_toc_lookup(toc, j + 1, false);
+				int		k = i + (preferred - i + j) % jsonbd_nworkers;
+
+				if (k >= hdr->workers_ready)
+					continue;
 
+				wd = shm_toc_lookup(toc, k + 1, false);
 				if (wd->dboid != MyDatabaseId)
 					/* somehow not all workers started for this database, try next */
 					continue;
@@ -341,8 +624,14 @@ begin:
 					goto comm;
 			}
 
-			/* if none of the workers were free, we just wait on last one */
-			Assert(!locked);
+			/* if none of the workers were free, we wait on the preferred one */
+			if (preferred >= hdr->workers_ready)
+				preferred = i;
+
+			wd = shm_toc_lookup(toc, preferred + 1, false);
+			if (wd->dboid != MyDatabaseId)
+				wd = shm_toc_lookup(toc, i + 1, false);
+
 			LWLockAcquire(wd->lock, LW_EXCLUSIVE);
 			goto comm;
 		}
@@ -437,11 +726,33 @@ comm:
 	if (!detached)
 	{
 		mqh = shm_mq_attach(mqout, NULL, NULL);
-		resmq = shm_mq_receive(mqh, &reslen, (void **) &res, false);
+		resmq = jsonbd_receive(mqh, &reslen, (void **) &res);
 		if (resmq != SHM_MQ_SUCCESS)
 			detached = true;
 
-		if (!detached)
+		if (!detached && reslen > 0 && res[0] == JSONBD_MSG_INLINE)
+			callback_succeded = callback(res + 1, reslen - 1, callback_arg);
+		else if (!detached && reslen == sizeof(jsonbd_large_message) &&
+				 res[0] == JSONBD_MSG_LARGE)
+		{
+			/*
+			 * the response is in the worker's segment, it's not changed until
+			 * the next request, and we hold the worker lock
+			 */
+			jsonbd_large_message   *large = (jsonbd_large_message *) res;
+			dsm_segment			   *seg = dsm_attach(large->handle);
+
+			if (seg == NULL)
+				attach_failed = true;
+			else
+			{
+				callback_succeded = callback(dsm_segment_address(seg),
+											 large->len, callback_arg);
+				dsm_detach(seg);
+			}
+		}
+		else if (!detached)
+			/* failure */
 			callback_succeded = callback(res, reslen, callback_arg);
 
 		shm_mq_detach(mqh);
@@ -452,19 +763,29 @@ comm:
 	if (detached)
 		elog(ERROR, "jsonbd: worker has detached");
 
+	if (attach_failed)
+		elog(ERROR, "jsonbd: could not attach to worker response");
+
 	if (!callback_succeded)
 		elog(ERROR, "jsonbd: communication error");
 
 }
 
-/* Get key IDs using workers */
+/*
+ * Get key IDs using workers. Keys are sent directly from their memory,
+ * the message contains lengths of all keys followed by keys themselves.
+ */
 static void
-jsonbd_worker_get_key_ids(Oid cmoptoid, char *buf, int buflen, uint32 *idsbuf, int nkeys)
+jsonbd_worker_get_key_ids(Oid cmoptoid, char **keys, uint32 *lens,
+						  uint32 *idsbuf, int nkeys)
 {
+	int					i;
 	JsonbcCommand		cmd = JSONBD_CMD_GET_IDS;
-	shm_mq_iovec		iov[4];
+	shm_mq_iovec	   *iov;
 	ids_callback_state	state;
 
+	iov = (shm_mq_iovec *) palloc(sizeof(shm_mq_iovec) * (nkeys + 4));
+
 	iov[0].data = (void *) &nkeys;
 	iov[0].len = sizeof(nkeys);
 
@@ -474,12 +795,19 @@ jsonbd_worker_get_key_ids(Oid cmoptoid, char *buf, int buflen, uint32 *idsbuf, i
 	iov[2].data = (void *) &cmd;
 	iov[2].len = sizeof(cmd);
 
-	iov[3].data = buf;
-	iov[3].len = buflen;
+	iov[3].data = (char *) lens;
+	iov[3].len = sizeof(uint32) * nkeys;
+
+	for (i = 0; i < nkeys; i++)
+	{
+		iov[i + 4].data = keys[i];
+		iov[i + 4].len = lens[i];
+	}
 
 	state.idsbuf = idsbuf;
 	state.nkeys = nkeys;
-	jsonbd_communicate(iov, 4, ids_callback, &state);
+	jsonbd_communicate(cmoptoid, iov, nkeys + 4, ids_callback, &state);
+	pfree(iov);
 }
 
 /* Get keys by their IDs using workers */
@@ -504,63 +832,162 @@ jsonbd_worker_get_keys(Oid cmoptoid, uint32 *ids, int nkeys, size_t *buflen)
 
 	state.buf = NULL;
 	state.buflen = 0;
-	jsonbd_communicate(iov, 4, keys_callback, &state);
+	jsonbd_communicate(cmoptoid, iov, 4, keys_callback, &state);
 
 	*buflen = state.buflen;
 	return state.buf;
 }
 
+static bool
+put_subdoc_callback(char *res, size_t reslen, void *arg)
+{
+	return reslen == sizeof(int32);
+}
+
+static bool
+get_subdoc_callback(char *res, size_t reslen, void *arg)
+{
+	if (reslen < VARHDRSZ || VARSIZE(res) != reslen)
+		return false;
+
+	*((Jsonb **) arg) = (Jsonb *) palloc(reslen);
+	memcpy(*((Jsonb **) arg), res, reslen);
+	return true;
+}
+
 /*
- * Varbyte-encode 'val' into *ptr.
+ * Save the subdocument in jsonbd_subdocs using workers. The worker commits
+ * it before the answer, so the document is visible to everyone before
+ * the datum referencing it is written.
  */
-static void
-encode_varbyte(uint32 val, unsigned char *ptr, int *len)
+void
+jsonbd_worker_put_subdoc(Oid dictid, const uint8 *hash, Jsonb *doc)
 {
-	unsigned char *p = ptr;
+	JsonbcCommand		cmd = JSONBD_CMD_PUT_SUBDOC;
+	int					n = 1;
+	shm_mq_iovec		iov[5];
 
-	while (val > 0x7F)
-	{
-		*(p++) = 0x80 | (val & 0x7F);
-		val >>= 7;
-	}
-	*(p++) = (unsigned char) val;
-	*len = p - ptr;
+	iov[0].data = (void *) &n;
+	iov[0].len = sizeof(n);
+
+	iov[1].data = (void *) &dictid;
+	iov[1].len = sizeof(dictid);
+
+	iov[2].data = (void *) &cmd;
+	iov[2].len = sizeof(cmd);
+
+	iov[3].data = (const char *) hash;
+	iov[3].len = JSONBD_SUBDOC_HASH_LEN;
+
+	iov[4].data = (char *) doc;
+	iov[4].len = VARSIZE(doc);
+
+	jsonbd_communicate(dictid, iov, 5, put_subdoc_callback, NULL);
+}
+
+/* Get the subdocument by its hash using workers, the result is palloc'd */
+Jsonb *
+jsonbd_worker_get_subdoc(Oid dictid, const uint8 *hash)
+{
+	JsonbcCommand		cmd = JSONBD_CMD_GET_SUBDOC;
+	int					n = 1;
+	shm_mq_iovec		iov[4];
+	Jsonb			   *doc = NULL;
+
+	iov[0].data = (void *) &n;
+	iov[0].len = sizeof(n);
+
+	iov[1].data = (void *) &dictid;
+	iov[1].len = sizeof(dictid);
+
+	iov[2].data = (void *) &cmd;
+	iov[2].len = sizeof(cmd);
+
+	iov[3].data = (const char *) hash;
+	iov[3].len = JSONBD_SUBDOC_HASH_LEN;
+
+	jsonbd_communicate(dictid, iov, 4, get_subdoc_callback, &doc);
+	return doc;
+}
+
+typedef struct
+{
+	char   *buf;
+	Size	len;
+} templates_callback_state;
+
+static bool
+templates_callback(char *res, size_t reslen, void *arg)
+{
+	templates_callback_state *state = (templates_callback_state *) arg;
+
+	/* the response starts with the count of templates */
+	if (reslen < sizeof(int32))
+		return false;
+
+	state->buf = palloc(reslen);
+	state->len = reslen;
+	memcpy(state->buf, res, reslen);
+	return true;
+}
+
+/* Get templates of compression options using workers */
+char *
+jsonbd_worker_get_templates(Oid acoid, Size *len)
+{
+	JsonbcCommand		cmd = JSONBD_CMD_GET_TEMPLATES;
+	int					n = 0;
+	shm_mq_iovec		iov[3];
+	templates_callback_state state;
+
+	iov[0].data = (void *) &n;
+	iov[0].len = sizeof(n);
+
+	iov[1].data = (void *) &acoid;
+	iov[1].len = sizeof(acoid);
+
+	iov[2].data = (void *) &cmd;
+	iov[2].len = sizeof(cmd);
+
+	state.buf = NULL;
+	state.len = 0;
+	jsonbd_communicate(acoid, iov, 3, templates_callback, &state);
+
+	*len = state.len;
+	return state.buf;
 }
 
 /*
- * Decode varbyte-encoded integer at *ptr.
+ * Register compression options in workers, they create the inherited or
+ * named dictionary if needed and return the dictionary we should use.
+ * Without 'attach' workers only find the dictionary, nothing is written,
+ * that's enough for decompression (which could run on a standby).
  */
-static uint32
-decode_varbyte(unsigned char *ptr)
+static void
+jsonbd_worker_attach(jsonbd_options *opts, bool attach)
 {
-	uint32		val;
-	unsigned char *p = ptr;
-	uint32		c;
+	JsonbcCommand		cmd = attach ? JSONBD_CMD_ATTACH : JSONBD_CMD_RESOLVE;
+	int					nkeys = 0;
+	shm_mq_iovec		iov[5];
 
-	c = *(p++);
-	val = c & 0x7F;
-	if (c & 0x80)
-	{
-		c = *(p++);
-		val |= (c & 0x7F) << 7;
-		if (c & 0x80)
-		{
-			c = *(p++);
-			val |= (c & 0x7F) << 14;
-			if (c & 0x80)
-			{
-				c = *(p++);
-				val |= (c & 0x7F) << 21;
-				if (c & 0x80)
-				{
-					c = *(p++);
-					val |= c << 28;
-				}
-			}
-		}
-	}
+	iov[0].data = (void *) &nkeys;
+	iov[0].len = sizeof(nkeys);
+
+	iov[1].data = (void *) &opts->acoid;
+	iov[1].len = sizeof(Oid);
+
+	iov[2].data = (void *) &cmd;
+	iov[2].len = sizeof(cmd);
+
+	iov[3].data = (void *) &opts->inherit;
+	iov[3].len = sizeof(Oid);
+
+	iov[4].data = opts->dictname;
+	iov[4].len = strlen(opts->dictname) + 1;
 
-	return val;
+	jsonbd_communicate(opts->acoid, iov, 5, attach_callback, &opts->dictid);
+	opts->attached = attach;
+	opts->resolved = true;
 }
 
 static void
@@ -591,6 +1018,12 @@ init_memory_context(bool init_buffers)
 		compression_buffers->buf = palloc(compression_buffers->buflen);
 		compression_buffers->idsbuf =
 				(uint32 *) palloc(compression_buffers->idslen * sizeof(uint32));
+		compression_buffers->keysbuf =
+				(char **) palloc(compression_buffers->idslen * sizeof(char *));
+		compression_buffers->lensbuf =
+				(uint32 *) palloc(compression_buffers->idslen * sizeof(uint32));
+		compression_buffers->posbuf =
+				(int *) palloc(compression_buffers->idslen * sizeof(int));
 		MemoryContextSwitchTo(old_mcxt);
 
 		compression_buffers->item_mcxt = AllocSetContextCreate(compression_mcxt,
@@ -599,6 +1032,24 @@ init_memory_context(bool init_buffers)
 	}
 }
 
+/* increase the size of buffers for key ids if we need to */
+static void
+ensure_ids_buffers(int nkeys)
+{
+	if (nkeys <= compression_buffers->idslen)
+		return;
+
+	compression_buffers->idsbuf = (uint32 *)
+		repalloc(compression_buffers->idsbuf, nkeys * sizeof(uint32));
+	compression_buffers->keysbuf = (char **)
+		repalloc(compression_buffers->keysbuf, nkeys * sizeof(char *));
+	compression_buffers->lensbuf = (uint32 *)
+		repalloc(compression_buffers->lensbuf, nkeys * sizeof(uint32));
+	compression_buffers->posbuf = (int *)
+		repalloc(compression_buffers->posbuf, nkeys * sizeof(int));
+	compression_buffers->idslen = nkeys;
+}
+
 static void
 memory_reset_callback(void *arg)
 {
@@ -658,203 +1109,1068 @@ packJsonbValue(JsonbValue *val, int header_size, int *len)
 }
 #endif
 
-/* Compress jsonb using dictionary */
-static struct varlena *
-jsonbd_cmcompress(CompressionAmOptions *cmoptions, const struct varlena *data)
+/*
+ * Build JsonbValue tree from the container. Unlike pushJsonbValue it keeps
+ * the order of object pairs as is, because keys in compressed containers are
+ * encoded and their order means nothing. 'callback' is called for each
+ * object before it is attached to its parent.
+ */
+static JsonbValue *
+jsonbd_build_value(JsonbContainer *container, object_callback callback,
+				   void *arg)
 {
-	int					size;
 	JsonbIteratorToken	r;
-	JsonbValue			jv;
+	JsonbValue			v;
 	JsonbIterator	   *it;
-	JsonbValue		   *jbv = NULL;
-	JsonbParseState	   *state = NULL;
-	struct varlena	   *res;
+	JsonbValue		   *res = NULL;
+	JsonbValue		  **stack;
+	int					depth = 0,
+						stacklen = 16;
 
-	init_memory_context(true);
+	stack = (JsonbValue **) palloc(sizeof(JsonbValue *) * stacklen);
+	it = JsonbIteratorInit(container);
 
-	it = JsonbIteratorInit(&((Jsonb *) data)->root);
-	while ((r = JsonbIteratorNext(&it, &jv, false)) != 0)
+	while ((r = JsonbIteratorNext(&it, &v, false)) != WJB_DONE)
 	{
-		/* we assume that jsonb has already been sorted and uniquefied */
-		jbv = pushJsonbValue(&state, r, r < WJB_BEGIN_ARRAY ? &jv : NULL);
+		JsonbValue	*top = depth > 0 ? stack[depth - 1] : NULL;
+		JsonbValue	*c;
 
-		if (r == WJB_END_OBJECT && jbv->type == jbvObject)
+		switch (r)
 		{
-			int		i,
-					len,
-					nkeys = jbv->val.object.nPairs,
-					offset = 0;
-
-			/* maximum length of encoded uint32 is 5 */
-			char   *keyptr = MemoryContextAlloc(compression_buffers->item_mcxt, nkeys * 5),
-				   *buf;
-			uint32 *idsbuf;
-
-			/* increase the size of buffer for key ids if we need to */
-			if (nkeys > compression_buffers->idslen)
-			{
-				compression_buffers->idsbuf =
-					(uint32 *) repalloc(compression_buffers->idsbuf, nkeys * sizeof(uint32));
-				compression_buffers->idslen = nkeys;
-			}
-
-			/* calculate length of keys */
-			len = 0;
-			for (i = 0; i < nkeys; i++)
-			{
-				JsonbValue *v = &jbv->val.object.pairs[i].key;
-				len += v->val.string.len + 1 /* \0 */;
-			}
-
-			/* increase the buffer if we need to */
-			if (len > compression_buffers->buflen)
-			{
-				compression_buffers->buf =
-					(char *) repalloc(compression_buffers->buf, len);
-				compression_buffers->buflen = len;
-			}
+			case WJB_BEGIN_OBJECT:
+			case WJB_BEGIN_ARRAY:
+				c = (JsonbValue *) palloc(sizeof(JsonbValue));
+				if (r == WJB_BEGIN_OBJECT)
+				{
+					c->type = jbvObject;
+					c->val.object.pairs = (JsonbPair *) palloc(sizeof(JsonbPair) *
+										Max(v.val.object.nPairs, 1));
+					c->val.object.nPairs = 0;
+				}
+				else
+				{
+					c->type = jbvArray;
+					c->val.array.elems = (JsonbValue *) palloc(sizeof(JsonbValue) *
+										Max(v.val.array.nElems, 1));
+					c->val.array.nElems = 0;
+					c->val.array.rawScalar = v.val.array.rawScalar;
+				}
 
-			/* copy all keys to buffer */
-			buf = compression_buffers->buf;
-			idsbuf = compression_buffers->idsbuf;
+				if (depth == stacklen)
+				{
+					stacklen *= 2;
+					stack = (JsonbValue **) repalloc(stack,
+										sizeof(JsonbValue *) * stacklen);
+				}
+				stack[depth++] = c;
+				break;
+			case WJB_KEY:
+				Assert(top && top->type == jbvObject);
+				top->val.object.pairs[top->val.object.nPairs].key = v;
+				top->val.object.pairs[top->val.object.nPairs].order =
+					top->val.object.nPairs;
+				break;
+			case WJB_VALUE:
+				Assert(top && top->type == jbvObject);
+				top->val.object.pairs[top->val.object.nPairs++].value = v;
+				break;
+			case WJB_ELEM:
+				Assert(top && top->type == jbvArray);
+				top->val.array.elems[top->val.array.nElems++] = v;
+				break;
+			case WJB_END_OBJECT:
+			case WJB_END_ARRAY:
+				c = stack[--depth];
+				if (r == WJB_END_OBJECT && callback)
+					callback(c, arg);
+
+				if (depth == 0)
+				{
+					res = c;
+					break;
+				}
 
-			for (i = 0; i < nkeys; i++)
-			{
-				JsonbValue *v = &jbv->val.object.pairs[i].key;
-				memcpy(buf + offset, v->val.string.val, v->val.string.len);
-				offset += v->val.string.len;
-				buf[offset++] = '\0';
-			}
+				/* attach to the parent */
+				top = stack[depth - 1];
+				if (top->type == jbvObject)
+					top->val.object.pairs[top->val.object.nPairs++].value = *c;
+				else
+					top->val.array.elems[top->val.array.nElems++] = *c;
+				break;
+			default:
+				elog(ERROR, "jsonbd: unexpected jsonb token: %d", r);
+		}
+	}
 
-			Assert(offset == len);
+	pfree(stack);
+	return res;
+}
 
-			/* retrieve or generate ids */
-			jsonbd_worker_get_key_ids(cmoptions->acoid, buf, len, idsbuf, nkeys);
+/*
+ * Replace keys of the object with encoded 'ids'. Encoded keys are allocated
+ * in current memory context.
+ */
+static void
+jsonbd_encode_ids(JsonbValue *obj, uint32 *ids, jsonbd_format format)
+{
+	int			i,
+				keylen,
+				nkeys = obj->val.object.nPairs;
+	char	   *keyptr;
+	JsonbPair  *pairs = obj->val.object.pairs;
 
-			/* replace the old keys with encoded ids */
-			for (i = 0; i < nkeys; i++)
-			{
-				int keylen;
+	if (nkeys == 0)
+		return;
 
-				JsonbValue *v = &jbv->val.object.pairs[i].key;
+	if (format == JSONBD_FORMAT_STREAM)
+	{
+		keyptr = palloc(JSONBD_STREAM_MAXLEN(nkeys));
+		keylen = encode_stream(ids, nkeys, (unsigned char *) keyptr);
 
-				encode_varbyte(idsbuf[i], (unsigned char *) keyptr, &keylen);
-				v->val.string.val = keyptr;
-				v->val.string.len = keylen;
-				keyptr += keylen;
-			}
+		/* all ids go to the first key, others are empty */
+		for (i = 0; i < nkeys; i++)
+		{
+			pairs[i].key.val.string.val = keyptr;
+			pairs[i].key.val.string.len = i == 0 ? keylen : 0;
 		}
+		return;
 	}
 
-	/* don't compress scalar values */
-	if (jbv == NULL || IsAJsonbScalar(jbv))
-		return NULL;
-
-	res = (struct varlena *) packJsonbValue(jbv, VARHDRSZ_CUSTOM_COMPRESSED, &size);
-	SET_VARSIZE_COMPRESSED(res, size);
+	keyptr = palloc(nkeys * JSONBD_VARBYTE_MAXLEN);
+	for (i = 0; i < nkeys; i++)
+	{
+		JsonbValue *v = &pairs[i].key;
 
-	MemoryContextReset(compression_buffers->item_mcxt);
-	return res;
+		encode_varbyte(ids[i], (unsigned char *) keyptr, &keylen);
+		v->val.string.val = keyptr;
+		v->val.string.len = keylen;
+		keyptr += keylen;
+	}
 }
 
-static void *
-jsonbd_cminitstate(Oid acoid, List *options)
+/*
+ * Decode key ids of the compressed object into 'ids',
+ * returns the format the ids were saved in.
+ */
+static jsonbd_format
+jsonbd_decode_ids(JsonbValue *obj, uint32 *ids)
 {
-	if (!OidIsValid(jsonbd_get_dictionary_relid()))
-		elog(ERROR, "could not create jsonbd dictionary");
+	int			i,
+				nkeys = obj->val.object.nPairs;
+	JsonbPair  *pairs = obj->val.object.pairs;
+	JsonbValue *first;
 
-	return NULL;
-}
+	if (nkeys == 0)
+		return JSONBD_FORMAT_VARBYTE;
 
-static void
-jsonbd_cmdrop(Oid acoid)
-{
-	/* TODO: if there is no compression options, remove the dictionary */
-}
+	first = &pairs[0].key;
+	Assert(first->type == jbvString);
 
-static struct varlena *
-jsonbd_cmdecompress(CompressionAmOptions *cmoptions, const struct varlena *data)
-{
-	JsonbIteratorToken	r;
-	JsonbValue			v,
-					   *jbv = NULL;
-	JsonbIterator	   *it;
-	Jsonb			   *jb;
-	JsonbParseState	   *state = NULL;
-	struct varlena	   *res;
+	if (first->val.string.len > 0 &&
+		(unsigned char) first->val.string.val[0] == JSONBD_STREAM_MARKER)
+	{
+		if (jsonbd_decode_stream((unsigned char *) first->val.string.val,
+								 first->val.string.len, ids, nkeys) != 0)
+			elog(ERROR, "jsonbd: corrupted stream of key ids");
 
-	init_memory_context(true);
-	Assert(VARATT_IS_CUSTOM_COMPRESSED(data));
+		return JSONBD_FORMAT_STREAM;
+	}
 
-	jb = (Jsonb *) ((char *) data + VARHDRSZ_CUSTOM_COMPRESSED - offsetof(Jsonb, root));
-	it = JsonbIteratorInit(&jb->root);
-	while ((r = JsonbIteratorNext(&it, &v, false)) != 0)
+	for (i = 0; i < nkeys; i++)
 	{
-		jbv = pushJsonbValue(&state, r, r < WJB_BEGIN_ARRAY ? &v : NULL);
+		JsonbValue *v = &pairs[i].key;
 
-		if (r == WJB_END_OBJECT && jbv->type == jbvObject)
-		{
-			char   *buf;
-			size_t	buflen,
-					offset = 0;
-			int		i,
-					nkeys = jbv->val.object.nPairs;
+		Assert(v->type == jbvString);
+		if (v->val.string.len == 0 || v->val.string.len > JSONBD_VARBYTE_MAXLEN)
+			elog(ERROR, "jsonbd: corrupted key id");
 
-			/* increase the size of buffer for key ids if we need to */
-			if (nkeys > compression_buffers->idslen)
-			{
-				compression_buffers->idsbuf =
-					(uint32 *) repalloc(compression_buffers->idsbuf, nkeys * sizeof(uint32));
-				compression_buffers->idslen = nkeys;
+		ids[i] = decode_varbyte((unsigned char *) v->val.string.val);
+	}
+
+	return JSONBD_FORMAT_VARBYTE;
+}
+
+/*
+ * Sparse objects carry many pairs with null values, each costs a key and
+ * two entries. Keys of null values are moved to the first pair, which has
+ * an empty key (encoded keys are never empty) and the list of their
+ * varbyte-encoded ids as the value. Other keys are encoded as usual after
+ * it. Returns false if the object has no null values.
+ */
+static bool
+elide_nulls(JsonbValue *obj, uint32 *ids, jsonbd_format format)
+{
+	int				i,
+					n = 0,
+					len = 0,
+					nnulls = 0,
+					nkeys = obj->val.object.nPairs;
+	JsonbPair	   *pairs = obj->val.object.pairs,
+				   *res;
+	JsonbValue		rest;
+	unsigned char  *list;
+
+	for (i = 0; i < nkeys; i++)
+		if (pairs[i].value.type == jbvNull)
+			nnulls++;
+
+	if (nnulls == 0)
+		return false;
+
+	list = palloc(nnulls * JSONBD_VARBYTE_MAXLEN + 1);
+	res = palloc(sizeof(JsonbPair) * (nkeys - nnulls + 1));
+	for (i = 0; i < nkeys; i++)
+	{
+		if (pairs[i].value.type == jbvNull)
+		{
+			int		keylen;
+
+			encode_varbyte(ids[i], list + len, &keylen);
+			len += keylen;
+			continue;
+		}
+
+		res[n + 1] = pairs[i];
+		ids[n++] = ids[i];
+	}
+
+	/* the lone list should not look like a reference to a subdocument */
+	if (n == 0 && len == JSONBD_SUBDOC_HASH_LEN)
+		list[len++] = 0;
+
+	res[0].key.type = jbvString;
+	res[0].key.val.string.val = "";
+	res[0].key.val.string.len = 0;
+	res[0].value.type = jbvString;
+	res[0].value.val.string.val = (char *) list;
+	res[0].value.val.string.len = len;
+	res[0].order = 0;
+
+	rest.type = jbvObject;
+	rest.val.object.pairs = res + 1;
+	rest.val.object.nPairs = n;
+	jsonbd_encode_ids(&rest, ids, format);
+
+	obj->val.object.pairs = res;
+	obj->val.object.nPairs = n + 1;
+	return true;
+}
+
+/* Replace keys of the object with their ids */
+static void
+compress_object(JsonbValue *jbv, jsonbd_options *opts, jsonbd_frozen *frozen)
+{
+	int				i,
+					nmissing = 0,
+					nkeys = jbv->val.object.nPairs;
+	MemoryContext	old_mcxt;
+	jsonbd_format	format = opts->format;
+
+	BENCH_LAP(JSONBD_STAGE_ITERATE);
+	ensure_ids_buffers(nkeys);
+
+	/*
+	 * keys of the frozen dictionary are resolved here, others are
+	 * sent to workers right from the jsonb
+	 */
+	for (i = 0; i < nkeys; i++)
+	{
+		JsonbValue *v = &jbv->val.object.pairs[i].key;
+		uint32		id = 0;
+
+		if (frozen && !jsonbd_bulk_load)
+			id = jsonbd_frozen_get_id(frozen, v->val.string.val,
+									  v->val.string.len);
+
+		compression_buffers->idsbuf[i] = id;
+		if (id == 0)
+		{
+			compression_buffers->keysbuf[nmissing] = v->val.string.val;
+			compression_buffers->lensbuf[nmissing] = v->val.string.len;
+			compression_buffers->posbuf[nmissing++] = i;
+		}
+	}
+
+	BENCH_LAP(JSONBD_STAGE_KEYS);
+
+	/* in bulk load mode all keys are resolved by the backend */
+	if (jsonbd_bulk_load &&
+		jsonbd_bulk_get_ids(opts->dictid, compression_buffers->keysbuf,
+							compression_buffers->lensbuf,
+							compression_buffers->idsbuf, nkeys))
+		nmissing = 0;
+
+	/* retrieve or generate ids */
+	if (nmissing == nkeys)
+		jsonbd_worker_get_key_ids(opts->dictid, compression_buffers->keysbuf,
+								  compression_buffers->lensbuf,
+								  compression_buffers->idsbuf, nkeys);
+	else if (nmissing > 0)
+	{
+		uint32 *ids = palloc(sizeof(uint32) * nmissing);
+
+		jsonbd_worker_get_key_ids(opts->dictid, compression_buffers->keysbuf,
+								  compression_buffers->lensbuf,
+								  ids, nmissing);
+		for (i = 0; i < nmissing; i++)
+			compression_buffers->idsbuf[compression_buffers->posbuf[i]] = ids[i];
+		pfree(ids);
+	}
+	BENCH_LAP(JSONBD_STAGE_IPC);
+
+	/* replace the old keys with encoded ids */
+	/* keys of chains are concatenated, so single keys are not streamed */
+	if (opts->paths && nkeys == 1)
+		format = JSONBD_FORMAT_VARBYTE;
+
+	old_mcxt = MemoryContextSwitchTo(compression_buffers->item_mcxt);
+	if (!opts->elide_nulls ||
+		!elide_nulls(jbv, compression_buffers->idsbuf, format))
+		jsonbd_encode_ids(jbv, compression_buffers->idsbuf, format);
+	MemoryContextSwitchTo(old_mcxt);
+	BENCH_LAP(JSONBD_STAGE_ENCODE);
+}
+
+/*
+ * Chains of objects with one pair, like {"data": {"attributes": {...}}},
+ * are saved as one pair whose key is the sequence of varbyte-encoded ids
+ * of the chain, see expand_path. Objects are finished bottom-up, so
+ * the inner object is already collapsed.
+ */
+static void
+collapse_path(JsonbValue *obj)
+{
+	JsonbPair  *pair = &obj->val.object.pairs[0];
+	JsonbValue *key = &pair->key,
+			   *inner = &pair->value,
+			   *ikey;
+	char	   *path;
+
+	if (obj->val.object.nPairs != 1 || key->val.string.len == 0 ||
+		inner->type != jbvObject || inner->val.object.nPairs != 1)
+		return;
+
+	/* references to subdocuments and lists of null keys have empty keys */
+	ikey = &inner->val.object.pairs[0].key;
+	if (ikey->val.string.len == 0)
+		return;
+
+	path = MemoryContextAlloc(compression_buffers->item_mcxt,
+							  key->val.string.len + ikey->val.string.len);
+	memcpy(path, key->val.string.val, key->val.string.len);
+	memcpy(path + key->val.string.len, ikey->val.string.val,
+		   ikey->val.string.len);
+
+	key->val.string.val = path;
+	key->val.string.len += ikey->val.string.len;
+	*inner = inner->val.object.pairs[0].value;
+}
+
+/* Push a reference to the stored subdocument, see jsonbd_subdocs.c */
+static void
+push_subdoc_ref(JsonbParseState **state, uint8 *hash)
+{
+	JsonbValue	v;
+	char	   *val = MemoryContextAlloc(compression_buffers->item_mcxt,
+										 JSONBD_SUBDOC_HASH_LEN);
+
+	memcpy(val, hash, JSONBD_SUBDOC_HASH_LEN);
+	pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+
+	v.type = jbvString;
+	v.val.string.val = val;
+	v.val.string.len = 0;
+	pushJsonbValue(state, WJB_KEY, &v);
+
+	v.val.string.len = JSONBD_SUBDOC_HASH_LEN;
+	pushJsonbValue(state, WJB_VALUE, &v);
+
+	pushJsonbValue(state, WJB_END_OBJECT, NULL);
+}
+
+/*
+ * Build the tree of the container with encoded keys. With deduplication
+ * nested containers are not unpacked by the iterator, large ones could be
+ * replaced by references, others are walked recursively.
+ */
+static JsonbValue *
+compress_container(JsonbContainer *container, JsonbParseState **state,
+				   jsonbd_options *opts, jsonbd_frozen *frozen)
+{
+	JsonbIteratorToken	r;
+	JsonbValue			jv;
+	JsonbIterator	   *it;
+	JsonbValue		   *jbv = NULL;
+	bool				dedup = opts->dedup > 0;
+
+	it = JsonbIteratorInit(container);
+	while ((r = JsonbIteratorNext(&it, &jv, dedup)) != 0)
+	{
+		if (dedup && (r == WJB_VALUE || r == WJB_ELEM) && jv.type == jbvBinary)
+		{
+			uint8	hash[JSONBD_SUBDOC_HASH_LEN];
+
+			if (jv.val.binary.len >= opts->dedup &&
+				jsonbd_subdoc_store(opts->dictid, &jv, hash))
+				push_subdoc_ref(state, hash);
+			else
+				compress_container(jv.val.binary.data, state, opts, frozen);
+
+			continue;
+		}
+
+		/* we assume that jsonb has already been sorted and uniquefied */
+		jbv = pushJsonbValue(state, r, r < WJB_BEGIN_ARRAY ? &jv : NULL);
+
+		if (r == WJB_END_OBJECT && jbv->type == jbvObject &&
+				jbv->val.object.nPairs > 0)
+		{
+			compress_object(jbv, opts, frozen);
+			if (opts->paths)
+				collapse_path(jbv);
+
+			/* the parent got a copy of the object, elided nulls change it */
+			if (opts->elide_nulls && *state != NULL)
+			{
+				JsonbValue *parent = &(*state)->contVal;
+
+				if (parent->type == jbvObject)
+					parent->val.object.pairs[parent->val.object.nPairs - 1].value = *jbv;
+				else
+					parent->val.array.elems[parent->val.array.nElems - 1] = *jbv;
+			}
+		}
+	}
+
+	return jbv;
+}
+
+/* Compress jsonb using dictionary */
+static struct varlena *
+jsonbd_cmcompress(CompressionAmOptions *cmoptions, const struct varlena *data)
+{
+	int					size;
+	JsonbValue		   *jbv;
+	JsonbValue			marker;
+	JsonbParseState	   *state = NULL;
+	struct varlena	   *res;
+	jsonbd_options	   *opts = (jsonbd_options *) cmoptions->acstate;
+	jsonbd_frozen	   *frozen;
+	Jsonb			   *src = (Jsonb *) data,
+					   *delta = NULL;
+
+	init_memory_context(true);
+
+	/*
+	 * new options could inherit a dictionary or use a shared one,
+	 * workers should know about it
+	 */
+	if (!opts->attached)
+		jsonbd_worker_attach(opts, true);
+
+	jsonbd_frozen_check();
+	jsonbd_subdocs_check();
+	jsonbd_templates_check();
+	frozen = jsonbd_frozen_open(opts->dictid);
+
+	if (opts->templates && JB_ROOT_IS_OBJECT(src))
+		delta = jsonbd_template_diff(opts->acoid, src, &marker);
+
+	jbv = compress_container(delta ? &delta->root : &src->root, &state,
+							 opts, frozen);
+	BENCH_LAP(JSONBD_STAGE_ITERATE);
+
+	/* don't compress scalar values */
+	if (jbv == NULL || IsAJsonbScalar(jbv))
+		return NULL;
+
+	/* the reference to the template goes first, with an empty key */
+	if (delta)
+	{
+		int			n = jbv->val.object.nPairs;
+		JsonbPair  *pairs = palloc(sizeof(JsonbPair) * (n + 1));
+
+		pairs[0].key.type = jbvString;
+		pairs[0].key.val.string.val = "";
+		pairs[0].key.val.string.len = 0;
+		pairs[0].value = marker;
+		pairs[0].order = 0;
+		memcpy(pairs + 1, jbv->val.object.pairs, sizeof(JsonbPair) * n);
+
+		jbv->val.object.pairs = pairs;
+		jbv->val.object.nPairs = n + 1;
+	}
+
+	res = (struct varlena *) packJsonbValue(jbv, VARHDRSZ_CUSTOM_COMPRESSED, &size);
+	SET_VARSIZE_COMPRESSED(res, size);
+
+	MemoryContextReset(compression_buffers->item_mcxt);
+	BENCH_LAP(JSONBD_STAGE_PACK);
+	return res;
+}
+
+/*
+ * Parse compression options, supported options are:
+ *	inherit - acoid of compression options which dictionary should be
+ *		inherited by new options
+ *	dictionary - name of the dictionary shared between compression options
+ *	format - 'varbyte' (default) or 'stream', how key ids are saved
+ *	dedup - minimal size in bytes of nested objects and arrays that are
+ *		saved once in jsonbd_subdocs
+ *	templates - encode objects as differences from templates of the options
+ *	elide_nulls - save keys of null values of an object as one list of ids
+ *	paths - save chains of objects with one pair as one pair
+ */
+static void
+jsonbd_parse_options(List *options, jsonbd_options *opts)
+{
+	ListCell	*lc;
+
+	foreach(lc, options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "inherit") == 0)
+		{
+			char   *val = defGetString(def);
+
+			opts->inherit = DatumGetObjectId(DirectFunctionCall1(oidin,
+												CStringGetDatum(val)));
+			if (!OidIsValid(opts->inherit))
+				elog(ERROR, "jsonbd: invalid acoid in \"inherit\" option");
+		}
+		else if (strcmp(def->defname, "dictionary") == 0)
+		{
+			char   *val = defGetString(def);
+
+			if (strlen(val) == 0 || strlen(val) >= JSONBD_DICTIONARY_NAME_LEN)
+				elog(ERROR, "jsonbd: invalid dictionary name \"%s\"", val);
+
+			strcpy(opts->dictname, val);
+		}
+		else if (strcmp(def->defname, "format") == 0)
+		{
+			char   *val = defGetString(def);
+
+			if (strcmp(val, "varbyte") == 0)
+				opts->format = JSONBD_FORMAT_VARBYTE;
+			else if (strcmp(val, "stream") == 0)
+				opts->format = JSONBD_FORMAT_STREAM;
+			else
+				elog(ERROR, "jsonbd: unknown format \"%s\"", val);
+		}
+		else if (strcmp(def->defname, "dedup") == 0)
+		{
+			char   *val = defGetString(def);
+
+			opts->dedup = pg_atoi(val, sizeof(int32), 0);
+			if (opts->dedup < JSONBD_SUBDOC_MIN_SIZE)
+				elog(ERROR, "jsonbd: \"dedup\" should be at least %d bytes",
+						JSONBD_SUBDOC_MIN_SIZE);
+		}
+		else if (strcmp(def->defname, "templates") == 0)
+			opts->templates = defGetBoolean(def);
+		else if (strcmp(def->defname, "elide_nulls") == 0)
+			opts->elide_nulls = defGetBoolean(def);
+		else if (strcmp(def->defname, "paths") == 0)
+			opts->paths = defGetBoolean(def);
+		else
+			elog(ERROR, "jsonbd: unknown compression option \"%s\"",
+					def->defname);
+	}
+
+	if (OidIsValid(opts->inherit) && opts->dictname[0] != '\0')
+		elog(ERROR, "jsonbd: \"inherit\" and \"dictionary\" options could not be used together");
+}
+
+static void *
+jsonbd_cminitstate(Oid acoid, List *options)
+{
+	jsonbd_options	*opts;
+
+	if (!OidIsValid(jsonbd_get_dictionary_relid()))
+		elog(ERROR, "could not create jsonbd dictionary");
+
+	opts = (jsonbd_options *) MemoryContextAllocZero(CacheMemoryContext,
+													 sizeof(jsonbd_options));
+	opts->acoid = acoid;
+	opts->dictid = acoid;
+	opts->inherit = InvalidOid;
+	jsonbd_parse_options(options, opts);
+
+	if (opts->inherit == acoid)
+		elog(ERROR, "jsonbd: compression options could not inherit themselves");
+
+	/* options with own dictionary without a parent have nothing to register */
+	opts->attached = !OidIsValid(opts->inherit) && opts->dictname[0] == '\0';
+
+	/* only named dictionaries have a dictid other than acoid */
+	opts->resolved = opts->dictname[0] == '\0';
+
+	/* remember the options for SQL functions */
+	if (options_cache == NULL)
+	{
+		HASHCTL		hash_ctl;
+
+		memset(&hash_ctl, 0, sizeof(hash_ctl));
+		hash_ctl.keysize = sizeof(Oid);
+		hash_ctl.entrysize = sizeof(OptionsEntry);
+		hash_ctl.hcxt = CacheMemoryContext;
+
+		options_cache = hash_create("jsonbd options cache", 64, &hash_ctl,
+									HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+	((OptionsEntry *) hash_search(options_cache, &acoid, HASH_ENTER,
+								  NULL))->opts = opts;
+
+	return opts;
+}
+
+/* Returns parsed options of compression options */
+static jsonbd_options *
+jsonbd_get_options(Oid acoid)
+{
+	OptionsEntry   *entry = NULL;
+
+	if (options_cache)
+		entry = hash_search(options_cache, &acoid, HASH_FIND, NULL);
+
+	if (entry)
+		return entry->opts;
+
+	return (jsonbd_options *) jsonbd_cminitstate(acoid,
+									GetCompressionOptionsList(acoid));
+}
+
+static void
+jsonbd_cmdrop(Oid acoid)
+{
+	jsonbd_drop_dictionary(acoid);
+}
+
+/* Request keys from workers and put them to 'pairs' at 'positions' */
+static void
+jsonbd_fetch_keys(Oid dictid, uint32 *ids, int *positions, int n,
+				  JsonbPair *pairs)
+{
+	int		i;
+	char   *buf;
+	size_t	buflen,
+			offset = 0;
+
+	buf = jsonbd_worker_get_keys(dictid, ids, n, &buflen);
+	if (buf == NULL)
+		elog(ERROR, "jsonbd: decompression error");
+
+	for (i = 0; i < n; i++)
+	{
+		JsonbValue *v = &pairs[positions[i]].key;
+		size_t		keylen = strlen(&buf[offset]);
+
+		Assert(offset + keylen < buflen);
+		v->val.string.val = pnstrdup(&buf[offset], keylen);
+		v->val.string.len = keylen;
+
+		/* move to next key in buffer */
+		offset += keylen + 1;
+	}
+
+	/* check correctness */
+	Assert(offset == buflen);
+}
+
+/*
+ * Replace key ids with keys. Keys are looked up in the frozen dictionary
+ * and the shared cache first, only missing ones are requested from workers. Keys are allocated in
+ * the item context, because the workers buffer is reused by next objects.
+ *
+ * Missing keys are claimed in the cache, so other backends wait for them
+ * instead of requesting the same keys. We wait for keys claimed by others
+ * only after our own keys were loaded, so backends can't wait for each
+ * other. If a key is not loaded in time, we request it ourselves.
+ */
+static void
+jsonbd_resolve_keys(jsonbd_options *opts, uint32 *ids, JsonbPair *pairs,
+					int nkeys)
+{
+	jsonbd_frozen  *frozen = jsonbd_frozen_open(opts->dictid);
+	int				i,
+					nmissing = 0,
+					nwaiting = 0;
+	int			   *missing,
+				   *waiting;
+	uint32		   *waitids;
+	MemoryContext	old_mcxt;
+
+	old_mcxt = MemoryContextSwitchTo(compression_buffers->item_mcxt);
+	missing = (int *) palloc(sizeof(int) * nkeys);
+	waiting = (int *) palloc(sizeof(int) * nkeys);
+	waitids = (uint32 *) palloc(sizeof(uint32) * nkeys);
+
+	for (i = 0; i < nkeys; i++)
+	{
+		int			keylen;
+		char	   *key;
+
+		if ((frozen && jsonbd_frozen_get_key(frozen, ids[i], &key, &keylen)) ||
+			jsonbd_bulk_get_key(opts->dictid, ids[i], &key, &keylen))
+		{
+			pairs[i].key.val.string.val = key;
+			pairs[i].key.val.string.len = keylen;
+			continue;
+		}
+
+		switch (jsonbd_shared_cache_lookup(opts->dictid, ids[i], true,
+										   &key, &keylen))
+		{
+			case JSONBD_CACHE_FOUND:
+				pairs[i].key.val.string.val = key;
+				pairs[i].key.val.string.len = keylen;
+				break;
+			case JSONBD_CACHE_LOADING:
+				waitids[nwaiting] = ids[i];
+				waiting[nwaiting++] = i;
+				break;
+			default:
+				/* ids of missing keys are moved to the beginning of the array */
+				ids[nmissing] = ids[i];
+				missing[nmissing++] = i;
+		}
+	}
+
+	if (nmissing > 0)
+	{
+		BENCH_LAP(JSONBD_STAGE_LOOKUP);
+		PG_TRY();
+		{
+			jsonbd_fetch_keys(opts->dictid, ids, missing, nmissing, pairs);
+		}
+		PG_CATCH();
+		{
+			/* let others load the keys we have claimed */
+			jsonbd_shared_cache_release(opts->dictid, ids, nmissing);
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+		BENCH_LAP(JSONBD_STAGE_IPC);
+	}
+
+	if (nwaiting > 0)
+	{
+		long	delay = JSONBD_LOADING_MIN_DELAY,
+				waited = 0;
+
+		while (nwaiting > 0)
+		{
+			int		n = 0;
+
+			nmissing = 0;
+			for (i = 0; i < nwaiting; i++)
+			{
+				int			keylen;
+				char	   *key;
+				JsonbValue *v = &pairs[waiting[i]].key;
+
+				switch (jsonbd_shared_cache_lookup(opts->dictid, waitids[i],
+												   false, &key, &keylen))
+				{
+					case JSONBD_CACHE_FOUND:
+						v->val.string.val = key;
+						v->val.string.len = keylen;
+						break;
+					case JSONBD_CACHE_LOADING:
+						if (waited < JSONBD_LOADING_TIMEOUT)
+						{
+							waitids[n] = waitids[i];
+							waiting[n++] = waiting[i];
+							break;
+						}
+						/* FALLTHROUGH */
+					default:
+						/* loading failed or the key is not cacheable */
+						ids[nmissing] = waitids[i];
+						missing[nmissing++] = waiting[i];
+				}
 			}
 
-			/* decode key ids */
-			for (i = 0; i < nkeys; i++)
+			nwaiting = n;
+			if (nmissing > 0)
 			{
-				int32		key_id;
-				JsonbValue *v = &jbv->val.object.pairs[i].key;
+				BENCH_LAP(JSONBD_STAGE_LOOKUP);
+				jsonbd_fetch_keys(opts->dictid, ids, missing, nmissing, pairs);
+				BENCH_LAP(JSONBD_STAGE_IPC);
+			}
+
+			if (nwaiting > 0)
+			{
+				CHECK_FOR_INTERRUPTS();
+				pg_usleep(delay);
+				waited += delay;
+				delay = Min(delay * 2, JSONBD_LOADING_MAX_DELAY);
+			}
+		}
+	}
+
+	MemoryContextSwitchTo(old_mcxt);
+}
+
+/* jsonb keeps keys sorted by length first, then bytewise */
+static int
+jsonbd_pair_cmp(const void *a, const void *b)
+{
+	const JsonbValue *ka = &((const JsonbPair *) a)->key;
+	const JsonbValue *kb = &((const JsonbPair *) b)->key;
+
+	if (ka->val.string.len != kb->val.string.len)
+		return ka->val.string.len > kb->val.string.len ? 1 : -1;
+
+	return memcmp(ka->val.string.val, kb->val.string.val, ka->val.string.len);
+}
+
+/* Decode and resolve keys of the object and sort its pairs */
+static void
+decompress_keys(JsonbValue *obj, jsonbd_options *opts)
+{
+	int				nkeys = obj->val.object.nPairs;
+	JsonbPair	   *pairs = obj->val.object.pairs;
+	uint32			shape_ids[JSONBD_SHAPE_MAX_KEYS];
+	int				i;
+
+	if (nkeys == 0)
+		return;
+
+	ensure_ids_buffers(nkeys);
+	jsonbd_decode_ids(obj, compression_buffers->idsbuf);
+	BENCH_LAP(JSONBD_STAGE_DECODE);
+
+	/* objects of known shapes don't need lookups and sorting */
+	if (jsonbd_shape_apply(opts->dictid, compression_buffers->idsbuf, pairs,
+						   nkeys))
+	{
+		BENCH_LAP(JSONBD_STAGE_LOOKUP);
+		return;
+	}
+
+	/* resolving moves ids, keep them for the shape */
+	if (nkeys <= JSONBD_SHAPE_MAX_KEYS)
+		memcpy(shape_ids, compression_buffers->idsbuf, sizeof(uint32) * nkeys);
+
+	jsonbd_resolve_keys(opts, compression_buffers->idsbuf, pairs, nkeys);
+	BENCH_LAP(JSONBD_STAGE_LOOKUP);
+
+	/* the order of encoded keys differs from the order of real ones */
+	for (i = 0; i < nkeys; i++)
+		pairs[i].order = i;
+	qsort(pairs, nkeys, sizeof(JsonbPair), jsonbd_pair_cmp);
+
+	jsonbd_shape_add(opts->dictid, shape_ids, pairs, nkeys);
+	BENCH_LAP(JSONBD_STAGE_SORT);
+}
+
+/* Add pairs with null values whose keys were elided by elide_nulls */
+static void
+restore_nulls(JsonbValue *obj, jsonbd_options *opts, JsonbValue *list)
+{
+	int			i,
+				n = obj->val.object.nPairs,
+				nnulls;
+	uint32	   *ids;
+	JsonbPair  *pairs;
+
+	nnulls = decode_varbyte_list((unsigned char *) list->val.string.val,
+								 list->val.string.len, NULL);
+	if (nnulls < 0)
+		elog(ERROR, "jsonbd: corrupted list of null keys");
+
+	ids = palloc(sizeof(uint32) * Max(nnulls, 1));
+	decode_varbyte_list((unsigned char *) list->val.string.val,
+						list->val.string.len, ids);
+
+	pairs = palloc(sizeof(JsonbPair) * (n + nnulls));
+	memcpy(pairs, obj->val.object.pairs, sizeof(JsonbPair) * n);
+	for (i = n; i < n + nnulls; i++)
+	{
+		pairs[i].key.type = jbvString;
+		pairs[i].value.type = jbvNull;
+	}
+
+	if (nnulls > 0)
+		jsonbd_resolve_keys(opts, ids, pairs + n, nnulls);
+	BENCH_LAP(JSONBD_STAGE_LOOKUP);
+
+	for (i = 0; i < n + nnulls; i++)
+		pairs[i].order = i;
+	qsort(pairs, n + nnulls, sizeof(JsonbPair), jsonbd_pair_cmp);
+
+	obj->val.object.pairs = pairs;
+	obj->val.object.nPairs = n + nnulls;
+	pfree(ids);
+	BENCH_LAP(JSONBD_STAGE_SORT);
+}
+
+/*
+ * Returns the number of key ids in the only key of the object, more than
+ * one for collapsed chains, see collapse_path.
+ */
+static int
+path_length(JsonbValue *obj)
+{
+	JsonbValue *key = &obj->val.object.pairs[0].key;
+
+	if (obj->val.object.nPairs != 1 || key->val.string.len == 0 ||
+		(unsigned char) key->val.string.val[0] == JSONBD_STREAM_MARKER)
+		return 0;
+
+	return decode_varbyte_list((unsigned char *) key->val.string.val,
+							   key->val.string.len, NULL);
+}
+
+/*
+ * Restore objects of the collapsed chain, keys of all levels are resolved
+ * at once. Each level uses the next pair of the chain as its only pair.
+ */
+static void
+expand_path(JsonbValue *obj, jsonbd_options *opts, int n)
+{
+	JsonbValue *key = &obj->val.object.pairs[0].key;
+	JsonbPair  *pairs = palloc(sizeof(JsonbPair) * n);
+	uint32	   *ids = palloc(sizeof(uint32) * n);
+	int			i;
+
+	decode_varbyte_list((unsigned char *) key->val.string.val,
+						key->val.string.len, ids);
+	for (i = 0; i < n; i++)
+	{
+		pairs[i].key.type = jbvString;
+		pairs[i].order = 0;
+	}
+
+	jsonbd_resolve_keys(opts, ids, pairs, n);
+	BENCH_LAP(JSONBD_STAGE_LOOKUP);
+
+	pairs[n - 1].value = obj->val.object.pairs[0].value;
+	for (i = n - 2; i >= 0; i--)
+	{
+		pairs[i].value.type = jbvObject;
+		pairs[i].value.val.object.pairs = &pairs[i + 1];
+		pairs[i].value.val.object.nPairs = 1;
+	}
+
+	obj->val.object.pairs = pairs;
+	pfree(ids);
+}
+
+static void
+decompress_object(JsonbValue *obj, jsonbd_options *opts)
+{
+	int		npath;
+
+	if (HAS_NULL_KEYS(obj))
+	{
+		JsonbValue	list = obj->val.object.pairs[0].value;
+
+		obj->val.object.pairs++;
+		obj->val.object.nPairs--;
+		decompress_keys(obj, opts);
+		restore_nulls(obj, opts, &list);
+		return;
+	}
+
+	if ((npath = path_length(obj)) > 1)
+	{
+		expand_path(obj, opts, npath);
+		return;
+	}
+
+	decompress_keys(obj, opts);
+}
 
-				Assert(v->type == jbvString);
-				Assert(v->val.string.len <= 5);
-				key_id = decode_varbyte((unsigned char *) v->val.string.val);
-				compression_buffers->idsbuf[i] = key_id;
-			}
+static void
+decompress_callback(JsonbValue *obj, void *arg)
+{
+	jsonbd_options *opts = (jsonbd_options *) arg;
+	JsonbPair	   *pairs = obj->val.object.pairs;
 
-			/* retrieve keys */
-			buf = jsonbd_worker_get_keys(cmoptions->acoid, compression_buffers->idsbuf, nkeys, &buflen);
-			if (buf == NULL)
-				elog(ERROR, "jsonbd: decompression error");
+	if (obj->val.object.nPairs == 0)
+		return;
 
-			/* replace the encoded keys with real keys */
-			for (i = 0; i < nkeys; i++)
-			{
-				size_t		oldoff	= offset;
-				JsonbValue *v		= &jbv->val.object.pairs[i].key;
+	BENCH_LAP(JSONBD_STAGE_BUILD);
 
-				v->val.string.val = &buf[offset];
+	/* reference to a deduplicated subdocument */
+	if (IS_SUBDOC_REF(obj))
+	{
+		Jsonb  *doc = jsonbd_subdoc_fetch(opts->dictid,
+							(uint8 *) pairs[0].value.val.string.val);
 
-				/* move to next key in buffer */
-				while (buf[offset++] != '\0')
-					Assert(offset <= buflen);
+		*obj = *jsonbd_build_value(&doc->root, NULL, NULL);
+		BENCH_LAP(JSONBD_STAGE_LOOKUP);
+		return;
+	}
 
-				v->val.string.len = offset - oldoff - 1;
-			}
+	/* other pairs are changed and added ones */
+	if (IS_TEMPLATE_DELTA(obj))
+	{
+		JsonbValue	marker = pairs[0].value;
 
-			/* check correctness */
-			Assert(offset == buflen);
-		}
+		obj->val.object.pairs++;
+		obj->val.object.nPairs--;
+		decompress_object(obj, opts);
+		jsonbd_template_apply(opts->acoid, obj, &marker);
+		BENCH_LAP(JSONBD_STAGE_LOOKUP);
+		return;
 	}
 
+	decompress_object(obj, opts);
+}
+
+static struct varlena *
+jsonbd_decompress_value(jsonbd_options *opts, const struct varlena *data)
+{
+	JsonbValue		   *jbv;
+	Jsonb			   *jb;
+	struct varlena	   *res;
+
+	init_memory_context(true);
+
+	/*
+	 * options could use a shared dictionary, get its id. Compressed data
+	 * exists only if the options were attached, so they are not attached
+	 * here, reads should not write.
+	 */
+	if (!opts->resolved)
+		jsonbd_worker_attach(opts, false);
+
+	jsonbd_frozen_check();
+	jsonbd_subdocs_check();
+	jsonbd_templates_check();
+	jb = (Jsonb *) ((char *) data + VARHDRSZ_CUSTOM_COMPRESSED - offsetof(Jsonb, root));
+	jbv = jsonbd_build_value(&jb->root, decompress_callback, opts);
+
 	res = (struct varlena *) JsonbValueToJsonb(jbv);
+	MemoryContextReset(compression_buffers->item_mcxt);
+	BENCH_LAP(JSONBD_STAGE_BUILD);
 	return res;
 }
 
+static struct varlena *
+jsonbd_cmdecompress(CompressionAmOptions *cmoptions, const struct varlena *data)
+{
+	Assert(VARATT_IS_CUSTOM_COMPRESSED(data));
+	return jsonbd_decompress_value((jsonbd_options *) cmoptions->acstate, data);
+}
+
 static void
 jsonbd_cmcheck(Form_pg_attribute att, List *options)
 {
+	jsonbd_options	opts;
+
 	if (att->atttypid != JSONBOID)
 		elog(ERROR, "unexpected type %d for jsonbd compression handler",
 				att->atttypid);
+
+	/* just validate the options */
+	memset(&opts, 0, sizeof(opts));
+	jsonbd_parse_options(options, &opts);
 }
 
 Datum
@@ -863,10 +2179,714 @@ jsonbd_compression_handler(PG_FUNCTION_ARGS)
 	CompressionAmRoutine *routine = makeNode(CompressionAmRoutine);
 
 	routine->cmcheck = jsonbd_cmcheck;
-	routine->cmdrop = jsonbd_cmdrop;		/* no drop behavior */
+	routine->cmdrop = jsonbd_cmdrop;
 	routine->cminitstate = jsonbd_cminitstate;
 	routine->cmcompress = jsonbd_cmcompress;
 	routine->cmdecompress = jsonbd_cmdecompress;
 
 	PG_RETURN_POINTER(routine);
 }
+
+/*
+ * Check whether the compressed root is a difference from a template,
+ * only top-level objects are encoded with templates.
+ */
+static bool
+is_template_delta(const struct varlena *data)
+{
+	JsonbContainer *root = (JsonbContainer *) ((char *) data +
+											   VARHDRSZ_CUSTOM_COMPRESSED);
+	JsonbIterator  *it;
+	JsonbValue		v;
+
+	if (VARSIZE(data) < VARHDRSZ_CUSTOM_COMPRESSED ||
+		!container_is_valid((char *) root,
+							VARSIZE(data) - VARHDRSZ_CUSTOM_COMPRESSED))
+		return false;
+
+	if (!JsonContainerIsObject(root) || JsonContainerSize(root) == 0)
+		return false;
+
+	/* the empty key of the marker goes first */
+	it = JsonbIteratorInit(root);
+	(void) JsonbIteratorNext(&it, &v, true);
+	if (JsonbIteratorNext(&it, &v, true) != WJB_KEY || v.val.string.len != 0)
+		return false;
+
+	(void) JsonbIteratorNext(&it, &v, true);
+	return v.type == jbvBinary && JsonContainerIsArray(v.val.binary.data);
+}
+
+/*
+ * Returns compressed datum as is, without decompression. Datums that
+ * are not compressed are returned in plain form.
+ */
+Datum
+jsonbd_export(PG_FUNCTION_ARGS)
+{
+	struct varlena *data = (struct varlena *) PG_GETARG_POINTER(0);
+	bytea		   *res;
+
+	if (VARATT_IS_EXTERNAL(data))
+		data = heap_tuple_fetch_attr(data);
+
+	if (!VARATT_IS_CUSTOM_COMPRESSED(data))
+		data = heap_tuple_untoast_attr(data);
+	else if (is_template_delta(data))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("jsonbd: datums encoded with templates could not be exported"),
+				 errhint("Export the datum decompressed, as plain jsonb.")));
+
+	res = (bytea *) palloc(VARSIZE(data) + VARHDRSZ);
+	SET_VARSIZE(res, VARSIZE(data) + VARHDRSZ);
+	memcpy(VARDATA(res), data, VARSIZE(data));
+
+	PG_RETURN_BYTEA_P(res);
+}
+
+/*
+ * Load exported dictionary of 'srcoid' compression options, generate
+ * ids for its keys in 'acoid' options and save translation of the ids
+ * for the session.
+ */
+Datum
+jsonbd_import_dictionary(PG_FUNCTION_ARGS)
+{
+	Oid				srcoid = PG_GETARG_OID(0);
+	Oid				acoid = PG_GETARG_OID(1);
+	ArrayType	   *ids_arr = PG_GETARG_ARRAYTYPE_P(2);
+	ArrayType	   *keys_arr = PG_GETARG_ARRAYTYPE_P(3);
+	Datum		   *ids,
+				   *keys;
+	int				nids,
+					nkeys,
+					i;
+	jsonbd_options *opts;
+	TranslationKey	tkey;
+	TranslationEntry *entry;
+	bool			found;
+	MemoryContext	old_mcxt;
+
+	check_jsonbd_options(acoid);
+	opts = jsonbd_get_options(acoid);
+
+	deconstruct_array(ids_arr, INT4OID, sizeof(int32), true, 'i',
+					  &ids, NULL, &nids);
+	deconstruct_array(keys_arr, TEXTOID, -1, false, 'i',
+					  &keys, NULL, &nkeys);
+
+	if (nids != nkeys)
+		elog(ERROR, "jsonbd: ids and keys should have same length");
+
+	if (!opts->attached)
+		jsonbd_worker_attach(opts, true);
+
+	if (translations == NULL)
+	{
+		HASHCTL		hash_ctl;
+
+		memset(&hash_ctl, 0, sizeof(hash_ctl));
+		hash_ctl.keysize = sizeof(TranslationKey);
+		hash_ctl.entrysize = sizeof(TranslationEntry);
+		hash_ctl.hcxt = TopMemoryContext;
+
+		translations = hash_create("jsonbd translations", 16, &hash_ctl,
+								   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	tkey.srcoid = srcoid;
+	tkey.acoid = acoid;
+	entry = hash_search(translations, &tkey, HASH_ENTER, &found);
+	if (!found)
+	{
+		HASHCTL		hash_ctl;
+
+		memset(&hash_ctl, 0, sizeof(hash_ctl));
+		hash_ctl.keysize = sizeof(uint32);
+		hash_ctl.entrysize = sizeof(TranslatedId);
+		hash_ctl.hcxt = TopMemoryContext;
+
+		entry->ids = hash_create("jsonbd translated ids", Max(nids, 128),
+								 &hash_ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	/* get ids by batches, so messages to workers have reasonable size */
+	for (i = 0; i < nkeys; i += JSONBD_IMPORT_BATCH)
+	{
+		int		j,
+				n = Min(JSONBD_IMPORT_BATCH, nkeys - i);
+		char  **keyptrs = (char **) palloc(sizeof(char *) * n);
+		uint32 *lens = (uint32 *) palloc(sizeof(uint32) * n);
+		uint32 *idsbuf = (uint32 *) palloc(sizeof(uint32) * n);
+
+		for (j = 0; j < n; j++)
+		{
+			text   *key = DatumGetTextPP(keys[i + j]);
+
+			keyptrs[j] = VARDATA_ANY(key);
+			lens[j] = VARSIZE_ANY_EXHDR(key);
+		}
+
+		jsonbd_worker_get_key_ids(opts->dictid, keyptrs, lens, idsbuf, n);
+
+		old_mcxt = MemoryContextSwitchTo(TopMemoryContext);
+		for (j = 0; j < n; j++)
+		{
+			uint32			srcid = DatumGetInt32(ids[i + j]);
+			TranslatedId   *tid;
+
+			tid = hash_search(entry->ids, &srcid, HASH_ENTER, NULL);
+			tid->id = idsbuf[j];
+		}
+		MemoryContextSwitchTo(old_mcxt);
+
+		pfree(keyptrs);
+		pfree(lens);
+		pfree(idsbuf);
+	}
+
+	PG_RETURN_INT32(nkeys);
+}
+
+static uint32
+translate_id(HTAB *ids, uint32 id)
+{
+	TranslatedId   *tid;
+
+	tid = hash_search(ids, &id, HASH_FIND, NULL);
+	if (tid == NULL)
+		elog(ERROR, "jsonbd: key id %u is not found in imported dictionary", id);
+
+	return tid->id;
+}
+
+/*
+ * Translate the list of varbyte-encoded ids, the list of keys of null values
+ * or the key of a collapsed chain. 'lone' is true if the list of null keys
+ * is the only pair of the object.
+ */
+static void
+translate_id_list(JsonbValue *list, HTAB *ids, bool lone)
+{
+	int				i,
+					n,
+					len = 0;
+	uint32		   *idsbuf;
+	unsigned char  *res;
+
+	n = decode_varbyte_list((unsigned char *) list->val.string.val,
+							list->val.string.len, NULL);
+	if (n < 0)
+		elog(ERROR, "jsonbd: corrupted list of key ids");
+
+	idsbuf = (uint32 *) palloc(sizeof(uint32) * Max(n, 1));
+	decode_varbyte_list((unsigned char *) list->val.string.val,
+						list->val.string.len, idsbuf);
+
+	res = palloc(n * JSONBD_VARBYTE_MAXLEN + 1);
+	for (i = 0; i < n; i++)
+	{
+		int		keylen;
+
+		encode_varbyte(translate_id(ids, idsbuf[i]), res + len, &keylen);
+		len += keylen;
+	}
+
+	if (lone && len == JSONBD_SUBDOC_HASH_LEN)
+		res[len++] = 0;
+
+	list->val.string.val = (char *) res;
+	list->val.string.len = len;
+	pfree(idsbuf);
+}
+
+static void
+translate_callback(JsonbValue *obj, void *arg)
+{
+	int				i;
+	HTAB		   *ids = (HTAB *) arg;
+	uint32		   *idsbuf;
+	jsonbd_format	format;
+	JsonbValue		keys = *obj;
+
+	if (obj->val.object.nPairs == 0)
+		return;
+
+	/* subdocuments are shared by all compression options */
+	if (IS_SUBDOC_REF(obj))
+	{
+		jsonbd_subdoc_check_ref((uint8 *) obj->val.object.pairs[0].value.val.string.val);
+		return;
+	}
+
+	/* refused by jsonbd_export, template ids differ between options */
+	if (IS_TEMPLATE_DELTA(obj))
+		elog(ERROR, "jsonbd: datums encoded with templates could not be imported");
+
+	/* other keys go after the list of keys of null values */
+	if (HAS_NULL_KEYS(obj))
+	{
+		translate_id_list(&obj->val.object.pairs[0].value, ids,
+						  obj->val.object.nPairs == 1);
+		keys.val.object.pairs++;
+		keys.val.object.nPairs--;
+	}
+
+	if (path_length(&keys) > 1)
+	{
+		translate_id_list(&keys.val.object.pairs[0].key, ids, false);
+		return;
+	}
+
+	idsbuf = (uint32 *) palloc(sizeof(uint32) * Max(keys.val.object.nPairs, 1));
+	format = jsonbd_decode_ids(&keys, idsbuf);
+
+	for (i = 0; i < keys.val.object.nPairs; i++)
+		idsbuf[i] = translate_id(ids, idsbuf[i]);
+
+	/* the format of the object is kept */
+	jsonbd_encode_ids(&keys, idsbuf, format);
+	pfree(idsbuf);
+}
+
+/*
+ * Check that offsets and lengths of the container of 'len' bytes and its
+ * nested containers stay within it, so imported datums are safe to read.
+ */
+static bool
+container_is_valid(const char *ptr, Size len)
+{
+	uint32			header,
+					count,
+					nentries,
+					offset = 0,
+					i;
+	const JEntry   *children;
+	const char	   *base;
+	Size			datalen;
+
+	check_stack_depth();
+
+	if (len < sizeof(uint32))
+		return false;
+
+	header = *((const uint32 *) ptr);
+	count = header & JB_CMASK;
+	if ((header & JB_FOBJECT) != 0)
+	{
+		if ((header & (JB_FARRAY | JB_FSCALAR)) != 0)
+			return false;
+		nentries = count * 2;
+	}
+	else if ((header & JB_FARRAY) != 0)
+	{
+		if ((header & JB_FSCALAR) != 0 && count != 1)
+			return false;
+		nentries = count;
+	}
+	else
+		return false;
+
+	if ((len - sizeof(uint32)) / sizeof(JEntry) < nentries)
+		return false;
+
+	children = (const JEntry *) (ptr + sizeof(uint32));
+	base = (const char *) (children + nentries);
+	datalen = len - sizeof(uint32) - nentries * sizeof(JEntry);
+
+	for (i = 0; i < nentries; i++)
+	{
+		JEntry		entry = children[i];
+		uint32		end = JBE_OFFLENFLD(entry),
+					start = INTALIGN(offset);
+
+		if (!JBE_HAS_OFF(entry))
+			end += offset;
+
+		if (end < offset || end > datalen)
+			return false;
+
+		/* keys of objects are strings */
+		if ((header & JB_FOBJECT) != 0 && i < count && !JBE_ISSTRING(entry))
+			return false;
+
+		if (JBE_ISNUMERIC(entry))
+		{
+			if (start + VARHDRSZ > end ||
+				VARSIZE_ANY(base + start) > end - start)
+				return false;
+		}
+		else if (JBE_ISCONTAINER(entry))
+		{
+			if (start > end || !container_is_valid(base + start, end - start))
+				return false;
+		}
+		else if (!JBE_ISSTRING(entry) && !JBE_ISNULL(entry) &&
+				 !JBE_ISBOOL_TRUE(entry) && !JBE_ISBOOL_FALSE(entry))
+			return false;
+
+		offset = end;
+	}
+
+	return true;
+}
+
+/*
+ * Import a datum exported by jsonbd_export. Key ids of compressed datums
+ * are translated to ids of 'acoid' compression options, the result is
+ * still compressed and is saved without recompression.
+ */
+Datum
+jsonbd_import(PG_FUNCTION_ARGS)
+{
+	bytea		   *data = PG_GETARG_BYTEA_P(0);
+	Oid				acoid = PG_GETARG_OID(1);
+	struct varlena *val = (struct varlena *) VARDATA(data);
+	jsonbd_compressed_header *hdr = (jsonbd_compressed_header *) val;
+	TranslationKey	tkey;
+	TranslationEntry *entry = NULL;
+	JsonbValue	   *jbv;
+	Jsonb		   *jb;
+	struct varlena *res;
+	int				size;
+
+	check_jsonbd_options(acoid);
+
+	if (VARSIZE(data) - VARHDRSZ < VARHDRSZ ||
+			VARSIZE(val) != VARSIZE(data) - VARHDRSZ)
+		elog(ERROR, "jsonbd: invalid exported datum");
+
+	/* not compressed datums are just copied */
+	if (!VARATT_IS_CUSTOM_COMPRESSED(val))
+	{
+		if (!VARATT_IS_4B_U(val) ||
+			!container_is_valid(VARDATA(val), VARSIZE(val) - VARHDRSZ))
+			elog(ERROR, "jsonbd: invalid exported datum");
+
+		res = (struct varlena *) palloc(VARSIZE(val));
+		memcpy(res, val, VARSIZE(val));
+		PG_RETURN_POINTER(res);
+	}
+
+	if (VARSIZE(val) < VARHDRSZ_CUSTOM_COMPRESSED ||
+		!container_is_valid((char *) val + VARHDRSZ_CUSTOM_COMPRESSED,
+							VARSIZE(val) - VARHDRSZ_CUSTOM_COMPRESSED))
+		elog(ERROR, "jsonbd: invalid exported datum");
+
+	tkey.srcoid = hdr->va_cmid;
+	tkey.acoid = acoid;
+	if (translations)
+		entry = hash_search(translations, &tkey, HASH_FIND, NULL);
+
+	if (entry == NULL)
+		elog(ERROR, "jsonbd: dictionary of compression options %u is not imported",
+				tkey.srcoid);
+
+	jb = (Jsonb *) ((char *) val + VARHDRSZ_CUSTOM_COMPRESSED - offsetof(Jsonb, root));
+	jbv = jsonbd_build_value(&jb->root, translate_callback, entry->ids);
+
+	res = (struct varlena *) packJsonbValue(jbv, VARHDRSZ_CUSTOM_COMPRESSED, &size);
+	SET_VARSIZE_COMPRESSED(res, size);
+
+	/* keys are the same, so the original size is the same too */
+	((jsonbd_compressed_header *) res)->va_info = hdr->va_info;
+	((jsonbd_compressed_header *) res)->va_cmid = acoid;
+
+	PG_RETURN_POINTER(res);
+}
+
+static const char *sql_jsonb_columns = \
+	"SELECT c.oid, a.attname FROM pg_catalog.pg_attribute a"
+	" JOIN pg_catalog.pg_class c ON c.oid = a.attrelid"
+	" WHERE a.atttypid = 'pg_catalog.jsonb'::pg_catalog.regtype"
+	" AND a.attnum > 0 AND NOT a.attisdropped AND c.relkind IN ('r', 'm')"
+	" AND c.relnamespace NOT IN ('pg_catalog'::pg_catalog.regnamespace,"
+	" 'information_schema'::pg_catalog.regnamespace, $1)";
+
+static const char *sql_remove_subdocs = \
+	"DELETE FROM %s.jsonbd_subdocs d WHERE NOT EXISTS"
+	" (SELECT 1 FROM pg_catalog.unnest($1) r(hash) WHERE r.hash = d.hash)";
+
+static void
+collect_refs_callback(JsonbValue *obj, void *arg)
+{
+	if (IS_SUBDOC_REF(obj))
+		hash_search((HTAB *) arg, obj->val.object.pairs[0].value.val.string.val,
+					HASH_ENTER, NULL);
+}
+
+/* Add references of the column values to 'refs' */
+static void
+collect_column_refs(Oid relid, const char *attname, HTAB *refs,
+					MemoryContext row_mcxt)
+{
+	Portal		portal;
+	char	   *sql;
+
+	sql = psprintf("SELECT %s FROM %s", quote_identifier(attname),
+				   quote_qualified_identifier(get_namespace_name(get_rel_namespace(relid)),
+											  get_rel_name(relid)));
+	portal = SPI_cursor_open_with_args(NULL, sql, 0, NULL, NULL, NULL, true, 0);
+
+	for (;;)
+	{
+		uint64	i;
+
+		SPI_cursor_fetch(portal, true, 1000);
+		if (SPI_processed == 0)
+			break;
+
+		for (i = 0; i < SPI_processed; i++)
+		{
+			MemoryContext	 old_mcxt;
+			struct varlena	*data;
+			bool			 isnull;
+			Jsonb			*jb;
+
+			/* values are not decompressed by the query */
+			data = (struct varlena *) DatumGetPointer(
+					SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc,
+								  1, &isnull));
+			if (isnull)
+				continue;
+
+			old_mcxt = MemoryContextSwitchTo(row_mcxt);
+			if (VARATT_IS_EXTERNAL(data))
+				data = heap_tuple_fetch_attr(data);
+
+			if (VARATT_IS_CUSTOM_COMPRESSED(data) &&
+				VARSIZE(data) >= VARHDRSZ_CUSTOM_COMPRESSED &&
+				container_is_valid((char *) data + VARHDRSZ_CUSTOM_COMPRESSED,
+								   VARSIZE(data) - VARHDRSZ_CUSTOM_COMPRESSED))
+			{
+				jb = (Jsonb *) ((char *) data + VARHDRSZ_CUSTOM_COMPRESSED -
+								offsetof(Jsonb, root));
+				(void) jsonbd_build_value(&jb->root, collect_refs_callback, refs);
+			}
+
+			MemoryContextSwitchTo(old_mcxt);
+			MemoryContextReset(row_mcxt);
+		}
+
+		SPI_freetuptable(SPI_tuptable);
+	}
+
+	SPI_cursor_close(portal);
+}
+
+/*
+ * Remove subdocuments that are not referenced by rows of jsonb columns,
+ * returns the number of removed subdocuments. Tables are locked against
+ * writes until the end of the transaction.
+ */
+Datum
+jsonbd_gc_subdocs(PG_FUNCTION_ARGS)
+{
+	Oid				nspoid = get_jsonbd_schema();
+	Oid				argtypes[1] = {OIDOID};
+	Datum			values[1];
+	HASHCTL			ctl;
+	HTAB		   *refs;
+	HASH_SEQ_STATUS	status;
+	uint8		   *hash;
+	List		   *relids = NIL,
+				   *attnames = NIL;
+	ListCell	   *lc1,
+				   *lc2;
+	Datum		   *hashes;
+	int				nhashes = 0;
+	int64			removed;
+	char		   *nspname;
+	MemoryContext	mcxt = CurrentMemoryContext,
+					row_mcxt;
+	uint64			i;
+
+	/* rows committed while the tables were being locked should be seen */
+	if (IsolationUsesXactSnapshot())
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("jsonbd: jsonbd_gc_subdocs should be called in READ COMMITTED transaction")));
+
+	nspname = get_namespace_name(nspoid);
+	if (!nspname)
+		elog(ERROR, "jsonbd: extension schema not found");
+	nspname = (char *) quote_identifier(nspname);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = JSONBD_SUBDOC_HASH_LEN;
+	ctl.entrysize = JSONBD_SUBDOC_HASH_LEN;
+	ctl.hcxt = mcxt;
+	refs = hash_create("jsonbd referenced subdocs", 1024, &ctl,
+					   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	row_mcxt = AllocSetContextCreate(mcxt, "jsonbd subdocs gc context",
+									 ALLOCSET_DEFAULT_SIZES);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "jsonbd: could not connect to SPI");
+
+	values[0] = ObjectIdGetDatum(nspoid);
+	if (SPI_execute_with_args(sql_jsonb_columns, 1, argtypes, values, NULL,
+							  true, 0) != SPI_OK_SELECT)
+		elog(ERROR, "jsonbd: could not get jsonb columns");
+
+	for (i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple		tup = SPI_tuptable->vals[i];
+		bool			isnull;
+		MemoryContext	old_mcxt = MemoryContextSwitchTo(mcxt);
+
+		relids = lappend_oid(relids, DatumGetObjectId(
+							SPI_getbinval(tup, SPI_tuptable->tupdesc, 1, &isnull)));
+		attnames = lappend(attnames, SPI_getvalue(tup, SPI_tuptable->tupdesc, 2));
+		MemoryContextSwitchTo(old_mcxt);
+	}
+
+	/*
+	 * Tables are locked first, so no backend waits for workers storing
+	 * subdocuments while we wait for it.
+	 */
+	foreach(lc1, relids)
+		LockRelationOid(lfirst_oid(lc1), ShareLock);
+	LockRelationOid(get_relname_relid("jsonbd_subdocs", nspoid),
+					ShareRowExclusiveLock);
+
+	forboth(lc1, relids, lc2, attnames)
+		collect_column_refs(lfirst_oid(lc1), (char *) lfirst(lc2), refs, row_mcxt);
+
+	hashes = (Datum *) palloc(sizeof(Datum) * Max(hash_get_num_entries(refs), 1));
+	hash_seq_init(&status, refs);
+	while ((hash = (uint8 *) hash_seq_search(&status)) != NULL)
+	{
+		bytea  *val = (bytea *) palloc(VARHDRSZ + JSONBD_SUBDOC_HASH_LEN);
+
+		SET_VARSIZE(val, VARHDRSZ + JSONBD_SUBDOC_HASH_LEN);
+		memcpy(VARDATA(val), hash, JSONBD_SUBDOC_HASH_LEN);
+		hashes[nhashes++] = PointerGetDatum(val);
+	}
+
+	argtypes[0] = get_array_type(BYTEAOID);
+	values[0] = PointerGetDatum(construct_array(hashes, nhashes, BYTEAOID,
+												-1, false, 'i'));
+	if (SPI_execute_with_args(psprintf(sql_remove_subdocs, nspname), 1,
+							  argtypes, values, NULL, false, 0) != SPI_OK_DELETE)
+		elog(ERROR, "jsonbd: could not remove subdocuments");
+
+	removed = SPI_processed;
+	SPI_finish();
+
+	/* backends forget cached subdocuments, they could be removed */
+	CacheInvalidateRelcacheByRelid(get_relname_relid("jsonbd_subdocs", nspoid));
+
+	PG_RETURN_INT64(removed);
+}
+
+/*
+ * Compress and decompress the samples 'iterations' times with 'acoid'
+ * compression options, returns time spent in each stage. Compression is
+ * done as by the toaster, but the dictionary gets keys of the samples.
+ */
+Datum
+jsonbd_bench(PG_FUNCTION_ARGS)
+{
+	ArrayType	   *samples = PG_GETARG_ARRAYTYPE_P(0);
+	int32			iterations = PG_GETARG_INT32(1);
+	Oid				acoid = PG_GETARG_OID(2);
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc		tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext	old_mcxt,
+					bench_mcxt;
+	CompressionAmOptions cmoptions;
+	jsonbd_options *opts;
+	instr_time		timings[JSONBD_STAGE_COUNT];
+	Datum		   *elems;
+	bool		   *nulls;
+	int				nelems,
+					nsamples = 0,
+					i,
+					j;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	/* compression adds keys of the samples to the dictionary */
+	check_jsonbd_options(acoid);
+	opts = jsonbd_get_options(acoid);
+	memset(&cmoptions, 0, sizeof(cmoptions));
+	cmoptions.acstate = opts;
+
+	/* samples are detoasted before measurements */
+	deconstruct_array(samples, JSONBOID, -1, false, 'i', &elems, &nulls, &nelems);
+	for (i = 0; i < nelems; i++)
+		if (!nulls[i])
+			elems[nsamples++] = PointerGetDatum(PG_DETOAST_DATUM(elems[i]));
+
+	bench_mcxt = AllocSetContextCreate(CurrentMemoryContext,
+									   "jsonbd bench context",
+									   ALLOCSET_DEFAULT_SIZES);
+	memset(timings, 0, sizeof(timings));
+
+	PG_TRY();
+	{
+		bench_timings = timings;
+		for (i = 0; i < iterations; i++)
+		{
+			for (j = 0; j < nsamples; j++)
+			{
+				struct varlena *compressed;
+
+				CHECK_FOR_INTERRUPTS();
+				old_mcxt = MemoryContextSwitchTo(bench_mcxt);
+
+				INSTR_TIME_SET_CURRENT(bench_lap);
+				compressed = jsonbd_cmcompress(&cmoptions,
+											   (struct varlena *) DatumGetPointer(elems[j]));
+				if (compressed)
+				{
+					INSTR_TIME_SET_CURRENT(bench_lap);
+					jsonbd_decompress_value(opts, compressed);
+				}
+
+				MemoryContextSwitchTo(old_mcxt);
+				MemoryContextReset(bench_mcxt);
+			}
+		}
+		bench_timings = NULL;
+	}
+	PG_CATCH();
+	{
+		bench_timings = NULL;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	old_mcxt = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(old_mcxt);
+
+	for (i = 0; i < JSONBD_STAGE_COUNT; i++)
+	{
+		Datum	values[3];
+		bool	isnull[3] = {false, false, false};
+		double	total = INSTR_TIME_GET_MILLISEC(timings[i]);
+		int64	calls = (int64) iterations * nsamples;
+
+		values[0] = CStringGetTextDatum(stage_names[i]);
+		values[1] = Float8GetDatum(total);
+		values[2] = Float8GetDatum(calls > 0 ? total * 1000.0 / calls : 0);
+		tuplestore_putvalues(tupstore, tupdesc, values, isnull);
+	}
+
+	MemoryContextDelete(bench_mcxt);
+	return (Datum) 0;
+}
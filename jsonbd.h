@@ -6,21 +6,113 @@
 
 #include "nodes/pg_list.h"
 #include "port/atomics.h"
+#include "storage/dsm.h"
 #include "storage/proc.h"
 #include "storage/shm_mq.h"
+#include "utils/jsonb.h"
 
 #define JSONBD_SHM_MQ_MAGIC		0xAAAA
 
 #define JSONBD_LWLOCKS_TRANCHE	"jsonbd lwlocks tranche"
+#define JSONBD_CACHE_LWLOCKS_TRANCHE	"jsonbd cache lwlocks tranche"
+#define JSONBD_CACHE_PARTITIONS			16
+#define JSONBD_SHARED_KEY_LEN			64
+#define JSONBD_SHAPE_MAX_KEYS			64		/* larger objects are not cached */
+#define JSONBD_SHAPE_CACHE_SIZE			1024	/* shapes per backend */
+#define JSONBD_SUBDOC_HASH_LEN			32		/* SHA-256 */
+#define JSONBD_SUBDOC_MIN_SIZE			64		/* smaller ones don't pay off */
+#define JSONBD_SUBDOCS_CACHE_SIZE		(16 * 1024 * 1024)	/* bytes */
+#define JSONBD_SUBDOCS_MAX_ENTRIES		65536
+#define JSONBD_MAX_TEMPLATES			16		/* per compression options */
+#define JSONBD_MIN_SPINS				16
+#define JSONBD_LOADING_MIN_DELAY		10		/* us */
+#define JSONBD_LOADING_MAX_DELAY		1000	/* us */
+#define JSONBD_LOADING_TIMEOUT			100000	/* us */
+#define JSONBD_READ_XACT_IDLE_TIMEOUT	1000	/* ms */
+#define JSONBD_READ_XACT_MAX_REQUESTS	10000
 #define MAX_JSONBD_WORKERS_PER_DATABASE		3
 #define MAX_DATABASES						10 /* FIXME: need more? */
 #define MAX_JSONBD_WORKERS	(MAX_DATABASES * MAX_JSONBD_WORKERS_PER_DATABASE)
 
 typedef enum {
 	JSONBD_CMD_GET_IDS,
-	JSONBD_CMD_GET_KEYS
+	JSONBD_CMD_GET_KEYS,
+	JSONBD_CMD_ATTACH,
+	JSONBD_CMD_PUT_SUBDOC,
+	JSONBD_CMD_GET_SUBDOC,
+	JSONBD_CMD_GET_TEMPLATES,
+	JSONBD_CMD_RESOLVE,		/* like ATTACH, but without writes */
+	JSONBD_CMD_LARGE		/* the request is in DSM segment */
 } JsonbcCommand;
 
+/*
+ * Every response starts with its kind. Messages that don't fit into the
+ * queue are passed through DSM segments, only jsonbd_large_message is sent
+ * through the queue then.
+ */
+#define JSONBD_MSG_FAILURE		'\0'
+#define JSONBD_MSG_INLINE		'i'
+#define JSONBD_MSG_LARGE		'l'
+
+#define JSONBD_INLINE_MESSAGE_MAX	(jsonbd_total_queue_size - shm_mq_minimum_size)
+
+typedef struct jsonbd_large_message
+{
+	char		kind;
+	dsm_handle	handle;
+	Size		len;
+} jsonbd_large_message;
+
+/* how key ids are saved in compressed objects */
+typedef enum {
+	JSONBD_FORMAT_VARBYTE,		/* each key is a varbyte encoded id */
+	JSONBD_FORMAT_STREAM		/* all ids are in the first key, see jsonbd_codec.h */
+} jsonbd_format;
+
+#define JSONBD_DICTIONARY_NAME_LEN	NAMEDATALEN
+#define JSONBD_IMPORT_BATCH			1024
+
+/*
+ * Compression options parsed by jsonbd_cminitstate.
+ *
+ * 'inherit' is an acoid whose dictionary is inherited by these options.
+ * Keys of the parent dictionary known at the moment of attaching are shared
+ * (ids up to parent's maximum id), new keys go to our own dictionary and get
+ * ids after that, so id spaces never overlap.
+ *
+ * 'dictname' is a name of a shared dictionary. All options with the same
+ * name use one dictionary, its dictid is acoid of the first attached options.
+ *
+ * 'format' is used only for compression, decompression detects the format
+ * of each object.
+ *
+ * 'dedup' is the minimal size of nested containers saved once in
+ * jsonbd_subdocs, see jsonbd_subdocs.c. 0 disables deduplication.
+ *
+ * 'templates' enables encoding of objects as differences from templates
+ * of the options, see jsonbd_templates.c.
+ *
+ * 'elide_nulls' enables saving keys of null values of an object as one list
+ * of their ids, see elide_nulls in jsonbd.c.
+ *
+ * 'paths' enables saving chains of objects with one pair as one pair,
+ * whose key is the path of key ids, see collapse_path in jsonbd.c.
+ */
+typedef struct jsonbd_options
+{
+	Oid		acoid;		/* compression options */
+	Oid		dictid;		/* dictionary used for these options */
+	Oid		inherit;	/* parent dictionary or InvalidOid */
+	char	dictname[JSONBD_DICTIONARY_NAME_LEN];
+	jsonbd_format format;
+	int		dedup;
+	bool	templates;
+	bool	elide_nulls;
+	bool	paths;
+	bool	attached;	/* options were registered in workers */
+	bool	resolved;	/* dictid is known */
+} jsonbd_options;
+
 typedef struct jsonbd_shm_worker
 {
 	shm_mq			   *mqin;
@@ -40,6 +132,18 @@ typedef struct jsonbd_shm_hdr
 	Latch				launcher_latch;
 } jsonbd_shm_hdr;
 
+/*
+ * Header of custom compressed varlena, copied from PostgreSQL with custom
+ * compression methods patch. We need it to read and set compression options
+ * of compressed datums that are moved without decompression.
+ */
+typedef struct jsonbd_compressed_header
+{
+	uint32		va_header;
+	uint32		va_info;	/* original data size and flags */
+	Oid			va_cmid;	/* compression options */
+} jsonbd_compressed_header;
+
 /* CACHE */
 typedef struct jsonbd_pair
 {
@@ -47,11 +151,30 @@ typedef struct jsonbd_pair
 	char	*key;
 } jsonbd_pair;
 
+/*
+ * Storage segment of a dictionary: a partition of jsonbd_dictionary with its
+ * indexes. Dictionaries that could not get their own segment are stored
+ * in the default partition.
+ */
+typedef struct jsonbd_segment
+{
+	Oid		 relid;
+	Oid		 id_indoid;
+	Oid		 keys_indoid;
+} jsonbd_segment;
+
 typedef struct jsonbd_cached_cmopt
 {
 	Oid		 cmoptoid;
 	HTAB	*key_cache;
 	HTAB	*id_cache;
+	jsonbd_segment	segment;	/* relid is InvalidOid if not known yet */
+	bool	 segment_changed;	/* the segment should be looked up again */
+
+	/* inherited dictionary, ids up to parent_maxid are resolved there */
+	Oid		 parent;
+	uint32	 parent_maxid;
+	struct jsonbd_cached_cmopt *parent_cache;
 } jsonbd_cached_cmopt;
 
 typedef struct jsonbd_cached_key
@@ -66,6 +189,21 @@ typedef struct jsonbd_cached_id
 	jsonbd_pair	*pair;
 } jsonbd_cached_id;
 
+/* Key of shared cache */
+typedef enum
+{
+	JSONBD_CACHE_MISS,		/* not found (and could not be claimed) */
+	JSONBD_CACHE_FOUND,
+	JSONBD_CACHE_CLAIMED,	/* not found, the caller should load it */
+	JSONBD_CACHE_LOADING	/* someone else is loading it */
+} jsonbd_cache_result;
+
+typedef struct jsonbd_shared_key
+{
+	Oid		dictid;
+	uint32	id;
+} jsonbd_shared_key;
+
 /* Worker launch arguments */
 typedef struct jsonbd_worker_args
 {
@@ -77,10 +215,77 @@ typedef struct jsonbd_worker_args
 extern void _PG_init(void);
 extern void jsonbd_register_launcher(void);
 extern Oid jsonbd_get_dictionary_relid(void);
+extern void jsonbd_drop_dictionary(Oid acoid);
+
+extern void jsonbd_shared_cache_request(void);
+extern void jsonbd_shared_cache_startup(void);
+extern jsonbd_cache_result jsonbd_shared_cache_lookup(Oid dictid, uint32 id,
+						   bool claim, char **keydata, int *keylen);
+extern void jsonbd_shared_cache_release(Oid dictid, uint32 *ids, int n);
+extern void jsonbd_shared_cache_purge(Oid dictid);
+
+extern bool jsonbd_shape_apply(Oid dictid, uint32 *ids, JsonbPair *pairs,
+							   int nkeys);
+extern void jsonbd_shape_add(Oid dictid, uint32 *ids, JsonbPair *pairs,
+							 int nkeys);
+extern void jsonbd_shape_reset(void);
+
+extern void jsonbd_subdocs_init(void);
+extern void jsonbd_subdocs_request(void);
+extern void jsonbd_subdocs_startup(void);
+extern void jsonbd_subdocs_check(void);
+extern void jsonbd_subdoc_check_ref(const uint8 *hash);
+extern bool jsonbd_subdoc_store(Oid dictid, JsonbValue *binary, uint8 *hash);
+extern Jsonb *jsonbd_subdoc_fetch(Oid dictid, const uint8 *hash);
+extern void jsonbd_worker_put_subdoc(Oid dictid, const uint8 *hash, Jsonb *doc);
+extern Jsonb *jsonbd_worker_get_subdoc(Oid dictid, const uint8 *hash);
+
+extern void jsonbd_templates_init(void);
+extern void jsonbd_templates_check(void);
+extern Jsonb *jsonbd_template_diff(Oid acoid, Jsonb *src, JsonbValue *marker);
+extern void jsonbd_template_apply(Oid acoid, JsonbValue *obj,
+								  JsonbValue *marker);
+extern char *jsonbd_worker_get_templates(Oid acoid, Size *len);
+
+extern void jsonbd_stats_init(void);
+extern Datum jsonbd_key_hash(const char *key, int keylen);
+
+extern void jsonbd_bulk_request(void);
+extern void jsonbd_bulk_startup(void);
+extern void jsonbd_bulk_init(void);
+extern uint32 jsonbd_reserve_ids(Oid dictid, uint32 maxid, uint32 n);
+extern void jsonbd_release_ids(Oid dictid);
+extern bool jsonbd_bulk_get_ids(Oid dictid, char **keys, uint32 *lens,
+								uint32 *ids, int nkeys);
+extern bool jsonbd_bulk_get_key(Oid dictid, uint32 id, char **key,
+								int *keylen);
+
+typedef struct jsonbd_frozen jsonbd_frozen;
+
+extern void jsonbd_frozen_request(void);
+extern void jsonbd_frozen_init(void);
+extern void jsonbd_frozen_startup(void);
+extern void jsonbd_frozen_check(void);
+extern jsonbd_frozen *jsonbd_frozen_open(Oid dictid);
+extern bool jsonbd_frozen_get_key(jsonbd_frozen *frozen, uint32 id,
+								  char **key, int *keylen);
+extern uint32 jsonbd_frozen_get_id(jsonbd_frozen *frozen, const char *key,
+								   int keylen);
+extern void jsonbd_frozen_remove(Oid dictid);
+extern void jsonbd_shared_cache_put(Oid dictid, uint32 id, const char *keydata, int keylen);
+
+typedef int (*jsonbd_stream_decoder) (const unsigned char *ptr, int len,
+									  uint32 *ids, int n);
+extern jsonbd_stream_decoder jsonbd_decode_stream;
+extern void jsonbd_codec_init(void);
 
 extern void *workers_data;
 extern int jsonbd_nworkers;
 extern int jsonbd_cache_size;
 extern int jsonbd_queue_size;
+extern Size jsonbd_total_queue_size;
+extern int jsonbd_max_spins;
+extern int jsonbd_shared_cache_size;
+extern bool jsonbd_bulk_load;
 
 #endif
@@ -0,0 +1,553 @@
+#include "jsonbd.h"
+#include "jsonbd_utils.h"
+
+#include "postgres.h"
+#include "miscadmin.h"
+
+#include "access/parallel.h"
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+
+/*
+ * Bulk load mode.
+ *
+ * With jsonbd.bulk_load the backend loads the whole dictionary of the
+ * compression options once and resolves keys locally, without workers.
+ * Ids of new keys are taken from blocks reserved in a shared counter,
+ * new keys are registered in the dictionary by one insert when
+ * the transaction commits, so they are committed together with the data.
+ *
+ * Workers take ids from the same counter, so ids reserved by a loading
+ * backend are never given to other keys. Keys missing in the local
+ * dictionary are looked up again among keys added by workers since
+ * the load, still a key added concurrently by a worker and a loading
+ * backend could get two ids, both resolve to the key.
+ *
+ * Keys that are not registered yet are known only to the loading backend,
+ * so parallel workers are disabled until the end of the transaction once
+ * it has such keys. The dictionary is read and written as the owner of
+ * the extension.
+ */
+
+#define JSONBD_BULK_LWLOCK_TRANCHE	"jsonbd bulk load"
+#define JSONBD_BULK_MAX_COUNTERS	1024
+#define JSONBD_BULK_ID_BLOCK		1024
+
+#ifndef INT8ARRAYOID
+#define INT8ARRAYOID	1016
+#endif
+
+typedef struct jsonbd_id_counter
+{
+	Oid			dictid;
+	uint32		maxid;		/* last reserved id */
+} jsonbd_id_counter;
+
+typedef struct
+{
+	uint32		hkey;
+	List	   *pairs;		/* bulk_pair */
+} bulk_key_entry;
+
+typedef struct
+{
+	uint32		id;
+	int			keylen;
+	char	   *key;
+} bulk_pair;
+
+typedef struct
+{
+	Oid			dictid;
+	HTAB	   *key_cache;	/* bulk_key_entry by hash of key */
+	HTAB	   *id_cache;	/* bulk_pair by id */
+	uint32		loaded_id;	/* maximum id loaded from the dictionary */
+	uint32		next_id;	/* reserved block of ids */
+	uint32		last_id;
+	List	   *pending;	/* new keys to register */
+} bulk_dictionary;
+
+bool	jsonbd_bulk_load = false;
+
+static HTAB			   *id_counters = NULL;
+static LWLock		   *counters_lock = NULL;
+static HTAB			   *bulk_dictionaries = NULL;
+static MemoryContext	bulk_mcxt = NULL;
+
+static const char *sql_load = \
+	"SELECT id, key FROM %s.jsonbd_export_dictionary($1, $2)";
+
+static const char *sql_register = \
+	"INSERT INTO %s.jsonbd_dictionary(acoid, id, key, keyhash)"
+	" SELECT $1, unnest($2), unnest($3), unnest($4)";
+
+/* Should be called from _PG_init */
+void
+jsonbd_bulk_request(void)
+{
+	RequestNamedLWLockTranche(JSONBD_BULK_LWLOCK_TRANCHE, 1);
+	RequestAddinShmemSpace(hash_estimate_size(JSONBD_BULK_MAX_COUNTERS,
+											  sizeof(jsonbd_id_counter)));
+}
+
+/* Should be called from shmem startup hook with AddinShmemInitLock held */
+void
+jsonbd_bulk_startup(void)
+{
+	HASHCTL		info;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(Oid);
+	info.entrysize = sizeof(jsonbd_id_counter);
+
+	id_counters = ShmemInitHash("jsonbd id counters",
+								JSONBD_BULK_MAX_COUNTERS,
+								JSONBD_BULK_MAX_COUNTERS,
+								&info,
+								HASH_ELEM | HASH_BLOBS);
+	counters_lock = &(GetNamedLWLockTranche(JSONBD_BULK_LWLOCK_TRANCHE))->lock;
+}
+
+/* Forget the counter of the dropped dictionary */
+void
+jsonbd_release_ids(Oid dictid)
+{
+	if (id_counters == NULL)
+		return;
+
+	LWLockAcquire(counters_lock, LW_EXCLUSIVE);
+	hash_search(id_counters, &dictid, HASH_REMOVE, NULL);
+	LWLockRelease(counters_lock);
+}
+
+/*
+ * Reserve 'n' ids after 'maxid', the last id saved in the dictionary.
+ * Returns the first reserved id, or 0 if there is no space for the counter
+ * of the dictionary, then only ids from the dictionary itself should be used.
+ */
+uint32
+jsonbd_reserve_ids(Oid dictid, uint32 maxid, uint32 n)
+{
+	jsonbd_id_counter  *counter;
+	uint32				result = 0;
+
+	if (id_counters == NULL)
+		return 0;
+
+	LWLockAcquire(counters_lock, LW_EXCLUSIVE);
+	counter = hash_search(id_counters, &dictid, HASH_FIND, NULL);
+
+	/*
+	 * Track the dictionary on the first id, even taken by a worker one by
+	 * one, otherwise a block reserved later could start below it.
+	 */
+	if (counter == NULL)
+	{
+		bool	found;
+
+		counter = hash_search(id_counters, &dictid, HASH_ENTER_NULL, &found);
+		if (counter && !found)
+			counter->maxid = 0;
+	}
+
+	if (counter)
+	{
+		counter->maxid = Max(counter->maxid, maxid);
+		result = counter->maxid + 1;
+		counter->maxid += n;
+	}
+	LWLockRelease(counters_lock);
+
+	return result;
+}
+
+static uint32
+bulk_key_hash(const char *key, int keylen)
+{
+	return qhashmurmur3_32(key, keylen);
+}
+
+static void
+bulk_add_pair(bulk_dictionary *dict, uint32 id, const char *key, int keylen)
+{
+	bulk_pair		*pair;
+	bulk_key_entry	*kentry;
+	uint32			 hkey = bulk_key_hash(key, keylen);
+	bool			 found;
+	MemoryContext	 old_mcxt = MemoryContextSwitchTo(bulk_mcxt);
+
+	pair = hash_search(dict->id_cache, &id, HASH_ENTER, &found);
+	if (found)
+	{
+		/* our own keys are loaded again after their registration */
+		MemoryContextSwitchTo(old_mcxt);
+		return;
+	}
+
+	pair->keylen = keylen;
+	pair->key = pnstrdup(key, keylen);
+
+	kentry = hash_search(dict->key_cache, &hkey, HASH_ENTER, &found);
+	if (!found)
+		kentry->pairs = NIL;
+	kentry->pairs = lappend(kentry->pairs, pair);
+
+	MemoryContextSwitchTo(old_mcxt);
+}
+
+/*
+ * Load keys added to the dictionary after 'loaded_id'. Keys added
+ * by workers after the snapshot of the statement are seen with 'latest'.
+ */
+static void
+bulk_load_keys(bulk_dictionary *dict, bool latest)
+{
+	Oid			argtypes[2] = {OIDOID, INT4OID};
+	Datum		values[2];
+	Oid			save_userid;
+	int			save_sec_context;
+	char	   *sql;
+	uint64		i;
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "jsonbd: could not connect to SPI");
+
+	/* the user id is restored on error by the abort of the transaction */
+	GetUserIdAndSecContext(&save_userid, &save_sec_context);
+	SetUserIdAndSecContext(get_jsonbd_owner(),
+						   save_sec_context | SECURITY_LOCAL_USERID_CHANGE);
+
+	values[0] = ObjectIdGetDatum(dict->dictid);
+	values[1] = Int32GetDatum(dict->loaded_id);
+	sql = psprintf(sql_load,
+				   quote_identifier(get_namespace_name(get_jsonbd_schema())));
+
+	if (latest)
+		PushActiveSnapshot(GetLatestSnapshot());
+	if (SPI_execute_with_args(sql, 2, argtypes, values, NULL, true, 0) != SPI_OK_SELECT)
+		elog(ERROR, "jsonbd: could not load the dictionary");
+	if (latest)
+		PopActiveSnapshot();
+
+	for (i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple	tup = SPI_tuptable->vals[i];
+		bool		isnull;
+		uint32		id = DatumGetInt32(SPI_getbinval(tup, SPI_tuptable->tupdesc,
+													  1, &isnull));
+		text	   *key = DatumGetTextPP(SPI_getbinval(tup, SPI_tuptable->tupdesc,
+													   2, &isnull));
+
+		bulk_add_pair(dict, id, VARDATA_ANY(key), VARSIZE_ANY_EXHDR(key));
+		dict->loaded_id = Max(dict->loaded_id, id);
+	}
+
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+	SPI_finish();
+}
+
+/* Load all keys of the dictionary */
+static bulk_dictionary *
+bulk_load_dictionary(Oid dictid)
+{
+	bulk_dictionary *dict,
+					 loaded;
+	HASHCTL			 ctl;
+
+	if (bulk_mcxt == NULL)
+		bulk_mcxt = AllocSetContextCreate(TopMemoryContext,
+										  "jsonbd bulk load context",
+										  ALLOCSET_DEFAULT_SIZES);
+
+	if (bulk_dictionaries == NULL)
+	{
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(bulk_dictionary);
+		ctl.hcxt = bulk_mcxt;
+		bulk_dictionaries = hash_create("jsonbd bulk dictionaries", 16, &ctl,
+										HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	dict = hash_search(bulk_dictionaries, &dictid, HASH_FIND, NULL);
+	if (dict)
+		return dict;
+
+	/* the entry is added only when the dictionary is loaded */
+	memset(&loaded, 0, sizeof(loaded));
+	loaded.dictid = dictid;
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(uint32);
+	ctl.entrysize = sizeof(bulk_key_entry);
+	ctl.hcxt = bulk_mcxt;
+	loaded.key_cache = hash_create("jsonbd bulk map by key", 1024, &ctl,
+								   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	ctl.entrysize = sizeof(bulk_pair);
+	loaded.id_cache = hash_create("jsonbd bulk map by id", 1024, &ctl,
+								  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	bulk_load_keys(&loaded, false);
+
+	/* the block is reserved on the first new key */
+	loaded.next_id = loaded.last_id = loaded.loaded_id;
+
+	dict = hash_search(bulk_dictionaries, &dictid, HASH_ENTER, NULL);
+	*dict = loaded;
+	return dict;
+}
+
+/*
+ * New keys are known only to this backend until the commit, so parallel
+ * workers that could decode them are not started in this transaction.
+ * A parallel operation that is running already does not read them.
+ */
+static void
+bulk_disable_parallel(void)
+{
+	if (IsInParallelMode())
+		return;
+
+	(void) set_config_option("max_parallel_workers_per_gather", "0",
+							 PGC_USERSET, PGC_S_SESSION,
+							 GUC_ACTION_LOCAL, true, 0, false);
+	(void) set_config_option("max_parallel_maintenance_workers", "0",
+							 PGC_USERSET, PGC_S_SESSION,
+							 GUC_ACTION_LOCAL, true, 0, false);
+}
+
+static uint32
+bulk_find_id(bulk_dictionary *dict, const char *key, int keylen)
+{
+	uint32			 hkey = bulk_key_hash(key, keylen);
+	bulk_key_entry	*kentry;
+	ListCell		*lc;
+
+	kentry = hash_search(dict->key_cache, &hkey, HASH_FIND, NULL);
+	if (kentry == NULL)
+		return 0;
+
+	foreach(lc, kentry->pairs)
+	{
+		bulk_pair	*pair = (bulk_pair *) lfirst(lc);
+
+		if (pair->keylen == keylen && memcmp(pair->key, key, keylen) == 0)
+			return pair->id;
+	}
+
+	return 0;
+}
+
+/*
+ * Get ids of keys from the local dictionary, new keys get ids from
+ * the reserved block. Returns false if ids could not be reserved, then
+ * keys should be sent to workers.
+ */
+bool
+jsonbd_bulk_get_ids(Oid dictid, char **keys, uint32 *lens, uint32 *ids,
+					int nkeys)
+{
+	bulk_dictionary	*dict = bulk_load_dictionary(dictid);
+	bool			 refreshed = false;
+	int				 i;
+
+	for (i = 0; i < nkeys; i++)
+	{
+		MemoryContext	old_mcxt;
+
+		ids[i] = bulk_find_id(dict, keys[i], lens[i]);
+		if (ids[i] == 0 && !refreshed)
+		{
+			/* the key could be added by workers since the last load */
+			bulk_load_keys(dict, true);
+			refreshed = true;
+			ids[i] = bulk_find_id(dict, keys[i], lens[i]);
+		}
+
+		if (ids[i] != 0)
+			continue;
+
+		if (dict->next_id == dict->last_id)
+		{
+			uint32	first = jsonbd_reserve_ids(dictid, dict->last_id,
+											   JSONBD_BULK_ID_BLOCK);
+
+			if (first == 0)
+				return false;
+
+			dict->next_id = first - 1;
+			dict->last_id = first + JSONBD_BULK_ID_BLOCK - 1;
+		}
+
+		if (dict->pending == NIL)
+			bulk_disable_parallel();
+
+		ids[i] = ++dict->next_id;
+		bulk_add_pair(dict, ids[i], keys[i], lens[i]);
+
+		old_mcxt = MemoryContextSwitchTo(bulk_mcxt);
+		dict->pending = lappend(dict->pending,
+								hash_search(dict->id_cache, &ids[i],
+											HASH_FIND, NULL));
+		MemoryContextSwitchTo(old_mcxt);
+	}
+
+	return true;
+}
+
+/*
+ * Get the key from the local dictionary, keys that are not registered yet
+ * are known only here.
+ */
+bool
+jsonbd_bulk_get_key(Oid dictid, uint32 id, char **key, int *keylen)
+{
+	bulk_dictionary	*dict;
+	bulk_pair		*pair;
+
+	if (bulk_dictionaries == NULL)
+		return false;
+
+	dict = hash_search(bulk_dictionaries, &dictid, HASH_FIND, NULL);
+	if (dict == NULL)
+		return false;
+
+	pair = hash_search(dict->id_cache, &id, HASH_FIND, NULL);
+	if (pair == NULL)
+		return false;
+
+	*key = pair->key;
+	*keylen = pair->keylen;
+	return true;
+}
+
+/* Insert new keys of the dictionary with one statement */
+static void
+bulk_register(bulk_dictionary *dict, const char *nspname)
+{
+	int			n = list_length(dict->pending),
+				i = 0;
+	Datum	   *ids = palloc(sizeof(Datum) * n),
+			   *keys = palloc(sizeof(Datum) * n),
+			   *hashes = palloc(sizeof(Datum) * n);
+	Oid			argtypes[4] = {OIDOID, INT4ARRAYOID, TEXTARRAYOID, INT8ARRAYOID};
+	Datum		values[4];
+	ListCell   *lc;
+
+	foreach(lc, dict->pending)
+	{
+		bulk_pair  *pair = (bulk_pair *) lfirst(lc);
+
+		ids[i] = Int32GetDatum(pair->id);
+		keys[i] = PointerGetDatum(cstring_to_text_with_len(pair->key,
+														   pair->keylen));
+		hashes[i] = jsonbd_key_hash(pair->key, pair->keylen);
+		i++;
+	}
+
+	values[0] = ObjectIdGetDatum(dict->dictid);
+	values[1] = PointerGetDatum(construct_array(ids, n, INT4OID, 4, true, 'i'));
+	values[2] = PointerGetDatum(construct_array(keys, n, TEXTOID, -1, false, 'i'));
+	values[3] = PointerGetDatum(construct_array(hashes, n, INT8OID, 8,
+												FLOAT8PASSBYVAL, 'd'));
+
+	if (SPI_execute_with_args(psprintf(sql_register, nspname), 4, argtypes,
+							  values, NULL, false, 0) != SPI_OK_INSERT)
+		elog(ERROR, "jsonbd: could not register new keys");
+}
+
+static void
+bulk_xact_callback(XactEvent event, void *arg)
+{
+	HASH_SEQ_STATUS		 status;
+	bulk_dictionary		*dict;
+	char				*nspname = NULL;
+	Oid					 save_userid = InvalidOid;
+	int					 save_sec_context = 0;
+
+	if (bulk_dictionaries == NULL)
+		return;
+
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+		case XACT_EVENT_PRE_PREPARE:
+			hash_seq_init(&status, bulk_dictionaries);
+			while ((dict = (bulk_dictionary *) hash_seq_search(&status)) != NULL)
+			{
+				if (dict->pending == NIL)
+					continue;
+
+				if (nspname == NULL)
+				{
+					nspname = (char *) quote_identifier(
+								get_namespace_name(get_jsonbd_schema()));
+					if (SPI_connect() != SPI_OK_CONNECT)
+						elog(ERROR, "jsonbd: could not connect to SPI");
+
+					GetUserIdAndSecContext(&save_userid, &save_sec_context);
+					SetUserIdAndSecContext(get_jsonbd_owner(),
+										   save_sec_context | SECURITY_LOCAL_USERID_CHANGE);
+				}
+
+				bulk_register(dict, nspname);
+			}
+
+			if (nspname != NULL)
+			{
+				SetUserIdAndSecContext(save_userid, save_sec_context);
+				SPI_finish();
+			}
+			break;
+		case XACT_EVENT_COMMIT:
+			hash_seq_init(&status, bulk_dictionaries);
+			while ((dict = (bulk_dictionary *) hash_seq_search(&status)) != NULL)
+			{
+				list_free(dict->pending);
+				dict->pending = NIL;
+			}
+			break;
+		case XACT_EVENT_PREPARE:
+		case XACT_EVENT_ABORT:
+			/*
+			 * Not registered keys are lost with the transaction, they should
+			 * not be used anymore. Keys of a prepared transaction could be
+			 * lost too. The dictionaries are loaded again.
+			 */
+			hash_seq_init(&status, bulk_dictionaries);
+			while ((dict = (bulk_dictionary *) hash_seq_search(&status)) != NULL)
+			{
+				if (dict->pending != NIL)
+				{
+					hash_seq_term(&status);
+					MemoryContextDelete(bulk_mcxt);
+					bulk_mcxt = NULL;
+					bulk_dictionaries = NULL;
+					/* shapes could use the lost ids */
+					jsonbd_shape_reset();
+					break;
+				}
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+/* Should be called from _PG_init */
+void
+jsonbd_bulk_init(void)
+{
+	RegisterXactCallback(bulk_xact_callback, NULL);
+}
@@ -0,0 +1,311 @@
+#include "jsonbd.h"
+
+#include "postgres.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/hsearch.h"
+
+/*
+ * Cache of keys by their ids in shared memory.
+ *
+ * Workers return only committed keys, and a committed key never changes
+ * its id, so pairs can be shared by all backends without invalidation until
+ * the dictionary is dropped (see jsonbd_shared_cache_purge). Backends
+ * (including parallel workers) look up keys here before asking dictionary
+ * workers, workers put here every key they return. Long keys are not cached.
+ *
+ * A backend that misses a key claims it by adding a not loaded entry, other
+ * backends see that the key is being loaded and wait for it instead of
+ * requesting it from workers too.
+ *
+ * A shared hash table takes more entries than requested while there is
+ * free shared memory, so the count of entries is kept in the header and
+ * keys are not cached after jsonbd.shared_cache_size.
+ */
+
+typedef struct jsonbd_shared_header
+{
+	pg_atomic_uint32	nentries;
+} jsonbd_shared_header;
+
+typedef struct jsonbd_shared_entry
+{
+	jsonbd_shared_key	key;
+	bool				loaded;		/* false while the key is being loaded */
+	uint16				keylen;
+	char				keydata[JSONBD_SHARED_KEY_LEN];
+} jsonbd_shared_entry;
+
+static jsonbd_shared_header *shared_header = NULL;
+static HTAB			   *shared_cache = NULL;
+static LWLockPadded	   *cache_locks = NULL;
+
+int		jsonbd_shared_cache_size = 0;
+
+static Size
+jsonbd_shared_cache_shmem_size(void)
+{
+	return add_size(MAXALIGN(sizeof(jsonbd_shared_header)),
+					hash_estimate_size(jsonbd_shared_cache_size,
+									   sizeof(jsonbd_shared_entry)));
+}
+
+/* Should be called from _PG_init */
+void
+jsonbd_shared_cache_request(void)
+{
+	if (jsonbd_shared_cache_size == 0)
+		return;
+
+	RequestNamedLWLockTranche(JSONBD_CACHE_LWLOCKS_TRANCHE,
+							  JSONBD_CACHE_PARTITIONS);
+	RequestAddinShmemSpace(jsonbd_shared_cache_shmem_size());
+}
+
+/* Should be called from shmem startup hook with AddinShmemInitLock held */
+void
+jsonbd_shared_cache_startup(void)
+{
+	HASHCTL		info;
+	bool		found;
+
+	if (jsonbd_shared_cache_size == 0)
+		return;
+
+	shared_header = ShmemInitStruct("jsonbd shared cache header",
+									sizeof(jsonbd_shared_header), &found);
+	if (!found)
+		pg_atomic_init_u32(&shared_header->nentries, 0);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(jsonbd_shared_key);
+	info.entrysize = sizeof(jsonbd_shared_entry);
+	info.num_partitions = JSONBD_CACHE_PARTITIONS;
+
+	shared_cache = ShmemInitHash("jsonbd shared cache",
+								 jsonbd_shared_cache_size,
+								 jsonbd_shared_cache_size,
+								 &info,
+								 HASH_ELEM | HASH_BLOBS | HASH_PARTITION);
+	cache_locks = GetNamedLWLockTranche(JSONBD_CACHE_LWLOCKS_TRANCHE);
+}
+
+static LWLock *
+partition_lock(uint32 hashcode)
+{
+	return &cache_locks[hashcode % JSONBD_CACHE_PARTITIONS].lock;
+}
+
+/*
+ * Add the entry for the key if the cache is not full, returns NULL
+ * otherwise. The partition lock should be held exclusively.
+ */
+static jsonbd_shared_entry *
+cache_enter(jsonbd_shared_key *key, uint32 hashcode, bool *found)
+{
+	jsonbd_shared_entry	*entry;
+	uint32				 n;
+
+	entry = hash_search_with_hash_value(shared_cache, key, hashcode,
+										HASH_FIND, NULL);
+	if (entry)
+	{
+		*found = true;
+		return entry;
+	}
+
+	n = pg_atomic_read_u32(&shared_header->nentries);
+	do
+	{
+		if (n >= (uint32) jsonbd_shared_cache_size)
+			return NULL;
+	} while (!pg_atomic_compare_exchange_u32(&shared_header->nentries, &n, n + 1));
+
+	entry = hash_search_with_hash_value(shared_cache, key, hashcode,
+										HASH_ENTER_NULL, found);
+	if (entry == NULL)
+		pg_atomic_fetch_sub_u32(&shared_header->nentries, 1);
+
+	return entry;
+}
+
+/* Remove the entry, the partition lock should be held exclusively */
+static void
+cache_remove(jsonbd_shared_key *key, uint32 hashcode)
+{
+	if (hash_search_with_hash_value(shared_cache, key, hashcode,
+									HASH_REMOVE, NULL))
+		pg_atomic_fetch_sub_u32(&shared_header->nentries, 1);
+}
+
+/*
+ * Look up the key in the cache. If it's found, a palloc'd copy of the key
+ * (not null-terminated) is returned in 'keydata'. If it's not found and
+ * 'claim' is true, the key is marked as being loaded by us, the caller
+ * should load it or release the claim.
+ */
+jsonbd_cache_result
+jsonbd_shared_cache_lookup(Oid dictid, uint32 id, bool claim,
+						   char **keydata, int *keylen)
+{
+	jsonbd_shared_key	 key;
+	jsonbd_shared_entry	*entry;
+	uint32				 hashcode;
+	LWLock				*lock;
+	bool				 found;
+	jsonbd_cache_result	 res = JSONBD_CACHE_MISS;
+
+	if (shared_cache == NULL)
+		return JSONBD_CACHE_MISS;
+
+	key.dictid = dictid;
+	key.id = id;
+	hashcode = get_hash_value(shared_cache, &key);
+	lock = partition_lock(hashcode);
+
+	LWLockAcquire(lock, LW_SHARED);
+	entry = hash_search_with_hash_value(shared_cache, &key, hashcode,
+										HASH_FIND, NULL);
+	if (entry && entry->loaded)
+	{
+		*keydata = palloc(entry->keylen);
+		memcpy(*keydata, entry->keydata, entry->keylen);
+		*keylen = entry->keylen;
+		res = JSONBD_CACHE_FOUND;
+	}
+	else if (entry)
+		res = JSONBD_CACHE_LOADING;
+	LWLockRelease(lock);
+
+	if (res != JSONBD_CACHE_MISS || !claim)
+		return res;
+
+	/* claim the key, someone could do it before us */
+	LWLockAcquire(lock, LW_EXCLUSIVE);
+	entry = cache_enter(&key, hashcode, &found);
+	if (entry == NULL)
+		res = JSONBD_CACHE_MISS;	/* the cache is full */
+	else if (!found)
+	{
+		entry->loaded = false;
+		entry->keylen = 0;
+		res = JSONBD_CACHE_CLAIMED;
+	}
+	else if (entry->loaded)
+	{
+		*keydata = palloc(entry->keylen);
+		memcpy(*keydata, entry->keydata, entry->keylen);
+		*keylen = entry->keylen;
+		res = JSONBD_CACHE_FOUND;
+	}
+	else
+		res = JSONBD_CACHE_LOADING;
+	LWLockRelease(lock);
+
+	return res;
+}
+
+/*
+ * Put the key into the cache, if there is a room for it. Claims of keys
+ * that could not be cached are removed, so waiters load them themselves.
+ */
+void
+jsonbd_shared_cache_put(Oid dictid, uint32 id, const char *keydata, int keylen)
+{
+	jsonbd_shared_key	 key;
+	jsonbd_shared_entry	*entry;
+	uint32				 hashcode;
+	LWLock				*lock;
+	bool				 found;
+
+	if (shared_cache == NULL)
+		return;
+
+	key.dictid = dictid;
+	key.id = id;
+	hashcode = get_hash_value(shared_cache, &key);
+	lock = partition_lock(hashcode);
+
+	LWLockAcquire(lock, LW_EXCLUSIVE);
+	if (keylen > JSONBD_SHARED_KEY_LEN)
+	{
+		entry = hash_search_with_hash_value(shared_cache, &key, hashcode,
+											HASH_FIND, NULL);
+		if (entry && !entry->loaded)
+			cache_remove(&key, hashcode);
+	}
+	else
+	{
+		entry = cache_enter(&key, hashcode, &found);
+
+		/* the cache is full, that's ok */
+		if (entry && (!found || !entry->loaded))
+		{
+			entry->keylen = keylen;
+			memcpy(entry->keydata, keydata, keylen);
+			entry->loaded = true;
+		}
+	}
+	LWLockRelease(lock);
+}
+
+/* Remove claims of the keys that were not loaded */
+void
+jsonbd_shared_cache_release(Oid dictid, uint32 *ids, int n)
+{
+	int		i;
+
+	if (shared_cache == NULL)
+		return;
+
+	for (i = 0; i < n; i++)
+	{
+		jsonbd_shared_key	 key;
+		jsonbd_shared_entry	*entry;
+		uint32				 hashcode;
+		LWLock				*lock;
+
+		key.dictid = dictid;
+		key.id = ids[i];
+		hashcode = get_hash_value(shared_cache, &key);
+		lock = partition_lock(hashcode);
+
+		LWLockAcquire(lock, LW_EXCLUSIVE);
+		entry = hash_search_with_hash_value(shared_cache, &key, hashcode,
+											HASH_FIND, NULL);
+		if (entry && !entry->loaded)
+			cache_remove(&key, hashcode);
+		LWLockRelease(lock);
+	}
+}
+
+/*
+ * Remove all keys of the dictionary, used when the dictionary is dropped.
+ * Locks all partitions, so it should be called rarely.
+ */
+void
+jsonbd_shared_cache_purge(Oid dictid)
+{
+	HASH_SEQ_STATUS			 status;
+	jsonbd_shared_entry		*entry;
+	int						 i;
+
+	if (shared_cache == NULL)
+		return;
+
+	for (i = 0; i < JSONBD_CACHE_PARTITIONS; i++)
+		LWLockAcquire(&cache_locks[i].lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&status, shared_cache);
+	while ((entry = (jsonbd_shared_entry *) hash_seq_search(&status)) != NULL)
+	{
+		if (entry->key.dictid == dictid &&
+			hash_search(shared_cache, &entry->key, HASH_REMOVE, NULL))
+			pg_atomic_fetch_sub_u32(&shared_header->nentries, 1);
+	}
+
+	for (i = JSONBD_CACHE_PARTITIONS - 1; i >= 0; i--)
+		LWLockRelease(&cache_locks[i].lock);
+}
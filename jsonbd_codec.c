@@ -0,0 +1,111 @@
+#include "jsonbd.h"
+#include "jsonbd_codec.h"
+
+#include "postgres.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define JSONBD_USE_SSSE3
+#include <tmmintrin.h>
+#endif
+
+/*
+ * Decoders of key id streams. The scalar decoder is used by default,
+ * the vectorized one is chosen by jsonbd_codec_init if CPU supports it.
+ */
+
+static int decode_stream_scalar(const unsigned char *ptr, int len,
+								uint32 *ids, int n);
+
+jsonbd_stream_decoder jsonbd_decode_stream = decode_stream_scalar;
+
+static int
+decode_stream_scalar(const unsigned char *ptr, int len, uint32 *ids, int n)
+{
+	return decode_stream(ptr, len, ids, n);
+}
+
+#ifdef JSONBD_USE_SSSE3
+
+/*
+ * For each control byte: shuffle mask that moves bytes of four ids to their
+ * places in four uint32 (0xFF gives zero byte), and the length of the ids.
+ */
+static uint8	shuffle_masks[256][16];
+static uint8	group_lengths[256];
+
+static void
+init_shuffle_masks(void)
+{
+	int		c;
+
+	for (c = 0; c < 256; c++)
+	{
+		int		i,
+				j,
+				offset = 0;
+
+		for (i = 0; i < 4; i++)
+		{
+			int		len = ((c >> (i * 2)) & 3) + 1;
+
+			for (j = 0; j < 4; j++)
+				shuffle_masks[c][i * 4 + j] = j < len ? offset + j : 0xFF;
+
+			offset += len;
+		}
+		group_lengths[c] = offset;
+	}
+}
+
+/*
+ * Decodes four ids per control byte with one shuffle. 16 bytes are loaded
+ * at once, so the last groups are decoded by scalar code to not read
+ * after the end of the stream.
+ */
+__attribute__((target("ssse3")))
+static int
+decode_stream_ssse3(const unsigned char *ptr, int len, uint32 *ids, int n)
+{
+	const unsigned char *end = ptr + len,
+						*ctrl = ptr + 1,
+						*data = ctrl + JSONBD_STREAM_CTRLLEN(n);
+	int					 i;
+
+	if (len < 1 || ptr[0] != JSONBD_STREAM_MARKER || data > end)
+		return -1;
+
+	for (i = 0; i + 4 <= n && data + 16 <= end; i += 4)
+	{
+		uint8		c = ctrl[i >> 2];
+		__m128i		val,
+					mask;
+
+		val = _mm_loadu_si128((const __m128i *) data);
+		mask = _mm_loadu_si128((const __m128i *) shuffle_masks[c]);
+		_mm_storeu_si128((__m128i *) &ids[i], _mm_shuffle_epi8(val, mask));
+		data += group_lengths[c];
+	}
+
+	if (data > end)
+		return -1;
+
+	/* the rest */
+	data = decode_stream_part(ctrl + (i >> 2), data, end, ids + i, n - i);
+	return data == end ? 0 : -1;
+}
+
+#endif
+
+/* Should be called from _PG_init */
+void
+jsonbd_codec_init(void)
+{
+#ifdef JSONBD_USE_SSSE3
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3"))
+	{
+		init_shuffle_masks();
+		jsonbd_decode_stream = decode_stream_ssse3;
+	}
+#endif
+}
@@ -0,0 +1,207 @@
+#ifndef JSONBD_CODEC_H
+#define JSONBD_CODEC_H
+
+/*
+ * Encoding of key ids, shared by the extension and the client library,
+ * so it should not depend on PostgreSQL headers.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* maximum length of varbyte-encoded uint32 */
+#define JSONBD_VARBYTE_MAXLEN	5
+
+/*
+ * Varbyte-encode 'val' into *ptr.
+ */
+static inline void
+encode_varbyte(uint32_t val, unsigned char *ptr, int *len)
+{
+	unsigned char *p = ptr;
+
+	while (val > 0x7F)
+	{
+		*(p++) = 0x80 | (val & 0x7F);
+		val >>= 7;
+	}
+	*(p++) = (unsigned char) val;
+	*len = p - ptr;
+}
+
+/*
+ * Decode varbyte-encoded integer at *ptr.
+ */
+static inline uint32_t
+decode_varbyte(unsigned char *ptr)
+{
+	uint32_t	val;
+	unsigned char *p = ptr;
+	uint32_t	c;
+
+	c = *(p++);
+	val = c & 0x7F;
+	if (c & 0x80)
+	{
+		c = *(p++);
+		val |= (c & 0x7F) << 7;
+		if (c & 0x80)
+		{
+			c = *(p++);
+			val |= (c & 0x7F) << 14;
+			if (c & 0x80)
+			{
+				c = *(p++);
+				val |= (c & 0x7F) << 21;
+				if (c & 0x80)
+				{
+					c = *(p++);
+					val |= c << 28;
+				}
+			}
+		}
+	}
+
+	return val;
+}
+
+/*
+ * Decode the list of 'len' bytes of varbyte-encoded ids into 'ids' (if not
+ * NULL). Zero bytes between ids are padding, ids are never zero. Returns
+ * the number of ids or -1 if the list is broken.
+ */
+static inline int
+decode_varbyte_list(const unsigned char *ptr, size_t len, uint32_t *ids)
+{
+	size_t		i = 0;
+	int			n = 0;
+
+	while (i < len)
+	{
+		size_t		start = i;
+
+		if (ptr[i] == 0)
+		{
+			i++;
+			continue;
+		}
+
+		while (i < len && (ptr[i] & 0x80))
+			i++;
+
+		if (i == len || i - start >= JSONBD_VARBYTE_MAXLEN)
+			return -1;
+
+		if (ids)
+			ids[n] = decode_varbyte((unsigned char *) ptr + start);
+		n++;
+		i++;
+	}
+
+	return n;
+}
+
+/*
+ * Stream format of key ids.
+ *
+ * All key ids of an object are saved in the first key as one stream, other
+ * keys are empty. The stream starts with JSONBD_STREAM_MARKER (varbyte
+ * encoded ids are never zero, so it can't be confused with them), then go
+ * control bytes, two bits for each id with its length in bytes minus one,
+ * then go ids themselves in little-endian order. So four ids could be
+ * decoded at once using one control byte.
+ */
+#define JSONBD_STREAM_MARKER		0x00
+#define JSONBD_STREAM_CTRLLEN(n)	(((n) + 3) / 4)
+#define JSONBD_STREAM_MAXLEN(n)		(1 + JSONBD_STREAM_CTRLLEN(n) + 4 * (n))
+
+/*
+ * Encode 'n' ids into stream at *ptr, returns the length of the stream
+ * (including the marker).
+ */
+static inline int
+encode_stream(const uint32_t *ids, int n, unsigned char *ptr)
+{
+	unsigned char *ctrl = ptr + 1,
+				  *data = ctrl + JSONBD_STREAM_CTRLLEN(n);
+	int			i;
+
+	ptr[0] = JSONBD_STREAM_MARKER;
+	for (i = 0; i < JSONBD_STREAM_CTRLLEN(n); i++)
+		ctrl[i] = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		uint32_t	val = ids[i];
+		int			len = 1;
+
+		*(data++) = val & 0xFF;
+		while ((val >>= 8) > 0)
+		{
+			*(data++) = val & 0xFF;
+			len++;
+		}
+		ctrl[i >> 2] |= (len - 1) << ((i & 3) * 2);
+	}
+
+	return data - ptr;
+}
+
+/*
+ * Decode 'n' ids using control bytes at *ctrl and data at *data, 'end' is
+ * the end of the stream. Returns the pointer after the last decoded id
+ * or NULL if the stream is broken.
+ */
+static inline const unsigned char *
+decode_stream_part(const unsigned char *ctrl, const unsigned char *data,
+				   const unsigned char *end, uint32_t *ids, int n)
+{
+	int			i;
+
+	for (i = 0; i < n; i++)
+	{
+		int			len = ((ctrl[i >> 2] >> ((i & 3) * 2)) & 3) + 1;
+		uint32_t	val = 0;
+
+		if (data + len > end)
+			return NULL;
+
+		switch (len)
+		{
+			case 4:
+				val |= (uint32_t) data[3] << 24;
+				/* fallthrough */
+			case 3:
+				val |= (uint32_t) data[2] << 16;
+				/* fallthrough */
+			case 2:
+				val |= (uint32_t) data[1] << 8;
+				/* fallthrough */
+			case 1:
+				val |= data[0];
+		}
+		ids[i] = val;
+		data += len;
+	}
+
+	return data;
+}
+
+/*
+ * Decode 'n' ids from the stream at *ptr of length 'len' (including
+ * the marker). Returns 0 on success or -1 if the stream is broken.
+ */
+static inline int
+decode_stream(const unsigned char *ptr, int len, uint32_t *ids, int n)
+{
+	const unsigned char *end = ptr + len,
+						*ctrl = ptr + 1,
+						*data = ctrl + JSONBD_STREAM_CTRLLEN(n);
+
+	if (len < 1 || ptr[0] != JSONBD_STREAM_MARKER || data > end)
+		return -1;
+
+	return decode_stream_part(ctrl, data, end, ids, n) == end ? 0 : -1;
+}
+
+#endif
@@ -0,0 +1,842 @@
+#include "jsonbd.h"
+#include "jsonbd_utils.h"
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "access/hash.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "catalog/objectaccess.h"
+#include "catalog/pg_database.h"
+#include "catalog/pg_extension.h"
+#include "catalog/pg_type.h"
+#include "commands/extension.h"
+#include "executor/spi.h"
+#include "port/atomics.h"
+#include "storage/fd.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+
+/*
+ * Frozen dictionaries.
+ *
+ * jsonbd_freeze writes all keys of a dictionary to an immutable file, which
+ * is mapped to memory by backends, so keys of frozen dictionaries are
+ * resolved without workers, locks and copies. Keys added after freezing
+ * are resolved by workers as usual, they are the mutable overlay of the
+ * frozen part. Committed keys never change their ids, so an outdated file
+ * is still correct, it just knows fewer keys.
+ *
+ * The file consists of the header, the table of key offsets by id,
+ * the minimal perfect hash index of keys and the arena of keys ordered by id.
+ *
+ * The index is built with CHD (compress, hash and displace): keys are split
+ * into small buckets, each bucket has a displacement that moves all its
+ * keys to free slots, the number of slots equals the number of keys.
+ * Lookup of a key takes one hash, one probe and one comparison of keys.
+ *
+ * A shared generation counter is incremented when a file is written or
+ * a dictionary is dropped, backends drop their mappings and cached shapes
+ * when they see a new generation.
+ * Files of the database are removed when the extension or the database
+ * is dropped, so a dictionary with a reused OID doesn't map an old file.
+ */
+
+#define JSONBD_FROZEN_MAGIC		0x4A534244
+#define JSONBD_FROZEN_VERSION	2
+#define JSONBD_FROZEN_DIR		"pg_jsonbd"
+#define JSONBD_FROZEN_ABSENT	0xFFFFFFFF
+
+#define JSONBD_PHASH_BUCKET_SIZE	4	/* average number of keys in a bucket */
+#define JSONBD_PHASH_MAX_ROUNDS		64	/* tries per bucket, in slots count */
+#define JSONBD_PHASH_MAX_SEEDS		32
+
+typedef struct jsonbd_frozen_header
+{
+	uint32	magic;
+	uint32	version;
+	Oid		dictid;
+	uint32	maxid;			/* number of entries in the offsets table */
+	uint32	nslots;			/* number of indexed keys */
+	uint32	nbuckets;
+	uint32	seed;
+	uint32	arenalen;
+} jsonbd_frozen_header;
+
+typedef struct jsonbd_frozen_entry
+{
+	uint32	offset;			/* JSONBD_FROZEN_ABSENT if there is no such id */
+	uint32	len;
+} jsonbd_frozen_entry;
+
+struct jsonbd_frozen
+{
+	Oid						 dictid;
+	char					*addr;		/* NULL if the dictionary is not frozen */
+	size_t					 size;
+	uint32					 maxid;
+	uint32					 nslots;
+	uint32					 nbuckets;
+	uint32					 seed;
+	jsonbd_frozen_entry		*entries;
+	uint32					*displacements;	/* by bucket */
+	uint32					*slots;			/* ids */
+	char					*arena;
+};
+
+static pg_atomic_uint64	   *frozen_generation = NULL;
+static uint64				local_generation = 0;
+static HTAB				   *frozen_maps = NULL;
+static List				   *dropped_databases = NIL;
+
+static object_access_hook_type prev_object_access_hook = NULL;
+
+PG_FUNCTION_INFO_V1(jsonbd_freeze);
+
+static const char *sql_get_dictid = \
+	"SELECT COALESCE((SELECT dictid FROM %s.jsonbd_attachments"
+	" WHERE acoid = $1), $1)";
+
+static const char *sql_get_keys = \
+	"SELECT id, key FROM %s.jsonbd_export_dictionary($1) ORDER BY id";
+
+/* Should be called from _PG_init */
+void
+jsonbd_frozen_request(void)
+{
+	RequestAddinShmemSpace(sizeof(pg_atomic_uint64));
+}
+
+/* Remember databases which files should be removed on commit */
+static void
+frozen_object_access(ObjectAccessType access, Oid classId, Oid objectId,
+					 int subId, void *arg)
+{
+	Oid				dbid = InvalidOid;
+	MemoryContext	old_mcxt;
+
+	if (prev_object_access_hook)
+		prev_object_access_hook(access, classId, objectId, subId, arg);
+
+	if (access != OAT_DROP)
+		return;
+
+	if (classId == DatabaseRelationId)
+		dbid = objectId;
+	else if (classId == ExtensionRelationId &&
+			 objectId == get_extension_oid("jsonbd", true))
+		dbid = MyDatabaseId;
+
+	if (!OidIsValid(dbid))
+		return;
+
+	old_mcxt = MemoryContextSwitchTo(TopMemoryContext);
+	dropped_databases = lappend_oid(dropped_databases, dbid);
+	MemoryContextSwitchTo(old_mcxt);
+}
+
+/*
+ * Files of a prepared drop of the extension are kept, the extension
+ * could still be used if it's rolled back.
+ */
+static void
+frozen_xact_callback(XactEvent event, void *arg)
+{
+	ListCell   *lc;
+	char		dir[MAXPGPATH];
+	struct stat	st;
+
+	if (dropped_databases == NIL)
+		return;
+
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+			foreach(lc, dropped_databases)
+			{
+				snprintf(dir, MAXPGPATH, "%s/%u", JSONBD_FROZEN_DIR,
+						 lfirst_oid(lc));
+				if (stat(dir, &st) == 0 && rmtree(dir, true))
+					pg_atomic_fetch_add_u64(frozen_generation, 1);
+			}
+			/* FALLTHROUGH */
+		case XACT_EVENT_PREPARE:
+		case XACT_EVENT_ABORT:
+			list_free(dropped_databases);
+			dropped_databases = NIL;
+			break;
+		default:
+			break;
+	}
+}
+
+/* Should be called from _PG_init */
+void
+jsonbd_frozen_init(void)
+{
+	prev_object_access_hook = object_access_hook;
+	object_access_hook = frozen_object_access;
+	RegisterXactCallback(frozen_xact_callback, NULL);
+}
+
+/* Should be called from shmem startup hook with AddinShmemInitLock held */
+void
+jsonbd_frozen_startup(void)
+{
+	bool	found;
+
+	frozen_generation = ShmemInitStruct("jsonbd frozen generation",
+										sizeof(pg_atomic_uint64), &found);
+	if (!found)
+		pg_atomic_init_u64(frozen_generation, 0);
+}
+
+static char *
+frozen_file_path(Oid dictid, bool create_dir)
+{
+	char	dir[MAXPGPATH];
+
+	if (create_dir)
+	{
+		if (MakePGDirectory(JSONBD_FROZEN_DIR) < 0 && errno != EEXIST)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not create directory \"%s\": %m",
+							JSONBD_FROZEN_DIR)));
+	}
+
+	snprintf(dir, MAXPGPATH, "%s/%u", JSONBD_FROZEN_DIR, MyDatabaseId);
+	if (create_dir)
+	{
+		if (MakePGDirectory(dir) < 0 && errno != EEXIST)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not create directory \"%s\": %m", dir)));
+	}
+
+	return psprintf("%s/%u.dict", dir, dictid);
+}
+
+static void
+unmap_frozen(jsonbd_frozen *frozen)
+{
+	if (frozen->addr != NULL && munmap(frozen->addr, frozen->size) != 0)
+		elog(WARNING, "jsonbd: could not unmap frozen dictionary %u: %m",
+			 frozen->dictid);
+
+	frozen->addr = NULL;
+}
+
+/*
+ * Hash of the key for the perfect hash: the bucket and two values that give
+ * the slot with the displacement of the bucket. All are taken from one
+ * 64-bit hash, the second value is remixed so it doesn't repeat the first.
+ */
+static inline void
+frozen_key_hash(const char *key, int keylen, uint32 seed, uint32 nbuckets,
+				uint32 nslots, uint32 *bucket, uint32 *h1, uint32 *h2)
+{
+	uint64	h = DatumGetUInt64(hash_any_extended((const unsigned char *) key,
+												 keylen, seed));
+
+	*bucket = (uint32) h % nbuckets;
+	*h1 = (uint32) (h >> 32) % nslots;
+	*h2 = (uint32) ((h * UINT64CONST(0x9E3779B97F4A7C15)) >> 32) % nslots;
+}
+
+/* Slot of the key for displacement 'd' */
+static inline uint32
+frozen_slot(uint32 h1, uint32 h2, uint32 d, uint32 nslots)
+{
+	return (uint32) ((h1 + (uint64) (d / nslots) * h2 + d % nslots) % nslots);
+}
+
+/*
+ * Lookups trust the mapped tables, so every key should lie in the arena
+ * and every slot should point to a key.
+ */
+static bool
+frozen_valid(jsonbd_frozen *frozen, uint32 arenalen)
+{
+	uint32	i;
+
+	for (i = 0; i < frozen->maxid; i++)
+	{
+		jsonbd_frozen_entry *entry = &frozen->entries[i];
+
+		if (entry->offset != JSONBD_FROZEN_ABSENT &&
+			(uint64) entry->offset + entry->len > arenalen)
+			return false;
+	}
+
+	for (i = 0; i < frozen->nslots; i++)
+	{
+		uint32	id = frozen->slots[i];
+
+		if (id > frozen->maxid ||
+			(id != 0 && frozen->entries[id - 1].offset == JSONBD_FROZEN_ABSENT))
+			return false;
+	}
+
+	return true;
+}
+
+/* Map the file of the dictionary, a broken file is ignored */
+static void
+map_frozen(jsonbd_frozen *frozen)
+{
+	char					*path = frozen_file_path(frozen->dictid, false);
+	int						 fd;
+	struct stat				 st;
+	void					*addr;
+	jsonbd_frozen_header	*hdr;
+	size_t					 expected;
+
+	frozen->addr = NULL;
+
+	fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+	{
+		if (errno != ENOENT)
+			elog(WARNING, "jsonbd: could not open \"%s\": %m", path);
+		pfree(path);
+		return;
+	}
+
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(jsonbd_frozen_header))
+	{
+		CloseTransientFile(fd);
+		elog(WARNING, "jsonbd: invalid frozen dictionary \"%s\"", path);
+		pfree(path);
+		return;
+	}
+
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	CloseTransientFile(fd);
+	if (addr == MAP_FAILED)
+	{
+		elog(WARNING, "jsonbd: could not map \"%s\": %m", path);
+		pfree(path);
+		return;
+	}
+
+	hdr = (jsonbd_frozen_header *) addr;
+	expected = sizeof(jsonbd_frozen_header) +
+		sizeof(jsonbd_frozen_entry) * (size_t) hdr->maxid +
+		sizeof(uint32) * ((size_t) hdr->nbuckets + hdr->nslots) + hdr->arenalen;
+
+	if (hdr->magic != JSONBD_FROZEN_MAGIC ||
+		hdr->version != JSONBD_FROZEN_VERSION ||
+		hdr->dictid != frozen->dictid ||
+		hdr->nbuckets == 0 || expected != st.st_size)
+	{
+		munmap(addr, st.st_size);
+		elog(WARNING, "jsonbd: invalid frozen dictionary \"%s\"", path);
+		pfree(path);
+		return;
+	}
+
+	frozen->addr = addr;
+	frozen->size = st.st_size;
+	frozen->maxid = hdr->maxid;
+	frozen->nslots = hdr->nslots;
+	frozen->nbuckets = hdr->nbuckets;
+	frozen->seed = hdr->seed;
+	frozen->entries = (jsonbd_frozen_entry *) (frozen->addr + sizeof(*hdr));
+	frozen->displacements = (uint32 *) (frozen->entries + hdr->maxid);
+	frozen->slots = frozen->displacements + hdr->nbuckets;
+	frozen->arena = (char *) (frozen->slots + hdr->nslots);
+
+	if (!frozen_valid(frozen, hdr->arenalen))
+	{
+		unmap_frozen(frozen);
+		elog(WARNING, "jsonbd: invalid frozen dictionary \"%s\"", path);
+	}
+
+	pfree(path);
+}
+
+/*
+ * Drop mappings if some dictionary was frozen or removed since the last
+ * call. Keys returned by the frozen dictionaries are valid until the next
+ * call, so it should be called only before processing of a datum.
+ */
+void
+jsonbd_frozen_check(void)
+{
+	HASH_SEQ_STATUS	 status;
+	jsonbd_frozen	*frozen;
+	uint64			 generation;
+
+	if (frozen_generation == NULL)
+		return;
+
+	generation = pg_atomic_read_u64(frozen_generation);
+	if (generation == local_generation)
+		return;
+
+	if (frozen_maps)
+	{
+		hash_seq_init(&status, frozen_maps);
+		while ((frozen = (jsonbd_frozen *) hash_seq_search(&status)) != NULL)
+		{
+			unmap_frozen(frozen);
+			hash_search(frozen_maps, &frozen->dictid, HASH_REMOVE, NULL);
+		}
+	}
+
+	/* ids of a dropped dictionary could be taken by other keys */
+	jsonbd_shape_reset();
+	local_generation = generation;
+}
+
+/* Returns the frozen part of the dictionary, or NULL if it's not frozen */
+jsonbd_frozen *
+jsonbd_frozen_open(Oid dictid)
+{
+	jsonbd_frozen	*frozen;
+	bool			 found;
+
+	if (frozen_generation == NULL)
+		return NULL;
+
+	if (frozen_maps == NULL)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(jsonbd_frozen);
+		frozen_maps = hash_create("jsonbd frozen dictionaries", 16, &ctl,
+								  HASH_ELEM | HASH_BLOBS);
+	}
+
+	frozen = hash_search(frozen_maps, &dictid, HASH_ENTER, &found);
+	if (!found)
+		map_frozen(frozen);
+
+	return frozen->addr ? frozen : NULL;
+}
+
+bool
+jsonbd_frozen_get_key(jsonbd_frozen *frozen, uint32 id, char **key,
+					  int *keylen)
+{
+	jsonbd_frozen_entry *entry;
+
+	if (id == 0 || id > frozen->maxid)
+		return false;
+
+	entry = &frozen->entries[id - 1];
+	if (entry->offset == JSONBD_FROZEN_ABSENT)
+		return false;
+
+	*key = frozen->arena + entry->offset;
+	*keylen = entry->len;
+	return true;
+}
+
+/* Returns id of the key, or 0 if the key is not frozen */
+uint32
+jsonbd_frozen_get_id(jsonbd_frozen *frozen, const char *key, int keylen)
+{
+	uint32				 bucket,
+						 h1,
+						 h2,
+						 id;
+	jsonbd_frozen_entry	*entry;
+
+	if (frozen->nslots == 0)
+		return 0;
+
+	frozen_key_hash(key, keylen, frozen->seed, frozen->nbuckets,
+					frozen->nslots, &bucket, &h1, &h2);
+	id = frozen->slots[frozen_slot(h1, h2, frozen->displacements[bucket],
+								   frozen->nslots)];
+	if (id == 0)
+		return 0;
+
+	/* the slot of a key that is not frozen holds some other key */
+	entry = &frozen->entries[id - 1];
+	if (entry->len == keylen &&
+		memcmp(frozen->arena + entry->offset, key, keylen) == 0)
+		return id;
+
+	return 0;
+}
+
+/*
+ * Remove the file of the dictionary, called when the dictionary is dropped.
+ * The generation is changed even without the file, backends also forget
+ * other state of the dictionary on it.
+ */
+void
+jsonbd_frozen_remove(Oid dictid)
+{
+	char   *path = frozen_file_path(dictid, false);
+
+	if (unlink(path) != 0 && errno != ENOENT)
+		elog(WARNING, "jsonbd: could not remove \"%s\": %m", path);
+
+	if (frozen_generation)
+		pg_atomic_fetch_add_u64(frozen_generation, 1);
+
+	pfree(path);
+}
+
+typedef struct
+{
+	jsonbd_frozen_entry	*entries;
+	const char			*arena;
+	uint32				*counts;	/* keys in buckets */
+} phash_build_state;
+
+/* Keys are ordered by length and bytes, equal keys by id */
+static int
+key_cmp(const void *a, const void *b, void *arg)
+{
+	phash_build_state	*state = (phash_build_state *) arg;
+	uint32				 ida = *(const uint32 *) a,
+						 idb = *(const uint32 *) b;
+	jsonbd_frozen_entry	*ea = &state->entries[ida - 1],
+						*eb = &state->entries[idb - 1];
+	int					 res;
+
+	if (ea->len != eb->len)
+		return ea->len > eb->len ? 1 : -1;
+
+	res = memcmp(state->arena + ea->offset, state->arena + eb->offset, ea->len);
+	if (res != 0)
+		return res;
+
+	return ida > idb ? 1 : (ida < idb ? -1 : 0);
+}
+
+/* Larger buckets go first */
+static int
+bucket_cmp(const void *a, const void *b, void *arg)
+{
+	phash_build_state	*state = (phash_build_state *) arg;
+	uint32				 ca = state->counts[*(const uint32 *) a],
+						 cb = state->counts[*(const uint32 *) b];
+
+	return ca < cb ? 1 : (ca > cb ? -1 : 0);
+}
+
+/*
+ * Try to place all keys with the seed. Buckets are placed from the largest,
+ * for each one we look for the first displacement that moves its keys to
+ * free distinct slots. Small displacements change only the offset, so
+ * a bucket of one key always finds a free slot.
+ */
+static bool
+place_buckets(phash_build_state *state, uint32 *ids, uint32 nslots,
+			  uint32 nbuckets, uint32 seed, uint32 *displacements,
+			  uint32 *slots)
+{
+	uint32	   *bucket_of = palloc(sizeof(uint32) * nslots),
+			   *h1 = palloc(sizeof(uint32) * nslots),
+			   *h2 = palloc(sizeof(uint32) * nslots),
+			   *starts = palloc0(sizeof(uint32) * (nbuckets + 1)),
+			   *members = palloc(sizeof(uint32) * nslots),
+			   *order = palloc(sizeof(uint32) * nbuckets),
+			   *pos = NULL;
+	uint64		max_tries = (uint64) nslots * JSONBD_PHASH_MAX_ROUNDS;
+	uint32		i,
+				maxcount = 0;
+	bool		result = true;
+
+	memset(state->counts, 0, sizeof(uint32) * nbuckets);
+	memset(slots, 0, sizeof(uint32) * nslots);
+
+	for (i = 0; i < nslots; i++)
+	{
+		jsonbd_frozen_entry *entry = &state->entries[ids[i] - 1];
+
+		frozen_key_hash(state->arena + entry->offset, entry->len, seed,
+						nbuckets, nslots, &bucket_of[i], &h1[i], &h2[i]);
+		state->counts[bucket_of[i]]++;
+	}
+
+	/* group keys by buckets */
+	for (i = 0; i < nbuckets; i++)
+	{
+		starts[i + 1] = starts[i] + state->counts[i];
+		maxcount = Max(maxcount, state->counts[i]);
+		order[i] = i;
+	}
+	for (i = 0; i < nslots; i++)
+		members[starts[bucket_of[i]]++] = i;
+	for (i = 0; i < nbuckets; i++)
+		starts[i] -= state->counts[i];
+
+	qsort_arg(order, nbuckets, sizeof(uint32), bucket_cmp, state);
+	pos = palloc(sizeof(uint32) * Max(maxcount, 1));
+
+	for (i = 0; i < nbuckets && result; i++)
+	{
+		uint32	b = order[i],
+				count = state->counts[b];
+		uint64	d;
+
+		displacements[b] = 0;
+		if (count == 0)
+			break;
+
+		for (d = 0; d < max_tries; d++)
+		{
+			uint32	j,
+					k;
+			bool	ok = true;
+
+			for (j = 0; j < count && ok; j++)
+			{
+				uint32	key = members[starts[b] + j];
+
+				pos[j] = frozen_slot(h1[key], h2[key], (uint32) d, nslots);
+				if (slots[pos[j]] != 0)
+					ok = false;
+
+				for (k = 0; k < j && ok; k++)
+					if (pos[k] == pos[j])
+						ok = false;
+			}
+
+			if (ok)
+			{
+				for (j = 0; j < count; j++)
+					slots[pos[j]] = ids[members[starts[b] + j]];
+
+				displacements[b] = (uint32) d;
+				break;
+			}
+		}
+
+		if (d == max_tries)
+			result = false;
+	}
+
+	/* the rest of buckets are empty */
+	for (; i < nbuckets; i++)
+		displacements[order[i]] = 0;
+
+	pfree(bucket_of);
+	pfree(h1);
+	pfree(h2);
+	pfree(starts);
+	pfree(members);
+	pfree(order);
+	pfree(pos);
+	return result;
+}
+
+/*
+ * Build the perfect hash index over keys in 'ids', fills the header and
+ * returns displacements and slots.
+ */
+static void
+build_perfect_hash(jsonbd_frozen_header *hdr, jsonbd_frozen_entry *entries,
+				   const char *arena, uint32 *ids, uint32 nkeys,
+				   uint32 **displacements, uint32 **slots)
+{
+	phash_build_state	state;
+	uint32				i,
+						nslots = 0;
+
+	state.entries = entries;
+	state.arena = arena;
+
+	/* equal keys would never get different slots, the first id is kept */
+	qsort_arg(ids, nkeys, sizeof(uint32), key_cmp, &state);
+	for (i = 0; i < nkeys; i++)
+	{
+		if (nslots > 0)
+		{
+			jsonbd_frozen_entry *prev = &entries[ids[nslots - 1] - 1],
+								*cur = &entries[ids[i] - 1];
+
+			if (prev->len == cur->len &&
+				memcmp(arena + prev->offset, arena + cur->offset, cur->len) == 0)
+				continue;
+		}
+		ids[nslots++] = ids[i];
+	}
+
+	hdr->nslots = nslots;
+	hdr->nbuckets = Max(1, (nslots + JSONBD_PHASH_BUCKET_SIZE - 1) /
+						JSONBD_PHASH_BUCKET_SIZE);
+	*displacements = palloc0(sizeof(uint32) * hdr->nbuckets);
+	*slots = palloc0(sizeof(uint32) * Max(nslots, 1));
+
+	if (nslots == 0)
+		return;
+
+	state.counts = palloc(sizeof(uint32) * hdr->nbuckets);
+	for (hdr->seed = 0; hdr->seed < JSONBD_PHASH_MAX_SEEDS; hdr->seed++)
+	{
+		CHECK_FOR_INTERRUPTS();
+		if (place_buckets(&state, ids, nslots, hdr->nbuckets, hdr->seed,
+						  *displacements, *slots))
+			break;
+	}
+
+	if (hdr->seed == JSONBD_PHASH_MAX_SEEDS)
+		elog(ERROR, "jsonbd: could not build perfect hash of the dictionary");
+
+	pfree(state.counts);
+}
+
+static void
+write_frozen(int fd, const char *path, const void *data, size_t len)
+{
+	errno = 0;
+	if (write(fd, data, len) != len)
+	{
+		/* if write didn't set errno, assume problem is no disk space */
+		if (errno == 0)
+			errno = ENOSPC;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", path)));
+	}
+}
+
+/*
+ * Write all keys of the dictionary used by 'acoid' compression options
+ * to the frozen file. Returns the number of frozen keys.
+ */
+Datum
+jsonbd_freeze(PG_FUNCTION_ARGS)
+{
+	Oid						 acoid = PG_GETARG_OID(0);
+	Oid						 argtypes[1] = {OIDOID};
+	Datum					 values[1];
+	Oid						 dictid;
+	char					*nspname,
+							*sql,
+							*path,
+							*tmppath;
+	bool					 isnull;
+	uint32					 i,
+							 nkeys;
+	jsonbd_frozen_header	 hdr;
+	jsonbd_frozen_entry		*entries;
+	uint32					*ids,
+							*displacements,
+							*slots;
+	StringInfoData			 arena;
+	int						 fd;
+	MemoryContext			 mcxt = CurrentMemoryContext;
+
+	if (frozen_generation == NULL)
+		elog(ERROR, "jsonbd: workers are disabled");
+
+	check_jsonbd_options(acoid);
+
+	nspname = get_namespace_name(get_jsonbd_schema());
+	if (!nspname)
+		elog(ERROR, "jsonbd: extension schema not found");
+	nspname = (char *) quote_identifier(nspname);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "jsonbd: could not connect to SPI");
+
+	values[0] = ObjectIdGetDatum(acoid);
+	sql = psprintf(sql_get_dictid, nspname);
+	if (SPI_execute_with_args(sql, 1, argtypes, values, NULL, true, 1) != SPI_OK_SELECT)
+		elog(ERROR, "jsonbd: could not get dictionary of compression options");
+
+	dictid = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[0],
+											SPI_tuptable->tupdesc, 1, &isnull));
+
+	values[0] = ObjectIdGetDatum(dictid);
+	sql = psprintf(sql_get_keys, nspname);
+	if (SPI_execute_with_args(sql, 1, argtypes, values, NULL, true, 0) != SPI_OK_SELECT)
+		elog(ERROR, "jsonbd: could not get keys of the dictionary");
+
+	nkeys = SPI_processed;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = JSONBD_FROZEN_MAGIC;
+	hdr.version = JSONBD_FROZEN_VERSION;
+	hdr.dictid = dictid;
+	hdr.maxid = nkeys == 0 ? 0 :
+		DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[nkeys - 1],
+									SPI_tuptable->tupdesc, 1, &isnull));
+
+	/* the keys are copied out of SPI memory, which is freed by SPI_finish */
+	MemoryContextSwitchTo(mcxt);
+	entries = (jsonbd_frozen_entry *)
+		palloc(sizeof(jsonbd_frozen_entry) * Max(hdr.maxid, 1));
+	memset(entries, 0xFF, sizeof(jsonbd_frozen_entry) * hdr.maxid);
+	ids = (uint32 *) palloc(sizeof(uint32) * Max(nkeys, 1));
+	initStringInfo(&arena);
+
+	for (i = 0; i < nkeys; i++)
+	{
+		HeapTuple	tup = SPI_tuptable->vals[i];
+		int32		id = DatumGetInt32(SPI_getbinval(tup, SPI_tuptable->tupdesc,
+													  1, &isnull));
+		text	   *key = DatumGetTextPP(SPI_getbinval(tup, SPI_tuptable->tupdesc,
+													   2, &isnull));
+		int			keylen = VARSIZE_ANY_EXHDR(key);
+
+		Assert(id > 0 && id <= hdr.maxid);
+		entries[id - 1].offset = arena.len;
+		entries[id - 1].len = keylen;
+		appendBinaryStringInfo(&arena, VARDATA_ANY(key), keylen);
+		ids[i] = id;
+	}
+	hdr.arenalen = arena.len;
+
+	SPI_finish();
+
+	build_perfect_hash(&hdr, entries, arena.data, ids, nkeys,
+					   &displacements, &slots);
+
+	path = frozen_file_path(dictid, true);
+	tmppath = psprintf("%s.tmp", path);
+
+	fd = OpenTransientFile(tmppath, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY);
+	if (fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m", tmppath)));
+
+	write_frozen(fd, tmppath, &hdr, sizeof(hdr));
+	write_frozen(fd, tmppath, entries, sizeof(jsonbd_frozen_entry) * hdr.maxid);
+	write_frozen(fd, tmppath, displacements, sizeof(uint32) * hdr.nbuckets);
+	write_frozen(fd, tmppath, slots, sizeof(uint32) * hdr.nslots);
+	write_frozen(fd, tmppath, arena.data, arena.len);
+
+	if (pg_fsync(fd) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not fsync file \"%s\": %m", tmppath)));
+
+	if (CloseTransientFile(fd))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not close file \"%s\": %m", tmppath)));
+
+	/*
+	 * Workers commit keys asynchronously, the keys should not be lost after
+	 * a crash while the file maps their ids.
+	 */
+	XLogFlush(GetXLogInsertRecPtr());
+
+	/* backends see either the old file or the new one */
+	durable_rename(tmppath, path, ERROR);
+	pg_atomic_fetch_add_u64(frozen_generation, 1);
+
+	PG_RETURN_INT32(nkeys);
+}
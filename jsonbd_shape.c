@@ -0,0 +1,184 @@
+#include "jsonbd.h"
+
+#include "postgres.h"
+
+#include "access/hash.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+
+/*
+ * Cache of object shapes.
+ *
+ * Documents of a column usually have a few shapes, objects with the same
+ * sequence of key ids. For every seen shape the backend keeps its keys in
+ * the sorted order and the permutation that sorts the pairs, so an object
+ * of a known shape is decoded without key lookups and without sorting.
+ *
+ * Committed keys keep their ids, but ids of a dropped dictionary and ids
+ * of keys lost by an aborted bulk load can be given to other keys. So the
+ * cache is cleared when the frozen generation changes, which happens when
+ * a dictionary is dropped (see jsonbd_frozen_check), and when a bulk load
+ * forgets its keys. When the cache is full new shapes are not added, the
+ * first seen shapes of a column are usually the dominant ones.
+ */
+
+typedef struct jsonbd_shape
+{
+	Oid			dictid;
+	int			nkeys;
+	uint32	   *ids;		/* in the encoded order */
+	char	  **keys;		/* in the sorted order */
+	int		   *lens;
+	int		   *order;		/* position of the sorted pair in the encoded order */
+} jsonbd_shape;
+
+typedef struct
+{
+	uint32		hash;
+	List	   *shapes;
+} shape_entry;
+
+static HTAB			   *shapes = NULL;
+static MemoryContext	shapes_mcxt = NULL;
+static int				shapes_count = 0;
+
+static uint32
+shape_hash(Oid dictid, uint32 *ids, int nkeys)
+{
+	uint32	hash = DatumGetUInt32(hash_any((const unsigned char *) ids,
+										   sizeof(uint32) * nkeys));
+
+	return hash ^ dictid;
+}
+
+static jsonbd_shape *
+shape_lookup(Oid dictid, uint32 hash, uint32 *ids, int nkeys)
+{
+	shape_entry	*entry;
+	ListCell	*lc;
+
+	if (shapes == NULL)
+		return NULL;
+
+	entry = hash_search(shapes, &hash, HASH_FIND, NULL);
+	if (entry == NULL)
+		return NULL;
+
+	foreach(lc, entry->shapes)
+	{
+		jsonbd_shape *shape = (jsonbd_shape *) lfirst(lc);
+
+		if (shape->dictid == dictid && shape->nkeys == nkeys &&
+			memcmp(shape->ids, ids, sizeof(uint32) * nkeys) == 0)
+			return shape;
+	}
+
+	return NULL;
+}
+
+/* Forget all shapes, called between datums */
+void
+jsonbd_shape_reset(void)
+{
+	if (shapes_mcxt != NULL)
+		MemoryContextDelete(shapes_mcxt);
+
+	shapes_mcxt = NULL;
+	shapes = NULL;
+	shapes_count = 0;
+}
+
+/*
+ * Fill keys of the object from the cached shape and sort the pairs.
+ * Returns false if the shape is not known.
+ */
+bool
+jsonbd_shape_apply(Oid dictid, uint32 *ids, JsonbPair *pairs, int nkeys)
+{
+	JsonbPair		 unsorted[JSONBD_SHAPE_MAX_KEYS];
+	jsonbd_shape	*shape;
+	int				 i;
+
+	if (nkeys > JSONBD_SHAPE_MAX_KEYS)
+		return false;
+
+	shape = shape_lookup(dictid, shape_hash(dictid, ids, nkeys), ids, nkeys);
+	if (shape == NULL)
+		return false;
+
+	memcpy(unsorted, pairs, sizeof(JsonbPair) * nkeys);
+	for (i = 0; i < nkeys; i++)
+	{
+		pairs[i] = unsorted[shape->order[i]];
+		pairs[i].key.val.string.val = shape->keys[i];
+		pairs[i].key.val.string.len = shape->lens[i];
+	}
+
+	return true;
+}
+
+/*
+ * Remember the shape of the object. 'ids' are in the encoded order,
+ * 'pairs' are sorted and their 'order' fields contain the encoded positions.
+ */
+void
+jsonbd_shape_add(Oid dictid, uint32 *ids, JsonbPair *pairs, int nkeys)
+{
+	uint32			 hash;
+	shape_entry		*entry;
+	jsonbd_shape	*shape;
+	MemoryContext	 old_mcxt;
+	bool			 found;
+	int				 i;
+
+	if (nkeys > JSONBD_SHAPE_MAX_KEYS || shapes_count >= JSONBD_SHAPE_CACHE_SIZE)
+		return;
+
+	if (shapes == NULL)
+	{
+		HASHCTL		ctl;
+
+		shapes_mcxt = AllocSetContextCreate(TopMemoryContext,
+											"jsonbd shapes context",
+											ALLOCSET_DEFAULT_SIZES);
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(uint32);
+		ctl.entrysize = sizeof(shape_entry);
+		ctl.hcxt = shapes_mcxt;
+		shapes = hash_create("jsonbd shapes", 256, &ctl,
+							 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	hash = shape_hash(dictid, ids, nkeys);
+	if (shape_lookup(dictid, hash, ids, nkeys) != NULL)
+		return;
+
+	old_mcxt = MemoryContextSwitchTo(shapes_mcxt);
+
+	shape = palloc(sizeof(jsonbd_shape));
+	shape->dictid = dictid;
+	shape->nkeys = nkeys;
+	shape->ids = palloc(sizeof(uint32) * nkeys);
+	shape->keys = palloc(sizeof(char *) * nkeys);
+	shape->lens = palloc(sizeof(int) * nkeys);
+	shape->order = palloc(sizeof(int) * nkeys);
+	memcpy(shape->ids, ids, sizeof(uint32) * nkeys);
+
+	for (i = 0; i < nkeys; i++)
+	{
+		JsonbValue *key = &pairs[i].key;
+
+		shape->keys[i] = pnstrdup(key->val.string.val, key->val.string.len);
+		shape->lens[i] = key->val.string.len;
+		shape->order[i] = pairs[i].order;
+	}
+
+	entry = hash_search(shapes, &hash, HASH_ENTER, &found);
+	if (!found)
+		entry->shapes = NIL;
+	entry->shapes = lappend(entry->shapes, shape);
+	shapes_count++;
+
+	MemoryContextSwitchTo(old_mcxt);
+}
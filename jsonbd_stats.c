@@ -0,0 +1,412 @@
+#include "jsonbd.h"
+#include "jsonbd_utils.h"
+
+#include "postgres.h"
+#include "miscadmin.h"
+
+#include "access/htup_details.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_type.h"
+#include "commands/vacuum.h"
+#include "executor/spi.h"
+#include "lib/stringinfo.h"
+#include "nodes/parsenodes.h"
+#include "tcop/utility.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+
+/*
+ * Key statistics of jsonbd columns.
+ *
+ * After ANALYZE of a table its jsonbd columns are sampled and for every key
+ * the average number of occurrences per row and the number of distinct
+ * values are saved to jsonbd_statistics. The sample has about the same size
+ * as the sample of ANALYZE itself, it's taken by pages (SYSTEM), once for
+ * all jsonbd columns of the relation.
+ *
+ * Like ANALYZE, only relations owned by the current role (or all relations
+ * for the owner of the database) are sampled, and only columns the role
+ * can read. The sample is read as the current role, only statistics are
+ * written as the owner of the extension, which owns jsonbd_statistics.
+ * All queries run with search_path of pg_catalog.
+ */
+
+static ProcessUtility_hook_type prev_ProcessUtility_hook = NULL;
+
+/* jsonbd columns of the relation, or of all relations if relid is 0 */
+static const char *sql_get_columns = \
+	"SELECT a.attrelid, a.attnum, a.attname, c.acoid"
+	" FROM pg_catalog.pg_attribute a"
+	" JOIN pg_catalog.pg_attr_compression c ON c.acoid = a.attcompression"
+	" JOIN pg_catalog.pg_class r ON r.oid = a.attrelid"
+	" WHERE ($1 = 0::oid OR a.attrelid = $1) AND c.acname = 'jsonbd'"
+	" AND r.relkind IN ('r', 'm')"
+	" AND a.attnum > 0 AND NOT a.attisdropped"
+	" ORDER BY a.attrelid, a.attnum";
+
+static const char *sql_clear = \
+	"DELETE FROM %s.jsonbd_statistics WHERE relid = $1 AND attnum = ANY($2)";
+
+static const char *sql_save = \
+	"INSERT INTO %s.jsonbd_statistics"
+	" (relid, attnum, acoid, key, frequency, ndistinct)"
+	" SELECT $1, s.attnum, s.acoid, s.key, s.frequency, s.ndistinct"
+	" FROM pg_catalog.unnest($2, $3, $4, $5, $6)"
+	"  s(attnum, acoid, key, frequency, ndistinct)";
+
+/*
+ * Keys are collected from objects at all levels, nested values are
+ * reached through objects and arrays. Arguments: the relation, the percent
+ * of its pages and VALUES list of (attnum, column) of sampled columns.
+ */
+static const char *sql_collect = \
+	"WITH RECURSIVE roots(attnum, v) AS ("
+	"  SELECT s.attnum, s.v FROM %s t TABLESAMPLE SYSTEM (%g),"
+	"    LATERAL (VALUES %s) s(attnum, v)"
+	"  WHERE s.v IS NOT NULL"
+	"), total(attnum, n) AS ("
+	"  SELECT attnum, pg_catalog.count(*) FROM roots GROUP BY attnum"
+	"), nodes(attnum, v) AS ("
+	"  SELECT attnum, v FROM roots"
+	"  UNION ALL"
+	"  SELECT n.attnum, c.v FROM nodes n, LATERAL ("
+	"    SELECT value FROM pg_catalog.jsonb_each(CASE WHEN"
+	"      pg_catalog.jsonb_typeof(n.v) = 'object' THEN n.v ELSE '{}' END)"
+	"    UNION ALL"
+	"    SELECT value FROM pg_catalog.jsonb_array_elements(CASE WHEN"
+	"      pg_catalog.jsonb_typeof(n.v) = 'array' THEN n.v ELSE '[]' END)"
+	"  ) c(v)"
+	")"
+	" SELECT n.attnum, e.key,"
+	"  (pg_catalog.count(*)::pg_catalog.float8 / t.n)::pg_catalog.float4,"
+	"  pg_catalog.count(DISTINCT e.value)::pg_catalog.float4"
+	" FROM nodes n JOIN total t ON t.attnum = n.attnum,"
+	"  pg_catalog.jsonb_each(CASE WHEN"
+	"  pg_catalog.jsonb_typeof(n.v) = 'object' THEN n.v ELSE '{}' END) e"
+	" GROUP BY n.attnum, e.key, t.n";
+
+typedef struct
+{
+	Oid			relid;
+	int			attnum;
+	char	   *attname;
+	Oid			acoid;
+} jsonbd_column;
+
+/* Percent of pages to sample so we get as many rows as ANALYZE does */
+static double
+sample_percent(Oid relid)
+{
+	HeapTuple	tp;
+	double		reltuples = 0,
+				target = 300.0 * default_statistics_target;
+
+	tp = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+	if (HeapTupleIsValid(tp))
+	{
+		reltuples = ((Form_pg_class) GETSTRUCT(tp))->reltuples;
+		ReleaseSysCache(tp);
+	}
+
+	if (reltuples <= target)
+		return 100.0;
+
+	return 100.0 * target / reltuples;
+}
+
+/*
+ * The same check as ANALYZE does, other relations are skipped by it.
+ * The sample is read by the role, so the column should be readable too.
+ */
+static bool
+can_analyze(Oid relid, AttrNumber attnum)
+{
+	Oid		userid = GetUserId();
+
+	if (!pg_class_ownercheck(relid, userid) &&
+		!pg_database_ownercheck(MyDatabaseId, userid))
+		return false;
+
+	return pg_class_aclcheck(relid, userid, ACL_SELECT) == ACLCHECK_OK ||
+		pg_attribute_aclcheck(relid, attnum, userid, ACL_SELECT) == ACLCHECK_OK;
+}
+
+static List *
+get_jsonbd_columns(Oid relid)
+{
+	Oid			argtypes[1] = {OIDOID};
+	Datum		values[1];
+	List	   *result = NIL;
+	uint64		i;
+
+	values[0] = ObjectIdGetDatum(relid);
+	if (SPI_execute_with_args(sql_get_columns, 1, argtypes, values, NULL,
+							  true, 0) != SPI_OK_SELECT)
+		elog(ERROR, "jsonbd: could not get jsonbd columns");
+
+	for (i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple		tup = SPI_tuptable->vals[i];
+		TupleDesc		tupdesc = SPI_tuptable->tupdesc;
+		jsonbd_column  *col = palloc(sizeof(jsonbd_column));
+		bool			isnull;
+
+		col->relid = DatumGetObjectId(SPI_getbinval(tup, tupdesc, 1, &isnull));
+		col->attnum = DatumGetInt16(SPI_getbinval(tup, tupdesc, 2, &isnull));
+		if (!can_analyze(col->relid, col->attnum))
+		{
+			pfree(col);
+			continue;
+		}
+
+		col->attname = SPI_getvalue(tup, tupdesc, 3);
+		col->acoid = DatumGetObjectId(SPI_getbinval(tup, tupdesc, 4, &isnull));
+		result = lappend(result, col);
+	}
+
+	return result;
+}
+
+/* Returns acoid of the sampled column */
+static Oid
+column_acoid(List *columns, int attnum)
+{
+	ListCell   *lc;
+
+	foreach(lc, columns)
+	{
+		jsonbd_column  *col = (jsonbd_column *) lfirst(lc);
+
+		if (col->attnum == attnum)
+			return col->acoid;
+	}
+
+	elog(ERROR, "jsonbd: unexpected column %d in the sample", attnum);
+	return InvalidOid;			/* keep compiler quiet */
+}
+
+/*
+ * Sample jsonbd columns of one relation as the current role and save
+ * their statistics as the extension owner
+ */
+static void
+collect_statistics(const char *nspname, Oid relid, List *columns)
+{
+	char		   *relnsp = get_namespace_name(get_rel_namespace(relid)),
+				   *relname = get_rel_name(relid),
+				   *sql;
+	StringInfoData	cols;
+	ListCell	   *lc;
+	Datum		   *attnums,
+				   *rowattnums,
+				   *acoids,
+				   *keys,
+				   *frequencies,
+				   *ndistincts,
+					args[6],
+					clear_args[2];
+	Oid				argtypes[6] = {OIDOID, INT2ARRAYOID, OIDARRAYOID,
+								   TEXTARRAYOID, FLOAT4ARRAYOID,
+								   FLOAT4ARRAYOID};
+	Oid				save_userid;
+	int				save_sec_context,
+					ncols = 0,
+					n,
+					i;
+
+	/* dropped concurrently */
+	if (relnsp == NULL || relname == NULL)
+		return;
+
+	relname = quote_qualified_identifier(relnsp, relname);
+
+	initStringInfo(&cols);
+	attnums = palloc(sizeof(Datum) * list_length(columns));
+	foreach(lc, columns)
+	{
+		jsonbd_column  *col = (jsonbd_column *) lfirst(lc);
+
+		appendStringInfo(&cols, "%s(%d::pg_catalog.int2, t.%s)",
+						 ncols > 0 ? ", " : "", col->attnum,
+						 quote_identifier(col->attname));
+		attnums[ncols++] = Int16GetDatum(col->attnum);
+	}
+
+	sql = psprintf(sql_collect, relname, sample_percent(relid), cols.data);
+	if (SPI_execute(sql, true, 0) != SPI_OK_SELECT)
+		elog(ERROR, "jsonbd: could not collect statistics");
+
+	n = (int) SPI_processed;
+	rowattnums = palloc(sizeof(Datum) * Max(n, 1));
+	acoids = palloc(sizeof(Datum) * Max(n, 1));
+	keys = palloc(sizeof(Datum) * Max(n, 1));
+	frequencies = palloc(sizeof(Datum) * Max(n, 1));
+	ndistincts = palloc(sizeof(Datum) * Max(n, 1));
+	for (i = 0; i < n; i++)
+	{
+		HeapTuple	tup = SPI_tuptable->vals[i];
+		TupleDesc	tupdesc = SPI_tuptable->tupdesc;
+		bool		isnull;
+
+		rowattnums[i] = SPI_getbinval(tup, tupdesc, 1, &isnull);
+		acoids[i] = ObjectIdGetDatum(column_acoid(columns,
+											DatumGetInt16(rowattnums[i])));
+		keys[i] = SPI_getbinval(tup, tupdesc, 2, &isnull);
+		frequencies[i] = SPI_getbinval(tup, tupdesc, 3, &isnull);
+		ndistincts[i] = SPI_getbinval(tup, tupdesc, 4, &isnull);
+	}
+
+	args[0] = ObjectIdGetDatum(relid);
+	args[1] = PointerGetDatum(construct_array(rowattnums, n, INT2OID,
+											  2, true, 's'));
+	args[2] = PointerGetDatum(construct_array(acoids, n, OIDOID,
+											  4, true, 'i'));
+	args[3] = PointerGetDatum(construct_array(keys, n, TEXTOID,
+											  -1, false, 'i'));
+	args[4] = PointerGetDatum(construct_array(frequencies, n, FLOAT4OID,
+											  4, FLOAT4PASSBYVAL, 'i'));
+	args[5] = PointerGetDatum(construct_array(ndistincts, n, FLOAT4OID,
+											  4, FLOAT4PASSBYVAL, 'i'));
+	SPI_freetuptable(SPI_tuptable);
+
+	/* the user id is restored on error by the abort of the transaction */
+	GetUserIdAndSecContext(&save_userid, &save_sec_context);
+	SetUserIdAndSecContext(get_jsonbd_owner(),
+						   save_sec_context | SECURITY_LOCAL_USERID_CHANGE);
+
+	clear_args[0] = args[0];
+	clear_args[1] = PointerGetDatum(construct_array(attnums, ncols, INT2OID,
+													2, true, 's'));
+	sql = psprintf(sql_clear, nspname);
+	if (SPI_execute_with_args(sql, 2, argtypes, clear_args, NULL,
+							  false, 0) != SPI_OK_DELETE)
+		elog(ERROR, "jsonbd: could not clear statistics");
+
+	sql = psprintf(sql_save, nspname);
+	if (n > 0 &&
+		SPI_execute_with_args(sql, 6, argtypes, args, NULL,
+							  false, 0) != SPI_OK_INSERT)
+		elog(ERROR, "jsonbd: could not save statistics");
+
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+}
+
+/* Collect statistics of jsonbd columns of analyzed relations */
+static void
+jsonbd_analyze(VacuumStmt *stmt)
+{
+	char	   *nspname;
+	List	   *columns = NIL,
+			   *relcolumns = NIL;
+	ListCell   *lc;
+	Oid			nspoid = get_jsonbd_schema(),
+				relid = InvalidOid;
+	int			save_nestlevel;
+
+	if (!OidIsValid(nspoid))
+		return;
+
+	nspname = (char *) quote_identifier(get_namespace_name(nspoid));
+
+	/*
+	 * VACUUM ANALYZE and ANALYZE of several relations commit their own
+	 * transactions, no snapshot is left for our queries
+	 */
+	PushActiveSnapshot(GetTransactionSnapshot());
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "jsonbd: could not connect to SPI");
+
+	/* objects of the role should not be found instead of the system ones */
+	save_nestlevel = NewGUCNestLevel();
+	(void) set_config_option("search_path", "pg_catalog",
+							 PGC_USERSET, PGC_S_SESSION,
+							 GUC_ACTION_SAVE, true, 0, false);
+
+	if (stmt->rels == NIL)
+		columns = get_jsonbd_columns(InvalidOid);
+
+	foreach(lc, stmt->rels)
+	{
+		VacuumRelation *vrel = lfirst_node(VacuumRelation, lc);
+		Oid				vrelid = vrel->oid;
+		ListCell	   *lc2;
+
+		if (!OidIsValid(vrelid))
+			vrelid = RangeVarGetRelid(vrel->relation, NoLock, true);
+
+		if (!OidIsValid(vrelid))
+			continue;
+
+		foreach(lc2, get_jsonbd_columns(vrelid))
+		{
+			jsonbd_column  *col = (jsonbd_column *) lfirst(lc2);
+			ListCell	   *lc3;
+			bool			analyzed = (vrel->va_cols == NIL);
+
+			/* only columns listed in ANALYZE */
+			foreach(lc3, vrel->va_cols)
+				if (strcmp(strVal(lfirst(lc3)), col->attname) == 0)
+					analyzed = true;
+
+			if (analyzed)
+				columns = lappend(columns, col);
+		}
+	}
+
+	/* columns of one relation follow each other, they are sampled at once */
+	foreach(lc, columns)
+	{
+		jsonbd_column  *col = (jsonbd_column *) lfirst(lc);
+
+		if (col->relid != relid && relcolumns != NIL)
+		{
+			CHECK_FOR_INTERRUPTS();
+			collect_statistics(nspname, relid, relcolumns);
+			relcolumns = NIL;
+		}
+
+		relid = col->relid;
+		relcolumns = lappend(relcolumns, col);
+	}
+
+	if (relcolumns != NIL)
+		collect_statistics(nspname, relid, relcolumns);
+
+	AtEOXact_GUC(true, save_nestlevel);
+	SPI_finish();
+	PopActiveSnapshot();
+}
+
+static void
+jsonbd_process_utility(PlannedStmt *pstmt, const char *queryString,
+					   ProcessUtilityContext context, ParamListInfo params,
+					   QueryEnvironment *queryEnv, DestReceiver *dest,
+					   char *completionTag)
+{
+	Node   *parsetree = pstmt->utilityStmt;
+
+	if (prev_ProcessUtility_hook)
+		prev_ProcessUtility_hook(pstmt, queryString, context, params,
+								 queryEnv, dest, completionTag);
+	else
+		standard_ProcessUtility(pstmt, queryString, context, params,
+								queryEnv, dest, completionTag);
+
+	if (IsA(parsetree, VacuumStmt) &&
+		(((VacuumStmt *) parsetree)->options & VACOPT_ANALYZE))
+		jsonbd_analyze((VacuumStmt *) parsetree);
+}
+
+/* Should be called from _PG_init */
+void
+jsonbd_stats_init(void)
+{
+	prev_ProcessUtility_hook = ProcessUtility_hook;
+	ProcessUtility_hook = jsonbd_process_utility;
+}
@@ -0,0 +1,286 @@
+#include "jsonbd.h"
+#include "jsonbd_utils.h"
+
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "common/sha2.h"
+#include "executor/spi.h"
+#include "port/atomics.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+
+/*
+ * Deduplication of subdocuments.
+ *
+ * With the 'dedup' option nested objects and arrays larger than the given
+ * size are addressed by SHA-256 of their binary representation. A subtree
+ * seen the second time is saved once in jsonbd_subdocs by workers and
+ * the compressed datum keeps only a reference to it: an object with one
+ * pair, whose key is empty (real encoded keys are never empty) and whose
+ * value is the hash.
+ *
+ * Subdocuments are content addressed, so they are shared by all compression
+ * options of the database. jsonbd_import checks that every reference of
+ * an imported datum is present in jsonbd_subdocs.
+ *
+ * Hashes of seen subtrees are remembered in a small lossy table in shared
+ * memory, so a subtree seen by any backend is stored on its next sight.
+ * The backend caches contents of stored subdocuments. When the cache is full
+ * it's cleared at the start of the next datum, so values that point to
+ * cached documents stay valid while they are used.
+ *
+ * jsonbd_gc_subdocs removes subdocuments that no row references, it sends
+ * an invalidation of jsonbd_subdocs, and backends clear their caches so
+ * they don't reference removed documents.
+ */
+
+#define JSONBD_SUBDOCS_REL			"jsonbd_subdocs"
+#define JSONBD_SUBDOCS_SEEN_SLOTS	16384
+
+typedef struct
+{
+	uint8		hash[JSONBD_SUBDOC_HASH_LEN];
+	Jsonb	   *doc;		/* NULL if the subtree was only seen */
+} subdoc_entry;
+
+static HTAB			   *subdocs = NULL;
+static MemoryContext	subdocs_mcxt = NULL;
+static Size				subdocs_size = 0;
+static Oid				subdocs_relid = InvalidOid;
+static bool				subdocs_stale = false;
+
+/* first 8 bytes of hashes of seen subtrees, 0 is an empty slot */
+static pg_atomic_uint64	   *seen_slots = NULL;
+
+static void
+subdocs_inval_callback(Datum arg, Oid relid)
+{
+	if (relid == InvalidOid || relid == subdocs_relid)
+		subdocs_stale = true;
+}
+
+/* Should be called from _PG_init */
+void
+jsonbd_subdocs_init(void)
+{
+	CacheRegisterRelcacheCallback(subdocs_inval_callback, (Datum) 0);
+}
+
+/* Should be called from _PG_init */
+void
+jsonbd_subdocs_request(void)
+{
+	RequestAddinShmemSpace(sizeof(pg_atomic_uint64) * JSONBD_SUBDOCS_SEEN_SLOTS);
+}
+
+/* Should be called from shmem startup hook with AddinShmemInitLock held */
+void
+jsonbd_subdocs_startup(void)
+{
+	bool	found;
+	int		i;
+
+	seen_slots = ShmemInitStruct("jsonbd seen subdocuments",
+								 sizeof(pg_atomic_uint64) * JSONBD_SUBDOCS_SEEN_SLOTS,
+								 &found);
+	if (!found)
+		for (i = 0; i < JSONBD_SUBDOCS_SEEN_SLOTS; i++)
+			pg_atomic_init_u64(&seen_slots[i], 0);
+}
+
+/*
+ * Remember the hash in the shared table, returns true if it was there.
+ * A slot keeps the last hash put to it, so some subtrees are forgotten.
+ */
+static bool
+subdoc_seen(const uint8 *hash)
+{
+	uint64				tag;
+	pg_atomic_uint64   *slot;
+
+	memcpy(&tag, hash, sizeof(tag));
+	if (tag == 0)
+		tag = 1;
+
+	slot = &seen_slots[tag % JSONBD_SUBDOCS_SEEN_SLOTS];
+	if (pg_atomic_read_u64(slot) == tag)
+		return true;
+
+	pg_atomic_write_u64(slot, tag);
+	return false;
+}
+
+static void
+subdocs_init(void)
+{
+	HASHCTL		ctl;
+
+	if (subdocs != NULL)
+		return;
+
+	if (!OidIsValid(subdocs_relid))
+		subdocs_relid = get_relname_relid(JSONBD_SUBDOCS_REL, get_jsonbd_schema());
+
+	subdocs_mcxt = AllocSetContextCreate(TopMemoryContext,
+										 "jsonbd subdocs context",
+										 ALLOCSET_DEFAULT_SIZES);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = JSONBD_SUBDOC_HASH_LEN;
+	ctl.entrysize = sizeof(subdoc_entry);
+	ctl.hcxt = subdocs_mcxt;
+	subdocs = hash_create("jsonbd subdocs", 1024, &ctl,
+						  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	subdocs_size = 0;
+}
+
+static void
+subdoc_remember(subdoc_entry *entry, Jsonb *doc)
+{
+	entry->doc = MemoryContextAlloc(subdocs_mcxt, VARSIZE(doc));
+	memcpy(entry->doc, doc, VARSIZE(doc));
+	subdocs_size += VARSIZE(doc);
+}
+
+/* Should be called at the start of each datum */
+void
+jsonbd_subdocs_check(void)
+{
+	if (subdocs == NULL)
+	{
+		subdocs_stale = false;
+		return;
+	}
+
+	if (!subdocs_stale &&
+		subdocs_size < JSONBD_SUBDOCS_CACHE_SIZE &&
+		hash_get_num_entries(subdocs) < JSONBD_SUBDOCS_MAX_ENTRIES)
+		return;
+
+	MemoryContextDelete(subdocs_mcxt);
+	subdocs = NULL;
+	subdocs_mcxt = NULL;
+	subdocs_size = 0;
+	subdocs_stale = false;
+}
+
+/*
+ * Decide if the nested container 'binary' should be replaced by a reference.
+ * Returns true if the subdocument is stored, its hash is put to 'hash'.
+ */
+bool
+jsonbd_subdoc_store(Oid dictid, JsonbValue *binary, uint8 *hash)
+{
+	pg_sha256_ctx	ctx;
+	subdoc_entry   *entry;
+	Jsonb		   *doc;
+	bool			found;
+
+	Assert(binary->type == jbvBinary);
+
+	pg_sha256_init(&ctx);
+	pg_sha256_update(&ctx, (uint8 *) binary->val.binary.data,
+					 binary->val.binary.len);
+	pg_sha256_final(&ctx, hash);
+
+	subdocs_init();
+	if (seen_slots != NULL)
+	{
+		entry = hash_search(subdocs, hash, HASH_FIND, NULL);
+		if (entry != NULL && entry->doc != NULL)
+			return true;
+
+		if (entry == NULL)
+		{
+			/* unique subtrees are kept in place */
+			if (!subdoc_seen(hash))
+				return false;
+
+			entry = hash_search(subdocs, hash, HASH_ENTER, NULL);
+			entry->doc = NULL;
+		}
+	}
+	else
+	{
+		entry = hash_search(subdocs, hash, HASH_ENTER, &found);
+		if (!found)
+		{
+			entry->doc = NULL;
+			return false;
+		}
+
+		if (entry->doc != NULL)
+			return true;
+	}
+
+	doc = JsonbValueToJsonb(binary);
+	jsonbd_worker_put_subdoc(dictid, hash, doc);
+	subdoc_remember(entry, doc);
+	pfree(doc);
+
+	return true;
+}
+
+/* Returns the subdocument by its hash */
+Jsonb *
+jsonbd_subdoc_fetch(Oid dictid, const uint8 *hash)
+{
+	subdoc_entry   *entry;
+	Jsonb		   *doc;
+
+	subdocs_init();
+	entry = hash_search(subdocs, hash, HASH_FIND, NULL);
+	if (entry != NULL && entry->doc != NULL)
+		return entry->doc;
+
+	/* the entry is added only when the document is received */
+	doc = jsonbd_worker_get_subdoc(dictid, hash);
+	entry = hash_search(subdocs, hash, HASH_ENTER, NULL);
+	subdoc_remember(entry, doc);
+	pfree(doc);
+
+	return entry->doc;
+}
+
+/* Raise an error if the referenced subdocument is not in jsonbd_subdocs */
+void
+jsonbd_subdoc_check_ref(const uint8 *hash)
+{
+	Oid			argtypes[1] = {BYTEAOID};
+	Datum		values[1];
+	bytea	   *hashval;
+	char	   *sql;
+	bool		found;
+
+	subdocs_init();
+	if (hash_search(subdocs, hash, HASH_FIND, NULL) != NULL)
+		return;
+
+	hashval = (bytea *) palloc(VARHDRSZ + JSONBD_SUBDOC_HASH_LEN);
+	SET_VARSIZE(hashval, VARHDRSZ + JSONBD_SUBDOC_HASH_LEN);
+	memcpy(VARDATA(hashval), hash, JSONBD_SUBDOC_HASH_LEN);
+	values[0] = PointerGetDatum(hashval);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "jsonbd: could not connect to SPI");
+
+	sql = psprintf("SELECT 1 FROM %s.%s WHERE hash = $1",
+				   quote_identifier(get_namespace_name(get_jsonbd_schema())),
+				   JSONBD_SUBDOCS_REL);
+	if (SPI_execute_with_args(sql, 1, argtypes, values, NULL, true, 1) != SPI_OK_SELECT)
+		elog(ERROR, "jsonbd: could not check subdocument");
+
+	found = SPI_processed > 0;
+	SPI_finish();
+
+	if (!found)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("jsonbd: imported datum references a subdocument missing in jsonbd_subdocs"),
+				 errhint("Copy rows of jsonbd_subdocs together with the datums.")));
+}
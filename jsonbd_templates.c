@@ -0,0 +1,554 @@
+#include "jsonbd.h"
+#include "jsonbd_utils.h"
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include "catalog/objectaddress.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "storage/lmgr.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+
+/*
+ * Templates of documents.
+ *
+ * Compression options with the 'templates' option encode a top-level object
+ * as a difference from the closest template of the options: only changed
+ * and added pairs are saved with encoded keys. The delta is marked by its
+ * first pair, which has the empty key and an array value holding
+ * the template id followed by positions of template keys the object lacks.
+ *
+ * A template is a plain jsonb object in jsonbd_templates, numbered from 1
+ * within its options. Rows are only added, so a delta always finds its
+ * template, and removed together with the options. Backends ask workers
+ * for the templates once and reload them when jsonbd_templates gets
+ * a relcache invalidation; the previous set is released only at the start
+ * of the next datum, as the datum in progress may point into it.
+ *
+ * Deltas keep template ids of the source options, so jsonbd_export refuses
+ * datums encoded with templates.
+ */
+
+#define JSONBD_TEMPLATES_REL	"jsonbd_templates"
+
+typedef struct
+{
+	int32		id;
+	int			npairs;
+	JsonbPair  *pairs;		/* nested containers are jbvBinary, for comparison */
+	JsonbValue *tree;		/* the same pairs unpacked, for the output */
+} jsonbd_template;
+
+typedef struct
+{
+	Oid				 acoid;
+	int				 ntemplates;
+	jsonbd_template	*templates;
+} template_set;
+
+static HTAB			   *template_sets = NULL;
+static MemoryContext	templates_mcxt = NULL;
+static Oid				templates_relid = InvalidOid;
+static bool				templates_stale = false;
+
+PG_FUNCTION_INFO_V1(jsonbd_add_template);
+
+static const char *sql_get_column = \
+	"SELECT attrelid FROM pg_catalog.pg_attribute WHERE attcompression = $1";
+
+static const char *sql_add_template = \
+	"INSERT INTO %s.jsonbd_templates(acoid, id, doc)"
+	" SELECT $1, COALESCE(MAX(id), 0) + 1, $2 FROM %s.jsonbd_templates"
+	" WHERE acoid = $1 HAVING COUNT(*) < %d"
+	" RETURNING id";
+
+static void
+templates_inval_callback(Datum arg, Oid relid)
+{
+	if (relid == InvalidOid || relid == templates_relid)
+		templates_stale = true;
+}
+
+/* Should be called from _PG_init */
+void
+jsonbd_templates_init(void)
+{
+	CacheRegisterRelcacheCallback(templates_inval_callback, (Datum) 0);
+}
+
+/* Should be called at the start of each datum */
+void
+jsonbd_templates_check(void)
+{
+	if (!templates_stale)
+		return;
+
+	if (templates_mcxt)
+		MemoryContextDelete(templates_mcxt);
+
+	templates_mcxt = NULL;
+	template_sets = NULL;
+	templates_stale = false;
+}
+
+/* jsonb orders keys by length first, then bytewise */
+static int
+key_cmp(const JsonbValue *a, const JsonbValue *b)
+{
+	if (a->val.string.len != b->val.string.len)
+		return a->val.string.len > b->val.string.len ? 1 : -1;
+
+	return memcmp(a->val.string.val, b->val.string.val, a->val.string.len);
+}
+
+/* Values are equal if they have the same binary representation */
+static bool
+values_equal(const JsonbValue *a, const JsonbValue *b)
+{
+	if (a->type != b->type)
+		return false;
+
+	switch (a->type)
+	{
+		case jbvNull:
+			return true;
+		case jbvBool:
+			return a->val.boolean == b->val.boolean;
+		case jbvString:
+			return a->val.string.len == b->val.string.len &&
+				memcmp(a->val.string.val, b->val.string.val,
+					   a->val.string.len) == 0;
+		case jbvNumeric:
+			return VARSIZE(a->val.numeric) == VARSIZE(b->val.numeric) &&
+				memcmp(a->val.numeric, b->val.numeric,
+					   VARSIZE(a->val.numeric)) == 0;
+		case jbvBinary:
+			return a->val.binary.len == b->val.binary.len &&
+				memcmp(a->val.binary.data, b->val.binary.data,
+					   a->val.binary.len) == 0;
+		default:
+			return false;
+	}
+}
+
+/* Top-level pairs of the object, nested containers are not unpacked */
+static int
+object_pairs(JsonbContainer *container, JsonbPair **pairs)
+{
+	JsonbIterator	   *it = JsonbIteratorInit(container);
+	JsonbIteratorToken	r;
+	JsonbValue			v;
+	int					n = 0;
+
+	r = JsonbIteratorNext(&it, &v, true);
+	Assert(r == WJB_BEGIN_OBJECT);
+	*pairs = (JsonbPair *) palloc(sizeof(JsonbPair) *
+								  Max(v.val.object.nPairs, 1));
+
+	while ((r = JsonbIteratorNext(&it, &v, true)) != WJB_DONE)
+	{
+		if (r == WJB_KEY)
+			(*pairs)[n].key = v;
+		else if (r == WJB_VALUE)
+			(*pairs)[n++].value = v;
+	}
+
+	return n;
+}
+
+static JsonbValue *
+unpack_container(JsonbContainer *container)
+{
+	JsonbIterator	   *it = JsonbIteratorInit(container);
+	JsonbParseState	   *state = NULL;
+	JsonbIteratorToken	r;
+	JsonbValue			v,
+					   *res = NULL;
+
+	while ((r = JsonbIteratorNext(&it, &v, false)) != WJB_DONE)
+		res = pushJsonbValue(&state, r, r < WJB_BEGIN_ARRAY ? &v : NULL);
+
+	return res;
+}
+
+/*
+ * Templates are received from workers as their count followed by
+ * the templates, each is its id and the document aligned to int.
+ */
+static template_set *
+get_template_set(Oid acoid, bool reload)
+{
+	template_set   *set;
+	MemoryContext	old_mcxt;
+	char		   *buf,
+				   *ptr;
+	Size			len;
+	int				i;
+
+	if (template_sets == NULL)
+	{
+		HASHCTL		ctl;
+
+		templates_mcxt = AllocSetContextCreate(TopMemoryContext,
+											   "jsonbd templates context",
+											   ALLOCSET_DEFAULT_SIZES);
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(template_set);
+		ctl.hcxt = templates_mcxt;
+		template_sets = hash_create("jsonbd templates", 16, &ctl,
+									HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+		templates_relid = get_relname_relid(JSONBD_TEMPLATES_REL,
+											get_jsonbd_schema());
+	}
+
+	set = hash_search(template_sets, &acoid, HASH_FIND, NULL);
+	if (set != NULL && !reload)
+		return set;
+
+	buf = jsonbd_worker_get_templates(acoid, &len);
+
+	/* old templates are kept, they could be used by the current datum */
+	old_mcxt = MemoryContextSwitchTo(templates_mcxt);
+	ptr = palloc(len);
+	memcpy(ptr, buf, len);
+	pfree(buf);
+	buf = ptr;
+
+	set = hash_search(template_sets, &acoid, HASH_ENTER, NULL);
+	set->ntemplates = *((int32 *) buf);
+	set->templates = (jsonbd_template *) palloc(sizeof(jsonbd_template) *
+												Max(set->ntemplates, 1));
+
+	ptr = buf + sizeof(int32);
+	for (i = 0; i < set->ntemplates; i++)
+	{
+		jsonbd_template	*t = &set->templates[i];
+		Jsonb			*doc;
+
+		t->id = *((int32 *) ptr);
+		doc = (Jsonb *) (ptr + sizeof(int32));
+		t->npairs = object_pairs(&doc->root, &t->pairs);
+		t->tree = unpack_container(&doc->root);
+		ptr += sizeof(int32) + INTALIGN(VARSIZE(doc));
+	}
+	MemoryContextSwitchTo(old_mcxt);
+
+	return set;
+}
+
+/*
+ * Compare the object with the template, returns the number of pairs that
+ * differ. If 'state' is given, changed and added pairs are pushed to it
+ * and positions of removed keys are appended to 'marker'.
+ */
+static int
+template_diff(JsonbPair *pairs, int npairs, jsonbd_template *t,
+			  JsonbParseState **state, JsonbValue *marker)
+{
+	int		i = 0,
+			j = 0,
+			cost = 0;
+
+	while (i < npairs || j < t->npairs)
+	{
+		int		cmp;
+
+		if (i == npairs)
+			cmp = 1;
+		else if (j == t->npairs)
+			cmp = -1;
+		else
+			cmp = key_cmp(&pairs[i].key, &t->pairs[j].key);
+
+		if (cmp == 0 && values_equal(&pairs[i].value, &t->pairs[j].value))
+		{
+			i++;
+			j++;
+			continue;
+		}
+
+		cost++;
+		if (cmp > 0)
+		{
+			/* removed key */
+			if (marker)
+			{
+				JsonbValue *v = &marker->val.array.elems[marker->val.array.nElems++];
+
+				v->type = jbvNumeric;
+				v->val.numeric = DatumGetNumeric(
+					DirectFunctionCall1(int4_numeric, Int32GetDatum(j)));
+			}
+			j++;
+			continue;
+		}
+
+		if (state)
+		{
+			pushJsonbValue(state, WJB_KEY, &pairs[i].key);
+			pushJsonbValue(state, WJB_VALUE, &pairs[i].value);
+		}
+
+		if (cmp == 0)
+			j++;
+		i++;
+	}
+
+	return cost;
+}
+
+/*
+ * Encode the object as a difference from the closest template of
+ * the options. Returns the document with changed and added pairs or NULL
+ * if no template is close enough, 'marker' gets the array to save in
+ * the first pair of the compressed object.
+ */
+Jsonb *
+jsonbd_template_diff(Oid acoid, Jsonb *src, JsonbValue *marker)
+{
+	template_set	   *set = get_template_set(acoid, false);
+	jsonbd_template	   *best = NULL;
+	JsonbParseState	   *state = NULL;
+	JsonbPair		   *pairs;
+	JsonbValue		   *res;
+	int					i,
+						npairs,
+						best_cost;
+
+	if (set->ntemplates == 0)
+		return NULL;
+
+	npairs = object_pairs(&src->root, &pairs);
+
+	/* the difference should be smaller than the object itself */
+	best_cost = npairs;
+	for (i = 0; i < set->ntemplates; i++)
+	{
+		int		cost = template_diff(pairs, npairs, &set->templates[i],
+									 NULL, NULL);
+
+		if (cost < best_cost)
+		{
+			best_cost = cost;
+			best = &set->templates[i];
+		}
+	}
+
+	if (best == NULL)
+		return NULL;
+
+	marker->type = jbvArray;
+	marker->val.array.rawScalar = false;
+	marker->val.array.elems = (JsonbValue *) palloc(sizeof(JsonbValue) *
+													(best->npairs + 1));
+	marker->val.array.elems[0].type = jbvNumeric;
+	marker->val.array.elems[0].val.numeric = DatumGetNumeric(
+		DirectFunctionCall1(int4_numeric, Int32GetDatum(best->id)));
+	marker->val.array.nElems = 1;
+
+	pushJsonbValue(&state, WJB_BEGIN_OBJECT, NULL);
+	template_diff(pairs, npairs, best, &state, marker);
+	res = pushJsonbValue(&state, WJB_END_OBJECT, NULL);
+
+	pfree(pairs);
+	return JsonbValueToJsonb(res);
+}
+
+static int32
+marker_int(JsonbValue *v)
+{
+	if (v->type != jbvNumeric)
+		elog(ERROR, "jsonbd: corrupted template reference");
+
+	return DatumGetInt32(DirectFunctionCall1(numeric_int4,
+											 NumericGetDatum(v->val.numeric)));
+}
+
+/*
+ * Restore the object from the template. 'obj' contains changed and added
+ * pairs with decoded keys in the sorted order.
+ */
+void
+jsonbd_template_apply(Oid acoid, JsonbValue *obj, JsonbValue *marker)
+{
+	template_set	   *set;
+	jsonbd_template	   *t = NULL;
+	JsonbPair		   *tpairs,
+					   *pairs = obj->val.object.pairs,
+					   *res;
+	bool			   *removed;
+	int32				id;
+	int					i,
+						j,
+						n = 0,
+						npairs = obj->val.object.nPairs;
+
+	if (marker->type != jbvArray || marker->val.array.nElems < 1)
+		elog(ERROR, "jsonbd: corrupted template reference");
+
+	id = marker_int(&marker->val.array.elems[0]);
+
+	/* the template could be added after the templates were loaded */
+	set = get_template_set(acoid, false);
+	for (i = 0; i < 2 && t == NULL; i++)
+	{
+		if (i > 0)
+			set = get_template_set(acoid, true);
+
+		for (j = 0; j < set->ntemplates; j++)
+			if (set->templates[j].id == id)
+				t = &set->templates[j];
+	}
+
+	if (t == NULL)
+		elog(ERROR, "jsonbd: template %d of compression options %u is not found",
+			 id, acoid);
+
+	removed = (bool *) palloc0(sizeof(bool) * Max(t->npairs, 1));
+	for (i = 1; i < marker->val.array.nElems; i++)
+	{
+		int32	pos = marker_int(&marker->val.array.elems[i]);
+
+		if (pos < 0 || pos >= t->npairs)
+			elog(ERROR, "jsonbd: corrupted template reference");
+
+		removed[pos] = true;
+	}
+
+	/* merge sorted pairs, pairs of the object replace pairs of the template */
+	tpairs = t->tree->val.object.pairs;
+	res = (JsonbPair *) palloc(sizeof(JsonbPair) * Max(t->npairs + npairs, 1));
+	for (i = 0, j = 0; i < t->npairs || j < npairs;)
+	{
+		int		cmp;
+
+		if (i == t->npairs)
+			cmp = 1;
+		else if (j == npairs)
+			cmp = -1;
+		else
+			cmp = key_cmp(&tpairs[i].key, &pairs[j].key);
+
+		if (cmp < 0)
+		{
+			if (!removed[i])
+				res[n++] = tpairs[i];
+			i++;
+		}
+		else
+		{
+			res[n++] = pairs[j++];
+			if (cmp == 0)
+				i++;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		res[i].order = i;
+
+	obj->val.object.pairs = res;
+	obj->val.object.nPairs = n;
+	pfree(removed);
+}
+
+/* Templates change how the column is stored, so only its owner adds them */
+static void
+check_template_owner(Oid acoid)
+{
+	Oid		argtypes[1] = {OIDOID};
+	Datum	values[1];
+	Oid		relid;
+	bool	isnull;
+
+	check_jsonbd_options(acoid);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "jsonbd: could not connect to SPI");
+
+	values[0] = ObjectIdGetDatum(acoid);
+	if (SPI_execute_with_args(sql_get_column, 1, argtypes, values, NULL,
+							  true, 1) != SPI_OK_SELECT)
+		elog(ERROR, "jsonbd: could not find the column of compression options");
+
+	if (SPI_processed == 0)
+		elog(ERROR, "jsonbd: compression options %u are not used by any column",
+			 acoid);
+
+	relid = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[0],
+										   SPI_tuptable->tupdesc, 1, &isnull));
+	SPI_finish();
+
+	if (!pg_class_ownercheck(relid, GetUserId()))
+		aclcheck_error(ACLCHECK_NOT_OWNER,
+					   get_relkind_objtype(get_rel_relkind(relid)),
+					   get_rel_name(relid));
+}
+
+/*
+ * Add the template document to compression options, returns its id.
+ * Other backends see the template after the commit.
+ */
+Datum
+jsonbd_add_template(PG_FUNCTION_ARGS)
+{
+	Oid			acoid = PG_GETARG_OID(0);
+	Jsonb	   *doc = PG_GETARG_JSONB_P(1);
+	Oid			argtypes[2] = {OIDOID, JSONBOID};
+	Datum		values[2];
+	Oid			nspoid = get_jsonbd_schema();
+	Oid			save_userid;
+	int			save_sec_context;
+	char	   *nspname,
+			   *sql;
+	bool		isnull;
+	int32		id;
+
+	if (!JB_ROOT_IS_OBJECT(doc))
+		elog(ERROR, "jsonbd: template should be an object");
+
+	nspname = get_namespace_name(nspoid);
+	if (!nspname)
+		elog(ERROR, "jsonbd: extension schema not found");
+	nspname = (char *) quote_identifier(nspname);
+
+	check_template_owner(acoid);
+
+	/* the next id is taken by one backend at a time */
+	LockRelationOid(get_relname_relid(JSONBD_TEMPLATES_REL, nspoid),
+					ShareRowExclusiveLock);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "jsonbd: could not connect to SPI");
+
+	GetUserIdAndSecContext(&save_userid, &save_sec_context);
+	SetUserIdAndSecContext(get_jsonbd_owner(),
+						   save_sec_context | SECURITY_LOCAL_USERID_CHANGE);
+
+	values[0] = ObjectIdGetDatum(acoid);
+	values[1] = JsonbPGetDatum(doc);
+	sql = psprintf(sql_add_template, nspname, nspname, JSONBD_MAX_TEMPLATES);
+	if (SPI_execute_with_args(sql, 2, argtypes, values, NULL, false, 0) != SPI_OK_INSERT_RETURNING)
+		elog(ERROR, "jsonbd: could not add template");
+
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+
+	if (SPI_processed == 0)
+		elog(ERROR, "jsonbd: compression options %u already have %d templates",
+			 acoid, JSONBD_MAX_TEMPLATES);
+
+	id = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0],
+									 SPI_tuptable->tupdesc, 1, &isnull));
+	SPI_finish();
+
+	CacheInvalidateRelcacheByRelid(get_relname_relid(JSONBD_TEMPLATES_REL, nspoid));
+	PG_RETURN_INT32(id);
+}
@@ -7,7 +7,9 @@
 #include "access/sysattr.h"
 #include "catalog/indexing.h"
 #include "catalog/pg_extension.h"
+#include "catalog/pg_type.h"
 #include "commands/extension.h"
+#include "executor/spi.h"
 #include "nodes/execnodes.h"
 #include "nodes/makefuncs.h"
 #include "utils/fmgroids.h"
@@ -135,10 +137,11 @@ shm_mq_clean_receiver(shm_mq *mq)
 	amq->mq_detached = false;
 }
 
-Oid
-get_jsonbd_schema(void)
+/* Finds the schema and the owner of the extension */
+static bool
+get_jsonbd_extension(Oid *nspoid, Oid *owner)
 {
-	Oid				result;
+	bool			found;
 	Relation		rel;
 	SysScanDesc		scandesc;
 	HeapTuple		tuple;
@@ -146,11 +149,11 @@ get_jsonbd_schema(void)
 	Oid				ext_oid;
 
 	if (!IsTransactionState())
-		return InvalidOid;
+		return false;
 
 	ext_oid = get_extension_oid("jsonbd", true);
 	if (ext_oid == InvalidOid)
-		return InvalidOid; /* exit if pg_pathman does not exist */
+		return false; /* exit if pg_pathman does not exist */
 
 	ScanKeyInit(&entry[0],
 				ObjectIdAttributeNumber,
@@ -164,13 +167,63 @@ get_jsonbd_schema(void)
 	tuple = systable_getnext(scandesc);
 
 	/* We assume that there can be at most one matching tuple */
-	if (HeapTupleIsValid(tuple))
-		result = ((Form_pg_extension) GETSTRUCT(tuple))->extnamespace;
-	else
-		result = InvalidOid;
+	found = HeapTupleIsValid(tuple);
+	if (found)
+	{
+		*nspoid = ((Form_pg_extension) GETSTRUCT(tuple))->extnamespace;
+		*owner = ((Form_pg_extension) GETSTRUCT(tuple))->extowner;
+	}
 
 	systable_endscan(scandesc);
 
 	heap_close(rel, AccessShareLock);
-	return result;
+	return found;
+}
+
+Oid
+get_jsonbd_schema(void)
+{
+	Oid		nspoid,
+			owner;
+
+	if (!get_jsonbd_extension(&nspoid, &owner))
+		return InvalidOid;
+
+	return nspoid;
+}
+
+Oid
+get_jsonbd_owner(void)
+{
+	Oid		nspoid,
+			owner;
+
+	if (!get_jsonbd_extension(&nspoid, &owner))
+		return InvalidOid;
+
+	return owner;
+}
+
+/* Raise an error if 'acoid' are not compression options of jsonbd */
+void
+check_jsonbd_options(Oid acoid)
+{
+	Oid		argtypes[1] = {OIDOID};
+	Datum	values[1];
+	bool	found;
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "jsonbd: could not connect to SPI");
+
+	values[0] = ObjectIdGetDatum(acoid);
+	if (SPI_execute_with_args("SELECT 1 FROM pg_catalog.pg_attr_compression"
+							  " WHERE acoid = $1 AND acname = 'jsonbd'",
+							  1, argtypes, values, NULL, true, 1) != SPI_OK_SELECT)
+		elog(ERROR, "jsonbd: could not check compression options");
+
+	found = SPI_processed > 0;
+	SPI_finish();
+
+	if (!found)
+		elog(ERROR, "jsonbd: %u are not jsonbd compression options", acoid);
 }
@@ -9,5 +9,7 @@ extern uint32 qhashmurmur3_32(const void *data, size_t nbytes);
 extern void shm_mq_clean_receiver(shm_mq *mq);
 extern void shm_mq_clean_sender(shm_mq *mq);
 Oid	get_jsonbd_schema(void);
+Oid	get_jsonbd_owner(void);
+void check_jsonbd_options(Oid acoid);
 
 #endif
@@ -7,16 +7,20 @@
 #include "pgstat.h"
 
 #include "access/genam.h"
+#include "access/hash.h"
 #include "access/heapam.h"
 #include "access/htup_details.h"
 #include "access/sysattr.h"
 #include "access/xact.h"
+#include "access/xlog.h"
 #include "catalog/indexing.h"
 #include "catalog/namespace.h"
 #include "catalog/pg_compression_opt.h"
 #include "catalog/pg_extension.h"
+#include "catalog/pg_type.h"
 #include "commands/extension.h"
 #include "commands/dbcommands.h"
+#include "executor/executor.h"
 #include "executor/spi.h"
 #include "port/atomics.h"
 #include "storage/ipc.h"
@@ -27,6 +31,8 @@
 #include "storage/shm_toc.h"
 #include "utils/builtins.h"
 #include "utils/fmgroids.h"
+#include "utils/guc.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/rel.h"
@@ -36,32 +42,97 @@
 #include "utils/syscache.h"
 
 static bool						xact_started = false;
+static bool						read_xact_started = false;
+static int						read_xact_requests = 0;
 static bool						shutdown_requested = false;
 static jsonbd_shm_worker	   *worker_state;
 static MemoryContext			worker_context = NULL;
 static MemoryContext			worker_cache_context = NULL;
 static HTAB					   *cmcache;
+static dsm_segment			   *response_seg = NULL;
+static List					   *dropped_dictionaries = NIL;
+static bool						drop_callback_registered = false;
 
 Oid jsonbd_dictionary_reloid	= InvalidOid;
-Oid	jsonbd_keys_indoid			= InvalidOid;
-Oid	jsonbd_id_indoid			= InvalidOid;
+static jsonbd_segment			default_segment = {InvalidOid, InvalidOid, InvalidOid};
 
 void jsonbd_worker_main(Datum arg);
 void jsonbd_launcher_main(Datum arg);
 static bool jsonbd_register_worker(int, Oid, int);
 static char *jsonbd_get_dictionary_name(Oid relid);
+static char *jsonbd_get_dictionaries_name(void);
+static char *jsonbd_get_attachments_name(void);
+static char *jsonbd_get_subdocs_name(void);
+static char *jsonbd_get_templates_name(void);
+static char *jsonbd_get_qualified_name(const char *relname);
+static void start_xact_command(void);
+static void finish_xact_command(void);
+static void start_read_command(void);
+static void finish_read_command(void);
+static void abort_xact_command(void);
 
 #define JSONBD_DICTIONARY_REL	"jsonbd_dictionary"
+#define JSONBD_DICTIONARIES_REL	"jsonbd_dictionaries"
+#define JSONBD_ATTACHMENTS_REL	"jsonbd_attachments"
+#define JSONBD_SUBDOCS_REL		"jsonbd_subdocs"
+#define JSONBD_TEMPLATES_REL	"jsonbd_templates"
+#define JSONBD_DEFAULT_SEGMENT_REL	"jsonbd_dictionary_default"
+#define JSONBD_SEGMENT_REL_FORMAT	"jsonbd_dictionary_%u"
 
-static const char *sql_insert = \
-	"WITH t AS (SELECT (COALESCE(MAX(id), 0) + 1) new_id FROM %s"
-	" WHERE acoid = %d) INSERT INTO %s"
-	" SELECT %d, t.new_id, '%s' FROM t RETURNING id";
+static const char *sql_create_segment = \
+	"CREATE TABLE %s PARTITION OF %s FOR VALUES IN (%u)";
+
+static const char *sql_drop_segment = \
+	"DROP TABLE IF EXISTS %s";
+
+static const char *sql_dictionary_used = \
+	"SELECT 1 FROM %s WHERE parent = %u"
+	" UNION ALL SELECT 1 FROM %s WHERE dictid = %u AND acoid <> %u";
+
+static const char *sql_forget_dictionary = \
+	"WITH d AS (DELETE FROM %s WHERE dictid = %u)"
+	" DELETE FROM %s WHERE acoid = %u";
+
+static const char *sql_detach = \
+	"DELETE FROM %s WHERE acoid = %u";
+
+static const char *sql_get_parent = \
+	"SELECT parent, maxid FROM %s WHERE dictid = %u";
+
+static const char *sql_attach = \
+	"INSERT INTO %s(dictid, parent, maxid)"
+	" SELECT %u, %u, COALESCE(MAX(id), %u) FROM %s WHERE acoid = %u"
+	" ON CONFLICT (dictid) DO NOTHING";
+
+static const char *sql_create_named = \
+	"INSERT INTO %s(dictid, name) VALUES (%u, $1)"
+	" ON CONFLICT DO NOTHING";
+
+static const char *sql_get_named = \
+	"SELECT dictid FROM %s WHERE name = $1";
+
+static const char *sql_attach_named = \
+	"INSERT INTO %s(acoid, dictid) VALUES (%u, %u)"
+	" ON CONFLICT (acoid) DO NOTHING";
+
+static const char *sql_put_subdoc = \
+	"INSERT INTO %s(hash, doc) VALUES ($1, $2)"
+	" ON CONFLICT (hash) DO NOTHING";
+
+static const char *sql_get_subdoc = \
+	"SELECT doc FROM %s WHERE hash = $1";
+
+static const char *sql_get_templates = \
+	"SELECT id, doc FROM %s WHERE acoid = %u ORDER BY id";
+
+static const char *sql_drop_templates = \
+	"DELETE FROM %s WHERE acoid = %u";
 
 enum {
 	JSONBD_DICTIONARY_REL_ATT_ACOID = 1,
 	JSONBD_DICTIONARY_REL_ATT_ID,
 	JSONBD_DICTIONARY_REL_ATT_KEY,
+	JSONBD_DICTIONARY_REL_ATT_KEYHASH,
 	JSONBD_DICTIONARY_REL_ATT_COUNT
 };
 
@@ -81,36 +152,145 @@ handle_sigterm(SIGNAL_ARGS)
 	errno = save_errno;
 }
 
-/* Returns an item from compression options cache */
+static jsonbd_cached_cmopt *get_cached_compression_options(Oid cmoptoid);
+
+/*
+ * Load information about the dictionary inherited by compression options.
+ * Should be called in transaction.
+ */
+static void
+load_dictionary_parent(jsonbd_cached_cmopt *cmdata)
+{
+	char   *sql = psprintf(sql_get_parent, jsonbd_get_dictionaries_name(),
+						   cmdata->cmoptoid);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "jsonbd: could not connect to SPI");
+
+	if (SPI_exec(sql, 1) != SPI_OK_SELECT)
+		elog(ERROR, "jsonbd: could not get dictionary parent");
+
+	if (SPI_processed > 0)
+	{
+		bool	isnull;
+
+		cmdata->parent = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[0],
+							SPI_tuptable->tupdesc, 1, &isnull));
+		cmdata->parent_maxid = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0],
+							SPI_tuptable->tupdesc, 2, &isnull));
+	}
+
+	SPI_finish();
+	pfree(sql);
+
+	if (OidIsValid(cmdata->parent))
+		cmdata->parent_cache = get_cached_compression_options(cmdata->parent);
+}
+
+/*
+ * Returns an item from compression options cache. The item is added only
+ * after its parent is loaded, loading could fail and the worker continues
+ * with the next task.
+ */
 static jsonbd_cached_cmopt *
 get_cached_compression_options(Oid cmoptoid)
 {
 	bool	found;
-	jsonbd_cached_cmopt *cmdata;
+	jsonbd_cached_cmopt *cmdata,
+						 loaded;
+	HASHCTL		hash_ctl;
+
+	cmdata = hash_search(cmcache, &cmoptoid, HASH_FIND, NULL);
+	if (cmdata)
+		return cmdata;
+
+	memset(&loaded, 0, sizeof(loaded));
+	loaded.cmoptoid = cmoptoid;
+	loaded.parent = InvalidOid;
+	loaded.parent_maxid = 0;
+	loaded.parent_cache = NULL;
+	loaded.segment.relid = InvalidOid;
+	loaded.segment_changed = false;
+
+	start_xact_command();
+	load_dictionary_parent(&loaded);
+
+	memset(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(uint32);
+	hash_ctl.entrysize = sizeof(jsonbd_cached_key);
+	hash_ctl.hcxt = worker_cache_context;
+
+	loaded.key_cache = hash_create("jsonbd map by key",
+						  128,
+						  &hash_ctl,
+						  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	hash_ctl.entrysize = sizeof(jsonbd_cached_id);
+	loaded.id_cache = hash_create("jsonbd map by id",
+						  128,
+						  &hash_ctl,
+						  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
 
 	cmdata = hash_search(cmcache, &cmoptoid, HASH_ENTER, &found);
-	if (!found)
+	Assert(!found);
+	*cmdata = loaded;
+
+	return cmdata;
+}
+
+/* Returns the dictionary (own or inherited) that contains the key id */
+static jsonbd_cached_cmopt *
+get_dictionary_for_id(jsonbd_cached_cmopt *cmdata, uint32 id)
+{
+	while (cmdata->parent_cache && id <= cmdata->parent_maxid)
+		cmdata = cmdata->parent_cache;
+
+	return cmdata;
+}
+
+/* Search for the key in cache of the dictionary, returns NULL if not found */
+static jsonbd_pair *
+get_cached_pair(jsonbd_cached_cmopt *cmdata, uint32 hkey, char *key)
+{
+	ListCell			*lc;
+	jsonbd_cached_key	*ckey;
+
+	ckey = hash_search(cmdata->key_cache, &hkey, HASH_FIND, NULL);
+	if (ckey == NULL)
+		return NULL;
+
+	foreach(lc, ckey->pairs)
 	{
-		HASHCTL		hash_ctl;
+		jsonbd_pair	*pair = lfirst(lc);
+		if (pair->id > 0 && strcmp(pair->key, key) == 0)
+			return pair;
+	}
 
-		memset(&hash_ctl, 0, sizeof(hash_ctl));
-		hash_ctl.keysize = sizeof(uint32);
-		hash_ctl.entrysize = sizeof(jsonbd_cached_key);
-		hash_ctl.hcxt = worker_cache_context;
+	return NULL;
+}
 
-		cmdata->cmoptoid = cmoptoid;
-		cmdata->key_cache = hash_create("jsonbd map by key",
-							  128,
-							  &hash_ctl,
-							  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+/*
+ * Forget cached segments when their relations change: a segment is dropped
+ * with its dictionary or could be detached. Invalidations come while
+ * the segment could be in use, so it's looked up again by name only on
+ * the next get_dictionary_segment.
+ */
+static void
+segment_invalidate_callback(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS		 status;
+	jsonbd_cached_cmopt	*cmdata;
 
-		hash_ctl.entrysize = sizeof(jsonbd_cached_id);
-		cmdata->id_cache = hash_create("jsonbd map by id",
-							  128,
-							  &hash_ctl,
-							  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	if (cmcache == NULL)
+		return;
+
+	hash_seq_init(&status, cmcache);
+	while ((cmdata = (jsonbd_cached_cmopt *) hash_seq_search(&status)) != NULL)
+	{
+		if (OidIsValid(cmdata->segment.relid) &&
+			(!OidIsValid(relid) || cmdata->segment.relid == relid))
+			cmdata->segment_changed = true;
 	}
-	return cmdata;
 }
 
 static void
@@ -127,6 +307,12 @@ init_worker(dsm_segment *seg)
 	/* Connect to our database */
 	BackgroundWorkerInitializeConnectionByOid(worker_args->dboid, InvalidOid);
 
+	/*
+	 * Backends wait for our commits, but keys become durable with commits
+	 * of backends anyway, see jsonbd_insert_key
+	 */
+	SetConfigOption("synchronous_commit", "off", PGC_SUSET, PGC_S_OVERRIDE);
+
 	worker_state = shm_toc_lookup(toc, worker_args->worker_num, false);
 	worker_state->proc = MyProc;
 	worker_state->dboid = worker_args->dboid;
@@ -152,6 +338,8 @@ init_worker(dsm_segment *seg)
 						  &hash_ctl,
 						  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
 
+	CacheRegisterRelcacheCallback(segment_invalidate_callback, (Datum) 0);
+
 	elog(LOG, "jsonbd dictionary worker %d started with pid: %d",
 			worker_args->worker_num, MyProcPid);
 
@@ -167,21 +355,31 @@ init_worker(dsm_segment *seg)
 	hdr->workers_ready++;
 }
 
+/*
+ * Start a transaction with a snapshot, used for writes and SPI queries.
+ * If the worker has an open read transaction, it becomes a write one
+ * and will be committed by finish_xact_command.
+ */
 static void
 start_xact_command(void)
 {
-	if (IsTransactionState())
+	if (xact_started)
+		return;
+
+	/* the transaction of a backend */
+	if (IsTransactionState() && !read_xact_started)
 		return;
 
-	if (!xact_started)
+	if (!read_xact_started)
 	{
 		ereport(DEBUG3,
 				(errmsg_internal("StartTransactionCommand")));
 		StartTransactionCommand();
-		PushActiveSnapshot(GetTransactionSnapshot());
-
-		xact_started = true;
 	}
+
+	PushActiveSnapshot(GetTransactionSnapshot());
+	read_xact_started = false;
+	xact_started = true;
 }
 
 static void
@@ -199,6 +397,249 @@ finish_xact_command(void)
 	}
 }
 
+/*
+ * Start a transaction for reading the dictionary. Dictionary rows are read
+ * with SnapshotAny and checked by dictionary_tuple_valid, so the transaction
+ * doesn't take a snapshot and is kept open between requests, until
+ * the worker becomes idle or a write is needed. Catalog changes are still
+ * seen because the relations are locked (and invalidations accepted) on
+ * each request.
+ */
+static void
+start_read_command(void)
+{
+	if (IsTransactionState())
+	{
+		if (read_xact_started)
+			AcceptInvalidationMessages();
+
+		return;
+	}
+
+	ereport(DEBUG3,
+			(errmsg_internal("StartTransactionCommand (read)")));
+	StartTransactionCommand();
+	read_xact_started = true;
+	read_xact_requests = 0;
+}
+
+static void
+finish_read_command(void)
+{
+	if (read_xact_started)
+	{
+		ereport(DEBUG3,
+				(errmsg_internal("CommitTransactionCommand (read)")));
+
+		CommitTransactionCommand();
+		read_xact_started = false;
+	}
+}
+
+static void
+abort_xact_command(void)
+{
+	if (xact_started || read_xact_started)
+	{
+		AbortCurrentTransaction();
+		xact_started = false;
+		read_xact_started = false;
+	}
+}
+
+/* Find indexes of the segment */
+static void
+fill_segment_indexes(jsonbd_segment *segment)
+{
+	Relation	 rel;
+	ListCell	*lc;
+	List		*indexes;
+
+	rel = relation_open(segment->relid, AccessShareLock);
+	indexes = RelationGetIndexList(rel);
+	Assert(list_length(indexes) == 2);
+
+	foreach(lc, indexes)
+	{
+		Oid			indOid = lfirst_oid(lc);
+		Relation	indRel = index_open(indOid, NoLock);
+		int			attnum = indRel->rd_index->indkey.values[1];
+
+		if (attnum == JSONBD_DICTIONARY_REL_ATT_ID)
+			segment->id_indoid = indOid;
+		else
+		{
+			Assert(attnum == JSONBD_DICTIONARY_REL_ATT_KEYHASH);
+			segment->keys_indoid = indOid;
+		}
+
+		index_close(indRel, NoLock);
+	}
+	relation_close(rel, AccessShareLock);
+
+	Assert(OidIsValid(segment->id_indoid));
+	Assert(OidIsValid(segment->keys_indoid));
+}
+
+static uint32 jsonbd_get_max_id(jsonbd_segment *segment, Oid cmoptoid);
+
+/*
+ * Returns the storage segment of the dictionary. Own segments are created
+ * on first insert if 'create' is true, we don't wait for locks to create
+ * them: if the dictionary table is used at the moment, the dictionary goes
+ * to the default segment and stays there, unless its segment has been
+ * created meanwhile.
+ * Should be called in transaction, with a snapshot if 'create' is true.
+ */
+static jsonbd_segment *
+get_dictionary_segment(jsonbd_cached_cmopt *cmdata, bool create)
+{
+	static Oid	nspoid = InvalidOid;
+	Oid		relid,
+			parent = jsonbd_get_dictionary_relid();
+	char   *relname;
+	bool	locked;
+
+	if (cmdata->segment_changed)
+	{
+		cmdata->segment.relid = InvalidOid;
+		cmdata->segment_changed = false;
+	}
+
+	if (OidIsValid(cmdata->segment.relid))
+		return &cmdata->segment;
+
+	if (!OidIsValid(nspoid))
+		nspoid = get_jsonbd_schema();
+
+	relname = psprintf(JSONBD_SEGMENT_REL_FORMAT, cmdata->cmoptoid);
+	relid = get_relname_relid(relname, nspoid);
+
+	if (!OidIsValid(relid) && create)
+	{
+		/* the dictionary is already in the default segment */
+		if (jsonbd_get_max_id(&default_segment, cmdata->cmoptoid) > 0)
+		{
+			cmdata->segment = default_segment;
+			return &cmdata->segment;
+		}
+
+		locked = ConditionalLockRelationOid(parent, AccessExclusiveLock);
+
+		/* don't keep the table locked if the segment will not be created */
+		if (locked &&
+			!ConditionalLockRelationOid(default_segment.relid, AccessExclusiveLock))
+		{
+			UnlockRelationOid(parent, AccessExclusiveLock);
+			locked = false;
+		}
+
+		if (locked)
+		{
+			/* someone could create it or use the default before we got the lock */
+			relid = get_relname_relid(relname, nspoid);
+			if (!OidIsValid(relid) &&
+				jsonbd_get_max_id(&default_segment, cmdata->cmoptoid) > 0)
+			{
+				cmdata->segment = default_segment;
+				return &cmdata->segment;
+			}
+
+			if (!OidIsValid(relid))
+			{
+				char   *segname = jsonbd_get_qualified_name(relname);
+				char   *sql = psprintf(sql_create_segment, segname,
+									   jsonbd_get_dictionary_name(parent),
+									   cmdata->cmoptoid);
+
+				if (SPI_connect() != SPI_OK_CONNECT)
+					elog(ERROR, "jsonbd: could not connect to SPI");
+
+				if (SPI_exec(sql, 0) != SPI_OK_UTILITY)
+					elog(ERROR, "jsonbd: could not create dictionary segment");
+
+				SPI_finish();
+				pfree(segname);
+				CommandCounterIncrement();
+				relid = get_relname_relid(relname, nspoid);
+				Assert(OidIsValid(relid));
+			}
+		}
+		else
+		{
+			/*
+			 * The segment could be created by the one who holds the lock.
+			 * Creation of a partition locks the default one, so after we got
+			 * it the segment either exists or will not be created until
+			 * the commit, keys could not go to the default segment otherwise.
+			 */
+			LockRelationOid(default_segment.relid, RowExclusiveLock);
+			AcceptInvalidationMessages();
+
+			relid = get_relname_relid(relname, nspoid);
+			if (!OidIsValid(relid))
+			{
+				cmdata->segment = default_segment;
+				return &cmdata->segment;
+			}
+		}
+	}
+
+	if (!OidIsValid(relid))
+		/* no keys yet */
+		return &default_segment;
+
+	cmdata->segment.relid = relid;
+	fill_segment_indexes(&cmdata->segment);
+	return &cmdata->segment;
+}
+
+/*
+ * Check the dictionary row found with SnapshotAny. Keys of bulk loads are
+ * inserted by user transactions, which could abort, and rows of dropped
+ * dictionaries are deleted from the default segment, such rows should not
+ * be used. Rows of running transactions are used only if 'in_progress',
+ * their ids should not be given to other keys, but their keys are unknown
+ * until the commit.
+ */
+static bool
+dictionary_tuple_valid(HeapTuple tup, bool in_progress)
+{
+	HeapTupleHeader	htup = tup->t_data;
+	TransactionId	xid;
+
+	if (!HeapTupleHeaderXminCommitted(htup))
+	{
+		if (HeapTupleHeaderXminInvalid(htup))
+			return false;
+
+		xid = HeapTupleHeaderGetRawXmin(htup);
+		if (!TransactionIdIsCurrentTransactionId(xid))
+		{
+			if (TransactionIdIsInProgress(xid))
+				return in_progress;
+			if (!TransactionIdDidCommit(xid))
+				return false;
+		}
+	}
+
+	/* dictionary rows are never updated, only deleted */
+	if ((htup->t_infomask & HEAP_XMAX_INVALID) ||
+		(htup->t_infomask & HEAP_XMAX_IS_MULTI) ||
+		HEAP_XMAX_IS_LOCKED_ONLY(htup->t_infomask))
+		return true;
+
+	if (htup->t_infomask & HEAP_XMAX_COMMITTED)
+		return false;
+
+	xid = HeapTupleHeaderGetRawXmax(htup);
+	if (TransactionIdIsCurrentTransactionId(xid) ||
+		TransactionIdIsInProgress(xid))
+		return true;
+
+	return !TransactionIdDidCommit(xid);
+}
+
 static char *
 jsonbd_get_key(Relation rel, Relation indrel, Oid cmoptoid, uint32 key_id)
 {
@@ -224,7 +665,10 @@ jsonbd_get_key(Relation rel, Relation indrel, Oid cmoptoid, uint32 key_id)
 	scan = index_beginscan(rel, indrel, SnapshotAny, 2, 0);
 	index_rescan(scan, skey, 2, NULL, 0);
 
-	tup = index_getnext(scan, ForwardScanDirection);
+	while ((tup = index_getnext(scan, ForwardScanDirection)) != NULL)
+		if (dictionary_tuple_valid(tup, false))
+			break;
+
 	if (tup == NULL)
 		elog(ERROR, "key not found for cmopt=%d and id=%d", cmoptoid, key_id);
 
@@ -248,10 +692,6 @@ jsonbd_get_keys(Oid cmoptoid, uint32 *ids, int nkeys)
 	char		  **keys;
 	jsonbd_cached_cmopt		*cmcache;
 
-	Oid			relid = jsonbd_get_dictionary_relid();
-	Relation	rel = NULL,
-				indrel;
-
 	cmcache = get_cached_compression_options(cmoptoid);
 	keys = (char **) MemoryContextAlloc(worker_context,
 										sizeof(char *) * nkeys);
@@ -263,22 +703,20 @@ jsonbd_get_keys(Oid cmoptoid, uint32 *ids, int nkeys)
 		jsonbd_cached_id		*cid;
 		jsonbd_pair				*pair;
 
-		Assert(cmcache->id_cache);
-		cid = hash_search(cmcache->id_cache, &ids[i], HASH_ENTER, &found);
+		jsonbd_cached_cmopt		*owner = get_dictionary_for_id(cmcache, ids[i]);
+
+		Assert(owner->id_cache);
+		cid = hash_search(owner->id_cache, &ids[i], HASH_ENTER, &found);
 
 		if (found)
 		{
 			keys[i] = cid->pair->key;
+			jsonbd_shared_cache_put(cmoptoid, ids[i], keys[i], strlen(keys[i]));
 			continue;
 		}
 
-		if (!rel)
-		{
-			start_xact_command();
-			rel = relation_open(relid, AccessShareLock);
-			indrel = index_open(jsonbd_id_indoid, AccessShareLock);
-		}
-		keys[i] = jsonbd_get_key(rel, indrel, cmoptoid, ids[i]);
+		start_read_command();
+		keys[i] = jsonbd_find_key(owner, ids[i]);
 
 		/* create new pair and save it in cache */
 		oldcontext = MemoryContextSwitchTo(worker_cache_context);
@@ -287,20 +725,25 @@ jsonbd_get_keys(Oid cmoptoid, uint32 *ids, int nkeys)
 		pair->key = pstrdup(keys[i]);
 		cid->pair = pair;
 		MemoryContextSwitchTo(oldcontext);
-	}
 
-	if (rel)
-	{
-		index_close(indrel, AccessShareLock);
-		relation_close(rel, AccessShareLock);
-		finish_xact_command();
+		jsonbd_shared_cache_put(cmoptoid, ids[i], keys[i], strlen(keys[i]));
 	}
 
 	return keys;
 }
 
+/* 64-bit hash of the key as it is saved in the dictionary */
+Datum
+jsonbd_key_hash(const char *key, int keylen)
+{
+	return Int64GetDatum((int64) DatumGetUInt64(
+			hash_any_extended((const unsigned char *) key, keylen, 0)));
+}
+
 /*
- * Search for key in index.
+ * Search for key in index. The index contains hashes of keys, so
+ * the key is checked on each found tuple. A key registered by a bulk load
+ * could have several ids, the first found one is returned.
  * Index should be locked properly
  */
 static uint32
@@ -311,6 +754,7 @@ jsonbd_get_key_id(Relation rel, Relation indrel, Oid cmoptoid, char *key)
 	HeapTuple		tup;
 	bool			isNull;
 	uint32			result = 0;
+	int				keylen = strlen(key);
 
 	ScanKeyInit(&skey[0],
 				1,
@@ -320,58 +764,253 @@ jsonbd_get_key_id(Relation rel, Relation indrel, Oid cmoptoid, char *key)
 	ScanKeyInit(&skey[1],
 				2,
 				BTEqualStrategyNumber,
-				F_TEXTEQ,
-				CStringGetTextDatum(key));
+				F_INT8EQ,
+				jsonbd_key_hash(key, keylen));
 
 	scan = index_beginscan(rel, indrel, SnapshotAny, 2, 0);
 	index_rescan(scan, skey, 2, NULL, 0);
 
-	tup = index_getnext(scan, ForwardScanDirection);
-	if (tup != NULL)
+	while ((tup = index_getnext(scan, ForwardScanDirection)) != NULL)
 	{
-		Datum dat = heap_getattr(tup, JSONBD_DICTIONARY_REL_ATT_ID,
-							  RelationGetDescr(rel), &isNull);
+		Datum	dat;
+		text   *found;
+
+		if (!dictionary_tuple_valid(tup, false))
+			continue;
+
+		dat = heap_getattr(tup, JSONBD_DICTIONARY_REL_ATT_KEY,
+						   RelationGetDescr(rel), &isNull);
+		found = DatumGetTextPP(dat);
 		Assert(!isNull);
-		result = DatumGetInt32(dat);
+		if (VARSIZE_ANY_EXHDR(found) == keylen &&
+				memcmp(VARDATA_ANY(found), key, keylen) == 0)
+		{
+			dat = heap_getattr(tup, JSONBD_DICTIONARY_REL_ATT_ID,
+							   RelationGetDescr(rel), &isNull);
+			Assert(!isNull);
+			result = DatumGetInt32(dat);
+			break;
+		}
 	}
 	index_endscan(scan);
 
 	return result;
 }
 
+/* Search for the key id in the segment of the dictionary */
+static uint32
+jsonbd_find_key_id(jsonbd_cached_cmopt *cmdata, char *key)
+{
+	jsonbd_segment *segment = get_dictionary_segment(cmdata, false);
+	Relation		rel,
+					indrel;
+	uint32			result;
+
+	rel = relation_open(segment->relid, AccessShareLock);
+	indrel = index_open(segment->keys_indoid, AccessShareLock);
+	result = jsonbd_get_key_id(rel, indrel, cmdata->cmoptoid, key);
+	index_close(indrel, AccessShareLock);
+	relation_close(rel, AccessShareLock);
+
+	return result;
+}
+
+/* Search for the key by its id in the segment of the dictionary */
+static char *
+jsonbd_find_key(jsonbd_cached_cmopt *cmdata, uint32 id)
+{
+	jsonbd_segment *segment = get_dictionary_segment(cmdata, false);
+	Relation		rel,
+					indrel;
+	char		   *result;
+
+	rel = relation_open(segment->relid, AccessShareLock);
+	indrel = index_open(segment->id_indoid, AccessShareLock);
+	result = jsonbd_get_key(rel, indrel, cmdata->cmoptoid, id);
+	index_close(indrel, AccessShareLock);
+	relation_close(rel, AccessShareLock);
+
+	return result;
+}
+
 /*
- * Get key IDs using relation
+ * Search for the key in inherited dictionaries. Only ids that were known
+ * when the dictionary was inherited are visible.
  */
-static bool
-jsonbd_get_key_ids(Oid cmoptoid, char *buf, uint32 *idsbuf, int nkeys)
+static uint32
+jsonbd_get_inherited_key_id(jsonbd_cached_cmopt *cmdata, uint32 hkey,
+							char *key)
 {
-	Relation	rel = NULL;
-	Relation	indrel;
-	int			i;
-	Oid			relid = jsonbd_get_dictionary_relid();
-	bool		spi_on = false,
-				failed = false;
-	jsonbd_cached_cmopt		*cmcache;
-	static char *relname = NULL;
+	uint32					 maxid = cmdata->parent_maxid;
+	jsonbd_cached_cmopt		*parent;
 
-	if (relname == NULL)
+	for (parent = cmdata->parent_cache; parent != NULL;
+			parent = parent->parent_cache)
 	{
-		start_xact_command();
-		relname = jsonbd_get_dictionary_name(relid);
-		finish_xact_command();
+		uint32		 id;
+		jsonbd_pair	*pair = get_cached_pair(parent, hkey, key);
+
+		if (pair)
+			id = pair->id;
+		else
+			id = jsonbd_find_key_id(parent, key);
+
+		if (id > 0 && id <= maxid)
+			return id;
+
+		maxid = Min(maxid, parent->parent_maxid);
+	}
+
+	return 0;
+}
+
+/* Returns maximum id of the dictionary in the segment or 0 if it's empty */
+static uint32
+jsonbd_get_max_id(jsonbd_segment *segment, Oid cmoptoid)
+{
+	IndexScanDesc	scan;
+	ScanKeyData		skey;
+	HeapTuple		tup;
+	Relation		rel,
+					indrel;
+	uint32			result = 0;
+
+	rel = relation_open(segment->relid, AccessShareLock);
+	indrel = index_open(segment->id_indoid, AccessShareLock);
+	ScanKeyInit(&skey,
+				1,
+				BTEqualStrategyNumber,
+				F_OIDEQ,
+				ObjectIdGetDatum(cmoptoid));
+
+	scan = index_beginscan(rel, indrel, SnapshotAny, 1, 0);
+	index_rescan(scan, &skey, 1, NULL, 0);
+
+	/* ids of running transactions are taken already */
+	while ((tup = index_getnext(scan, BackwardScanDirection)) != NULL)
+		if (dictionary_tuple_valid(tup, true))
+			break;
+
+	if (tup != NULL)
+	{
+		bool	isNull;
+		Datum	dat = heap_getattr(tup, JSONBD_DICTIONARY_REL_ATT_ID,
+								   RelationGetDescr(rel), &isNull);
+
+		Assert(!isNull);
+		result = DatumGetInt32(dat);
 	}
 
+	index_endscan(scan);
+	index_close(indrel, AccessShareLock);
+	relation_close(rel, AccessShareLock);
+	return result;
+}
+
+/*
+ * Insert the tuple into the dictionary segment and its indexes.
+ * jsonbd_dictionary is a regular table, so its indexes are maintained
+ * the way the executor does it, not by catalog routines.
+ */
+static void
+insert_dictionary_tuple(Relation rel, HeapTuple tup)
+{
+	EState			*estate = CreateExecutorState();
+	ResultRelInfo	*resultRelInfo = makeNode(ResultRelInfo);
+	TupleTableSlot	*slot;
+	List			*recheck;
+
+	InitResultRelInfo(resultRelInfo, rel, 1, NULL, 0);
+	estate->es_result_relations = resultRelInfo;
+	estate->es_num_result_relations = 1;
+	estate->es_result_relation_info = resultRelInfo;
+	ExecOpenIndices(resultRelInfo, false);
+
+	simple_heap_insert(rel, tup);
+
+	slot = ExecInitExtraTupleSlot(estate, RelationGetDescr(rel));
+	ExecStoreTuple(tup, slot, InvalidBuffer, false);
+	recheck = ExecInsertIndexTuples(slot, &(tup->t_self), estate, false,
+									NULL, NIL);
+	list_free(recheck);
+
+	ExecCloseIndices(resultRelInfo);
+	ExecResetTupleTable(estate->es_tupleTable, false);
+	FreeExecutorState(estate);
+}
+
+/*
+ * Insert the key into the dictionary, returns its new id. The keys index
+ * should be locked exclusively, so nobody else takes the same id.
+ *
+ * The tuple is inserted directly, without SPI. The worker commits
+ * asynchronously (see init_worker): a backend gets ids only after
+ * the commit is written to WAL buffers, and its own commit, that comes
+ * later, flushes WAL including the new keys. So keys are durable when
+ * the data using them is.
+ */
+static uint32
+jsonbd_insert_key(jsonbd_segment *segment, jsonbd_cached_cmopt *cmdata,
+				  char *key)
+{
+	Relation	rel;
+	HeapTuple	tup;
+	uint32		id,
+				reserved;
+	Datum		values[JSONBD_DICTIONARY_REL_ATT_COUNT - 1];
+	bool		nulls[JSONBD_DICTIONARY_REL_ATT_COUNT - 1];
+
+	rel = relation_open(segment->relid, RowExclusiveLock);
+
+	/* ids of the own dictionary go after the inherited ones */
+	id = jsonbd_get_max_id(segment, cmdata->cmoptoid);
+	if (id == 0)
+		id = cmdata->parent_maxid;
+
+	/* skip ids reserved by bulk loads */
+	reserved = jsonbd_reserve_ids(cmdata->cmoptoid, id, 1);
+	id = reserved ? reserved : id + 1;
+
+	memset(nulls, false, sizeof(nulls));
+	values[JSONBD_DICTIONARY_REL_ATT_ACOID - 1] = ObjectIdGetDatum(cmdata->cmoptoid);
+	values[JSONBD_DICTIONARY_REL_ATT_ID - 1] = Int32GetDatum(id);
+	values[JSONBD_DICTIONARY_REL_ATT_KEY - 1] = CStringGetTextDatum(key);
+	values[JSONBD_DICTIONARY_REL_ATT_KEYHASH - 1] = jsonbd_key_hash(key, strlen(key));
+
+	tup = heap_form_tuple(RelationGetDescr(rel), values, nulls);
+	insert_dictionary_tuple(rel, tup);
+	heap_freetuple(tup);
+
+	relation_close(rel, RowExclusiveLock);
+	CommandCounterIncrement();
+
+	return id;
+}
+
+/*
+ * Get key IDs using relation. Keys are not null-terminated, their lengths
+ * are in 'lens', keys follow each other in 'buf'.
+ */
+static void
+jsonbd_get_key_ids(Oid cmoptoid, uint32 *lens, char *buf, uint32 *idsbuf,
+				   int nkeys)
+{
+	int			i;
+	jsonbd_cached_cmopt		*cmcache;
+
 	cmcache = get_cached_compression_options(cmoptoid);
 
 	for (i = 0; i < nkeys; i++)
 	{
-		uint32		hkey;
+		uint32		hkey,
+					keylen = lens[i];
+		char	   *key;
 		bool		found;
 		MemoryContext	oldcontext;
 		jsonbd_cached_key		*ckey;
 		jsonbd_pair				*pair;
 
-		hkey = qhashmurmur3_32(buf, strlen(buf));
+		hkey = qhashmurmur3_32(buf, keylen);
 
 		Assert(cmcache->key_cache);
 		ckey = hash_search(cmcache->key_cache, &hkey, HASH_ENTER, &found);
@@ -383,7 +1022,8 @@ jsonbd_get_key_ids(Oid cmoptoid, char *buf, uint32 *idsbuf, int nkeys)
 			foreach(lc, ckey->pairs)
 			{
 				jsonbd_pair	*pair = lfirst(lc);
-				if (strcmp(pair->key, buf) == 0)
+				if (pair->id > 0 && strncmp(pair->key, buf, keylen) == 0 &&
+						pair->key[keylen] == '\0')
 				{
 					idsbuf[i] = pair->id;
 					goto next;
@@ -395,139 +1035,476 @@ jsonbd_get_key_ids(Oid cmoptoid, char *buf, uint32 *idsbuf, int nkeys)
 		/* create new pair and save it in cache, id will be set after scan */
 		oldcontext = MemoryContextSwitchTo(worker_cache_context);
 		pair = (jsonbd_pair *) palloc(sizeof(jsonbd_pair));
-		pair->key = pstrdup(buf);
+		pair->key = key = pnstrdup(buf, keylen);
 		ckey->pairs = lappend(ckey->pairs, pair);
 		MemoryContextSwitchTo(oldcontext);
 
-		/* lazy transaction creation */
-		if (!rel)
+		/* lazy transaction creation */
+		start_read_command();
+
+		idsbuf[i] = jsonbd_find_key_id(cmcache, key);
+
+		if (idsbuf[i] == 0 && cmcache->parent_cache)
+			idsbuf[i] = jsonbd_get_inherited_key_id(cmcache, hkey, key);
+
+		if (idsbuf[i] == 0)
+		{
+			Relation		indrel;
+			jsonbd_segment *segment;
+
+			/* writes need a snapshot and a commit */
+			start_xact_command();
+			segment = get_dictionary_segment(cmcache, true);
+			indrel = index_open(segment->keys_indoid, ExclusiveLock);
+
+			/* recheck, key could be added while we wait for lock */
+			idsbuf[i] = jsonbd_find_key_id(cmcache, key);
+
+			/* still need to add */
+			if (idsbuf[i] == 0)
+				idsbuf[i] = jsonbd_insert_key(segment, cmcache, key);
+
+			index_close(indrel, ExclusiveLock);
+		}
+
+		/* set correct id in cache */
+		pair->id = idsbuf[i];
+next:
+		Assert(idsbuf[i] > 0);
+
+		/* move to next key */
+		buf += keylen;
+	}
+
+	finish_xact_command();
+}
+
+static char *
+jsonbd_cmd_get_ids(int nkeys, Oid cmoptoid, char *buf, size_t *buflen)
+{
+	uint32		   *idsbuf;
+	MemoryContext	mcxt = CurrentMemoryContext;
+
+	*buflen = nkeys * sizeof(uint32);
+	idsbuf = (uint32 *) palloc(Max(*buflen, sizeof(uint32)));
+
+	PG_TRY();
+	{
+		/* lengths of keys go first, then keys themselves */
+		jsonbd_get_key_ids(cmoptoid, (uint32 *) buf,
+						   buf + sizeof(uint32) * nkeys, idsbuf, nkeys);
+	}
+	PG_CATCH();
+	{
+		ErrorData  *error;
+		MemoryContextSwitchTo(mcxt);
+		error = CopyErrorData();
+		elog(LOG, "jsonbd: cannot get ids: %s", error->message);
+		FlushErrorState();
+		pfree(error);
+
+		abort_xact_command();
+		idsbuf[0] = 0;
+		*buflen = 1;
+	}
+	PG_END_TRY();
+
+	return (char *) idsbuf;
+}
+
+static char **
+jsonbd_cmd_get_keys(int nkeys, Oid cmoptoid, uint32 *ids)
+{
+	char		  **keys = NULL;
+	MemoryContext	mcxt = CurrentMemoryContext;;
+
+	PG_TRY();
+	{
+		keys = jsonbd_get_keys(cmoptoid, ids, nkeys);
+	}
+	PG_CATCH();
+	{
+		ErrorData  *error;
+		MemoryContextSwitchTo(mcxt);
+		error = CopyErrorData();
+		elog(LOG, "jsonbd: error occured: %s", error->message);
+		FlushErrorState();
+		pfree(error);
+
+		abort_xact_command();
+		keys = NULL;
+	}
+	PG_END_TRY();
+
+	return keys;
+}
+
+/*
+ * Find the named dictionary. With 'attach' it's created if it doesn't exist
+ * yet and the options are attached to it.
+ * Returns dictid of the dictionary.
+ */
+static Oid
+jsonbd_get_named_dictionary(Oid cmoptoid, char *name, bool attach)
+{
+	Oid		dictid = InvalidOid;
+	Oid		argtypes[1] = {TEXTOID};
+	Datum	values[1] = {CStringGetTextDatum(name)};
+	char   *sql;
+	bool	isnull;
+
+	start_xact_command();
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "jsonbd: could not connect to SPI");
+
+	sql = psprintf(sql_get_named, jsonbd_get_dictionaries_name());
+	if (SPI_execute_with_args(sql, 1, argtypes, values, NULL, false, 1) != SPI_OK_SELECT)
+		elog(ERROR, "jsonbd: could not get named dictionary");
+
+	if (SPI_processed == 0 && attach && !RecoveryInProgress())
+	{
+		/* the first attached options give their acoid to the dictionary */
+		char *sql2 = psprintf(sql_create_named, jsonbd_get_dictionaries_name(),
+							  cmoptoid);
+
+		if (SPI_execute_with_args(sql2, 1, argtypes, values, NULL, false, 0) != SPI_OK_INSERT)
+			elog(ERROR, "jsonbd: could not create named dictionary");
+
+		/* someone could create the dictionary concurrently, so select again */
+		if (SPI_execute_with_args(sql, 1, argtypes, values, NULL, false, 1) != SPI_OK_SELECT)
+			elog(ERROR, "jsonbd: could not get named dictionary");
+	}
+
+	if (SPI_processed > 0)
+		dictid = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[0],
+									SPI_tuptable->tupdesc, 1, &isnull));
+	else
+		elog(ERROR, "jsonbd: dictionary \"%s\" does not exist", name);
+
+	if (attach && !RecoveryInProgress())
+	{
+		char *sql3 = psprintf(sql_attach_named, jsonbd_get_attachments_name(),
+							  cmoptoid, dictid);
+
+		if (SPI_exec(sql3, 0) != SPI_OK_INSERT)
+			elog(ERROR, "jsonbd: could not attach to named dictionary");
+	}
+
+	SPI_finish();
+	finish_xact_command();
+
+	return dictid;
+}
+
+/*
+ * Register compression options. If the options inherit a dictionary, save
+ * the maximum id of the parent dictionary, keys with ids up to it will be
+ * shared. If the options use a named dictionary, return its id.
+ * Without 'attach' nothing is registered, only the dictionary is found.
+ */
+static char *
+jsonbd_cmd_attach(Oid cmoptoid, Oid parent, char *name, bool attach,
+				  size_t *buflen)
+{
+	Oid			   *res = (Oid *) palloc(sizeof(Oid));
+	MemoryContext	mcxt = CurrentMemoryContext;
+
+	*res = cmoptoid;
+	*buflen = sizeof(Oid);
+
+	PG_TRY();
+	{
+		jsonbd_cached_cmopt	*cmdata;
+
+		if (name[0] != '\0')
+			*res = jsonbd_get_named_dictionary(cmoptoid, name, attach);
+
+		cmdata = get_cached_compression_options(*res);
+		if (attach && OidIsValid(parent) && !OidIsValid(cmdata->parent) &&
+				!RecoveryInProgress())
 		{
+			jsonbd_cached_cmopt	*parent_cache;
+			char	   *dictname;
+			char	   *sql;
+
 			start_xact_command();
-			rel = relation_open(relid, AccessShareLock);
-			indrel = index_open(jsonbd_keys_indoid, AccessShareLock);
-		}
+			parent_cache = get_cached_compression_options(parent);
+			dictname = jsonbd_get_dictionary_name(jsonbd_get_dictionary_relid());
+			sql = psprintf(sql_attach, jsonbd_get_dictionaries_name(),
+						   cmoptoid, parent, parent_cache->parent_maxid,
+						   dictname, parent);
 
-		idsbuf[i] = jsonbd_get_key_id(rel, indrel, cmoptoid, buf);
+			if (SPI_connect() != SPI_OK_CONNECT)
+				elog(ERROR, "jsonbd: could not connect to SPI");
 
-		if (idsbuf[i] == 0)
-		{
-			Relation	indrel2;
+			if (SPI_exec(sql, 0) != SPI_OK_INSERT)
+				elog(ERROR, "jsonbd: could not inherit dictionary");
 
-			indrel2 = index_open(jsonbd_keys_indoid, ExclusiveLock);
+			SPI_finish();
 
-			/* recheck, key could be added while we wait for lock */
-			idsbuf[i] = jsonbd_get_key_id(rel, indrel2, cmoptoid, buf);
+			/* other worker could attach the options before us, reload */
+			load_dictionary_parent(cmdata);
+			finish_xact_command();
+		}
+	}
+	PG_CATCH();
+	{
+		ErrorData  *error;
+		MemoryContextSwitchTo(mcxt);
+		error = CopyErrorData();
+		elog(LOG, "jsonbd: error occured: %s", error->message);
+		FlushErrorState();
+		pfree(error);
 
-			if (idsbuf[i] == 0)
-			{
-				/* still need to add */
-				Datum	datum;
-				bool	isnull;
-				char   *sql2 = psprintf(sql_insert, relname, cmoptoid,
-										relname, cmoptoid, buf);
-
-				/* TODO: maybe use bulk inserts instead of SPI */
-				if (!spi_on)
-				{
-					/* lazy SPI initialization */
-					if (SPI_connect() != SPI_OK_CONNECT)
-					{
-						failed = true;
-						goto finish;
-					}
+		abort_xact_command();
+		*buflen = 1;
+	}
+	PG_END_TRY();
 
-					spi_on = true;
-				}
+	return (char *) res;
+}
 
-				if (SPI_exec(sql2, 0) != SPI_OK_INSERT_RETURNING)
-				{
-					failed = true;
-					goto finish;
-				}
+/*
+ * Save the subdocument, 'data' contains its hash followed by the document.
+ * The insert is committed before the answer.
+ */
+static char *
+jsonbd_cmd_put_subdoc(char *data, size_t *buflen)
+{
+	int32		   *res = (int32 *) palloc(sizeof(int32));
+	MemoryContext	mcxt = CurrentMemoryContext;
 
-				pfree(sql2);
+	*buflen = sizeof(int32);
 
-				datum = SPI_getbinval(SPI_tuptable->vals[0],
-									  SPI_tuptable->tupdesc,
-									  1,
-									  &isnull);
-				Assert(!isnull);
-				idsbuf[i] = DatumGetInt32(datum);
-			}
-			index_close(indrel2, ExclusiveLock);
-		}
+	PG_TRY();
+	{
+		Oid			argtypes[2] = {BYTEAOID, JSONBOID};
+		Datum		values[2];
+		bytea	   *hash = (bytea *) palloc(VARHDRSZ + JSONBD_SUBDOC_HASH_LEN);
+		Jsonb	   *doc = (Jsonb *) (data + JSONBD_SUBDOC_HASH_LEN);
+		char	   *sql;
+
+		SET_VARSIZE(hash, VARHDRSZ + JSONBD_SUBDOC_HASH_LEN);
+		memcpy(VARDATA(hash), data, JSONBD_SUBDOC_HASH_LEN);
+		values[0] = PointerGetDatum(hash);
+		values[1] = PointerGetDatum(doc);
+		*res = VARSIZE(doc);
 
-		/* set correct id in cache */
-		pair->id = idsbuf[i];
-next:
-		Assert(idsbuf[i] > 0);
+		start_xact_command();
+		if (SPI_connect() != SPI_OK_CONNECT)
+			elog(ERROR, "jsonbd: could not connect to SPI");
 
-		/* move to next key */
-		while (*buf++ != '\0');
-	}
+		sql = psprintf(sql_put_subdoc, jsonbd_get_subdocs_name());
+		if (SPI_execute_with_args(sql, 2, argtypes, values, NULL, false, 0) != SPI_OK_INSERT)
+			elog(ERROR, "jsonbd: could not save subdocument");
 
-finish:
-	if (spi_on)
 		SPI_finish();
-
-	if (rel)
-	{
-		index_close(indrel, AccessShareLock);
-		relation_close(rel, AccessShareLock);
+		finish_xact_command();
 	}
+	PG_CATCH();
+	{
+		ErrorData  *error;
+		MemoryContextSwitchTo(mcxt);
+		error = CopyErrorData();
+		elog(LOG, "jsonbd: cannot save subdocument: %s", error->message);
+		FlushErrorState();
+		pfree(error);
 
-	if (failed && xact_started)
-		AbortCurrentTransaction();
-	else if (!failed)
-		finish_xact_command();
+		abort_xact_command();
+		*buflen = 1;
+	}
+	PG_END_TRY();
 
-	return !failed;
+	return (char *) res;
 }
 
+/* Returns the subdocument by its hash or NULL */
 static char *
-jsonbd_cmd_get_ids(int nkeys, Oid cmoptoid, char *buf, size_t *buflen)
+jsonbd_cmd_get_subdoc(char *data, size_t *buflen)
 {
-	bool			ok;
-	uint32		   *idsbuf;
-	MemoryContext	old_mcxt = CurrentMemoryContext;;
+	Jsonb		   *res = NULL;
+	MemoryContext	mcxt = CurrentMemoryContext;
 
-	*buflen = nkeys * sizeof(uint32);
-	idsbuf = (uint32 *) palloc(*buflen);
-	ok = jsonbd_get_key_ids(cmoptoid, buf, idsbuf, nkeys);
-	if (!ok)
+	PG_TRY();
 	{
-		elog(LOG, "jsonbd: cannot get ids");
+		Oid			argtypes[1] = {BYTEAOID};
+		Datum		values[1];
+		bytea	   *hash = (bytea *) palloc(VARHDRSZ + JSONBD_SUBDOC_HASH_LEN);
+		char	   *sql;
+		bool		isnull;
 
-		idsbuf[0] = 0;
-		*buflen = 1;
+		SET_VARSIZE(hash, VARHDRSZ + JSONBD_SUBDOC_HASH_LEN);
+		memcpy(VARDATA(hash), data, JSONBD_SUBDOC_HASH_LEN);
+		values[0] = PointerGetDatum(hash);
+
+		start_xact_command();
+		if (SPI_connect() != SPI_OK_CONNECT)
+			elog(ERROR, "jsonbd: could not connect to SPI");
+
+		sql = psprintf(sql_get_subdoc, jsonbd_get_subdocs_name());
+		if (SPI_execute_with_args(sql, 1, argtypes, values, NULL, true, 1) != SPI_OK_SELECT)
+			elog(ERROR, "jsonbd: could not get subdocument");
+
+		if (SPI_processed == 0)
+			elog(ERROR, "jsonbd: subdocument is not found");
+
+		/* copy before SPI memory is released */
+		MemoryContextSwitchTo(worker_context);
+		res = DatumGetJsonbPCopy(SPI_getbinval(SPI_tuptable->vals[0],
+											   SPI_tuptable->tupdesc, 1, &isnull));
+		SPI_finish();
+		finish_xact_command();
+		*buflen = VARSIZE(res);
+	}
+	PG_CATCH();
+	{
+		ErrorData  *error;
+		MemoryContextSwitchTo(mcxt);
+		error = CopyErrorData();
+		elog(LOG, "jsonbd: cannot get subdocument: %s", error->message);
+		FlushErrorState();
+		pfree(error);
+
+		abort_xact_command();
+		res = NULL;
 	}
+	PG_END_TRY();
 
-	MemoryContextSwitchTo(old_mcxt);
-	return (char *) idsbuf;
+	MemoryContextSwitchTo(mcxt);
+	return (char *) res;
 }
 
-static char **
-jsonbd_cmd_get_keys(int nkeys, Oid cmoptoid, uint32 *ids)
+/*
+ * Get templates of compression options. The result is the count of
+ * templates followed by the templates, each is its id and the document
+ * aligned to int.
+ */
+static char *
+jsonbd_cmd_get_templates(Oid acoid, size_t *buflen)
 {
-	char		  **keys = NULL;
-	MemoryContext	mcxt = CurrentMemoryContext;;
+	char		   *res = NULL;
+	MemoryContext	mcxt = CurrentMemoryContext;
 
 	PG_TRY();
 	{
-		keys = jsonbd_get_keys(cmoptoid, ids, nkeys);
+		char	   *sql,
+				   *ptr;
+		Size		len = sizeof(int32);
+		uint64		i;
+
+		start_xact_command();
+		if (SPI_connect() != SPI_OK_CONNECT)
+			elog(ERROR, "jsonbd: could not connect to SPI");
+
+		sql = psprintf(sql_get_templates, jsonbd_get_templates_name(), acoid);
+		if (SPI_exec(sql, 0) != SPI_OK_SELECT)
+			elog(ERROR, "jsonbd: could not get templates");
+
+		for (i = 0; i < SPI_processed; i++)
+		{
+			bool	isnull;
+			Datum	doc = SPI_getbinval(SPI_tuptable->vals[i],
+										SPI_tuptable->tupdesc, 2, &isnull);
+
+			len += sizeof(int32) + INTALIGN(VARSIZE_ANY(DatumGetPointer(doc)));
+		}
+
+		/* copy before SPI memory is released */
+		res = MemoryContextAllocZero(worker_context, len);
+		*((int32 *) res) = (int32) SPI_processed;
+		ptr = res + sizeof(int32);
+
+		for (i = 0; i < SPI_processed; i++)
+		{
+			bool	isnull;
+			int32	id = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[i],
+											SPI_tuptable->tupdesc, 1, &isnull));
+			Jsonb  *doc = DatumGetJsonbP(SPI_getbinval(SPI_tuptable->vals[i],
+											SPI_tuptable->tupdesc, 2, &isnull));
+
+			*((int32 *) ptr) = id;
+			memcpy(ptr + sizeof(int32), doc, VARSIZE(doc));
+			ptr += sizeof(int32) + INTALIGN(VARSIZE(doc));
+		}
+
+		SPI_finish();
+		finish_xact_command();
+		*buflen = len;
 	}
 	PG_CATCH();
 	{
 		ErrorData  *error;
 		MemoryContextSwitchTo(mcxt);
 		error = CopyErrorData();
-		elog(LOG, "jsonbd: error occured: %s", error->message);
+		elog(LOG, "jsonbd: cannot get templates: %s", error->message);
 		FlushErrorState();
 		pfree(error);
+
+		abort_xact_command();
+		res = NULL;
 	}
 	PG_END_TRY();
 
-	return keys;
+	MemoryContextSwitchTo(mcxt);
+	return res;
+}
+
+/*
+ * Send the response prefixed by its kind. Responses larger than the queue
+ * are copied to the worker's DSM segment, which is kept until the next
+ * large response. The backend reads it while it holds the worker lock,
+ * so the segment is not changed meanwhile.
+ */
+static shm_mq_result
+jsonbd_send_response(shm_mq_handle *mqh, shm_mq_iovec *iov, int iovlen)
+{
+	int				i;
+	Size			len = 0;
+	char			kind = JSONBD_MSG_INLINE;
+	shm_mq_iovec   *full;
+
+	if (iov == NULL)
+	{
+		kind = JSONBD_MSG_FAILURE;
+		return shm_mq_send(mqh, 1, &kind, false);
+	}
+
+	for (i = 0; i < iovlen; i++)
+		len += iov[i].len;
+
+	if (len > JSONBD_INLINE_MESSAGE_MAX)
+	{
+		jsonbd_large_message	msg;
+		char				   *ptr;
+
+		if (response_seg == NULL || dsm_segment_map_length(response_seg) < len)
+		{
+			if (response_seg)
+				dsm_detach(response_seg);
+
+			response_seg = dsm_create(Max(len, 2 * JSONBD_INLINE_MESSAGE_MAX), 0);
+			dsm_pin_mapping(response_seg);
+		}
+
+		ptr = dsm_segment_address(response_seg);
+		for (i = 0; i < iovlen; i++)
+		{
+			memcpy(ptr, iov[i].data, iov[i].len);
+			ptr += iov[i].len;
+		}
+
+		msg.kind = JSONBD_MSG_LARGE;
+		msg.handle = dsm_segment_handle(response_seg);
+		msg.len = len;
+		return shm_mq_send(mqh, sizeof(msg), &msg, false);
+	}
+
+	full = (shm_mq_iovec *) palloc(sizeof(shm_mq_iovec) * (iovlen + 1));
+	full[0].data = &kind;
+	full[0].len = 1;
+	memcpy(&full[1], iov, sizeof(shm_mq_iovec) * iovlen);
+
+	return shm_mq_sendv(mqh, full, iovlen + 1, false);
 }
 
 void
@@ -693,13 +1670,21 @@ jsonbd_worker_main(Datum arg)
 		if (shutdown_requested)
 			break;
 
-		/* Wait to be signalled. */
-		rc = WaitLatch(&worker_state->latch, WL_LATCH_SET | WL_POSTMASTER_DEATH,
-					   0, PG_WAIT_EXTENSION);
+		/*
+		 * Wait to be signalled. If the read transaction is open, wait
+		 * for a while and close it if there are no more requests.
+		 */
+		rc = WaitLatch(&worker_state->latch,
+					   WL_LATCH_SET | WL_POSTMASTER_DEATH |
+					   (read_xact_started ? WL_TIMEOUT : 0),
+					   JSONBD_READ_XACT_IDLE_TIMEOUT, PG_WAIT_EXTENSION);
 
 		if (rc & WL_POSTMASTER_DEATH)
 			break;
 
+		if (rc & WL_TIMEOUT)
+			finish_read_command();
+
 		/* Reset the latch so we don't spin. */
 		ResetLatch(&worker_state->latch);
 
@@ -731,7 +1716,8 @@ jsonbd_worker_main(Datum arg)
 			shm_mq_iovec   *iov = NULL;
 			char		   *ptr = data;
 			int				nkeys = *((int *) ptr);
-			size_t			iovlen;
+			size_t			iovlen = 0;
+			dsm_segment	   *request_seg = NULL;
 
 			ptr += sizeof(int);
 			cmoptoid = *((Oid *) ptr);
@@ -739,6 +1725,27 @@ jsonbd_worker_main(Datum arg)
 			cmd = *((JsonbcCommand *) ptr);
 			ptr += sizeof(JsonbcCommand);
 
+			/* large request, read the real one from the backend's segment */
+			if (cmd == JSONBD_CMD_LARGE)
+			{
+				jsonbd_large_message *msg = (jsonbd_large_message *) ptr;
+
+				request_seg = dsm_attach(msg->handle);
+				if (request_seg != NULL)
+				{
+					/* we detach it ourselves, even if transaction aborts */
+					dsm_pin_mapping(request_seg);
+
+					ptr = dsm_segment_address(request_seg);
+					nkeys = *((int *) ptr);
+					ptr += sizeof(int) + sizeof(Oid);
+					cmd = *((JsonbcCommand *) ptr);
+					ptr += sizeof(JsonbcCommand);
+				}
+				else
+					elog(LOG, "jsonbd: could not attach to request segment");
+			}
+
 			switch (cmd)
 			{
 				case JSONBD_CMD_GET_IDS:
@@ -746,6 +1753,50 @@ jsonbd_worker_main(Datum arg)
 					iovlen = 1;
 					iov->data = jsonbd_cmd_get_ids(nkeys, cmoptoid, ptr, &iov->len);
 					break;
+				case JSONBD_CMD_ATTACH:
+				case JSONBD_CMD_RESOLVE:
+					iov = (shm_mq_iovec *) palloc(sizeof(shm_mq_iovec));
+					iovlen = 1;
+					iov->data = jsonbd_cmd_attach(cmoptoid, *((Oid *) ptr),
+												  ptr + sizeof(Oid),
+												  cmd == JSONBD_CMD_ATTACH,
+												  &iov->len);
+					break;
+				case JSONBD_CMD_PUT_SUBDOC:
+					iov = (shm_mq_iovec *) palloc(sizeof(shm_mq_iovec));
+					iovlen = 1;
+					iov->data = jsonbd_cmd_put_subdoc(ptr, &iov->len);
+					break;
+				case JSONBD_CMD_GET_SUBDOC:
+				{
+					size_t	len;
+					char   *doc = jsonbd_cmd_get_subdoc(ptr, &len);
+
+					if (doc != NULL)
+					{
+						iov = (shm_mq_iovec *) palloc(sizeof(shm_mq_iovec));
+						iovlen = 1;
+						iov->data = doc;
+						iov->len = len;
+					}
+
+					break;
+				}
+				case JSONBD_CMD_GET_TEMPLATES:
+				{
+					size_t	len;
+					char   *buf = jsonbd_cmd_get_templates(cmoptoid, &len);
+
+					if (buf != NULL)
+					{
+						iov = (shm_mq_iovec *) palloc(sizeof(shm_mq_iovec));
+						iovlen = 1;
+						iov->data = buf;
+						iov->len = len;
+					}
+
+					break;
+				}
 				case JSONBD_CMD_GET_KEYS:
 				{
 					char **keys = jsonbd_cmd_get_keys(nkeys, cmoptoid, (uint32 *) ptr);
@@ -764,6 +1815,9 @@ jsonbd_worker_main(Datum arg)
 
 					break;
 				}
+				case JSONBD_CMD_LARGE:
+					/* could not attach */
+					break;
 				default:
 					elog(NOTICE, "jsonbd: got unknown command");
 			}
@@ -771,20 +1825,37 @@ jsonbd_worker_main(Datum arg)
 			shm_mq_detach(mqh);
 			mqh = shm_mq_attach(worker_state->mqout, NULL, NULL);
 
-			if (iov != NULL)
-				resmq = shm_mq_sendv(mqh, iov, iovlen, false);
-			else
-				resmq = shm_mq_sendv(mqh, &((shm_mq_iovec) {"\0", 1}), 1, false);
+			resmq = jsonbd_send_response(mqh, iov, iovlen);
+			if (request_seg)
+				dsm_detach(request_seg);
 
 			if (resmq != SHM_MQ_SUCCESS)
 				elog(NOTICE, "jsonbd: backend detached early");
 
 			shm_mq_detach(mqh);
+
+			/* cache loading could leave the transaction open */
+			finish_xact_command();
+
+			/*
+			 * The read transaction is kept, but it should not hold back
+			 * xmin by the catalog snapshot, and it's restarted from time
+			 * to time to release accumulated resources.
+			 */
+			if (read_xact_started)
+			{
+				InvalidateCatalogSnapshot();
+				if (++read_xact_requests >= JSONBD_READ_XACT_MAX_REQUESTS)
+					finish_read_command();
+			}
+
 			MemoryContextReset(worker_context);
 			pg_atomic_clear_flag(&worker_state->busy);
 		}
 	}
 
+	finish_read_command();
+
 finish:
 	elog(LOG, "jsonbd dictionary worker has ended its work");
 	proc_exit(0);
@@ -883,58 +1954,137 @@ jsonbd_get_dictionary_relid(void)
 	if (relid == InvalidOid)
 		elog(ERROR, "jsonbd dictionary relation does not exist");
 
-	/* fill index Oids too */
-	if (jsonbd_id_indoid == InvalidOid)
-	{
-		Relation	 rel;
-		ListCell	*lc;
-		List		*indexes;
+	/* find the default segment and its indexes */
+	default_segment.relid = get_relname_relid(JSONBD_DEFAULT_SEGMENT_REL,
+											  get_jsonbd_schema());
+	if (!OidIsValid(default_segment.relid))
+		elog(ERROR, "jsonbd default dictionary segment does not exist");
 
-		Assert(relid != InvalidOid);
+	fill_segment_indexes(&default_segment);
+	finish_xact_command();
 
-		rel = relation_open(relid, NoLock);
-		indexes = RelationGetIndexList(rel);
-		Assert(list_length(indexes) == 2);
+	jsonbd_dictionary_reloid = relid;
+	return relid;
+}
 
-		foreach(lc, indexes)
-		{
-			Oid			indOid = lfirst_oid(lc);
-			Relation	indRel = index_open(indOid, NoLock);
-			int			attnum = indRel->rd_index->indkey.values[1];
+/*
+ * Shared state of dropped dictionaries is forgotten when the drop commits,
+ * before that the dictionary could still be used. Drops rolled back by
+ * a subtransaction are forgotten too, the state is only a cache.
+ */
+static void
+drop_xact_callback(XactEvent event, void *arg)
+{
+	ListCell   *lc;
 
-			if (attnum == JSONBD_DICTIONARY_REL_ATT_ID)
-				jsonbd_id_indoid = indOid;
-			else
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PREPARE:
+			foreach(lc, dropped_dictionaries)
 			{
-				Assert(attnum == JSONBD_DICTIONARY_REL_ATT_KEY);
-				jsonbd_keys_indoid = indOid;
+				Oid		acoid = lfirst_oid(lc);
+
+				jsonbd_shared_cache_purge(acoid);
+				jsonbd_frozen_remove(acoid);
+				jsonbd_release_ids(acoid);
 			}
+			/* FALLTHROUGH */
+		case XACT_EVENT_ABORT:
+			list_free(dropped_dictionaries);
+			dropped_dictionaries = NIL;
+			break;
+		default:
+			break;
+	}
+}
 
-			index_close(indRel, NoLock);
-		}
-		relation_close(rel, NoLock);
+/*
+ * Called from backends when compression options are dropped. The dictionary
+ * is removed with its segment if no other options use it, otherwise only
+ * the attachment of the options is removed.
+ */
+void
+jsonbd_drop_dictionary(Oid acoid)
+{
+	char   *sql;
+	char   *relname;
+	char   *segname;
+	bool	used;
+
+	if (!OidIsValid(jsonbd_get_dictionary_relid()))
+		return;
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "jsonbd: could not connect to SPI");
+
+	sql = psprintf(sql_detach, jsonbd_get_attachments_name(), acoid);
+	if (SPI_exec(sql, 0) != SPI_OK_DELETE)
+		elog(ERROR, "jsonbd: could not detach dictionary");
+
+	sql = psprintf(sql_drop_templates, jsonbd_get_templates_name(), acoid);
+	if (SPI_exec(sql, 0) != SPI_OK_DELETE)
+		elog(ERROR, "jsonbd: could not remove templates");
+
+	sql = psprintf(sql_dictionary_used,
+				   jsonbd_get_dictionaries_name(), acoid,
+				   jsonbd_get_attachments_name(), acoid, acoid);
+	if (SPI_exec(sql, 1) != SPI_OK_SELECT)
+		elog(ERROR, "jsonbd: could not check dictionary usage");
+
+	used = SPI_processed > 0;
+	if (!used)
+	{
+		relname = psprintf(JSONBD_SEGMENT_REL_FORMAT, acoid);
+		segname = jsonbd_get_qualified_name(relname);
+		sql = psprintf(sql_drop_segment, segname);
+		if (SPI_exec(sql, 0) != SPI_OK_UTILITY)
+			elog(ERROR, "jsonbd: could not drop dictionary segment");
+
+		pfree(segname);
+		segname = jsonbd_get_qualified_name(JSONBD_DEFAULT_SEGMENT_REL);
+		sql = psprintf(sql_forget_dictionary, jsonbd_get_dictionaries_name(),
+					   acoid, segname, acoid);
+		if (SPI_exec(sql, 0) != SPI_OK_DELETE)
+			elog(ERROR, "jsonbd: could not remove dictionary");
+
+		pfree(segname);
 	}
 
-	finish_xact_command();
+	SPI_finish();
 
-	/* check we did fill global variables */
-	Assert(OidIsValid(jsonbd_id_indoid));
-	Assert(OidIsValid(jsonbd_keys_indoid));
-	Assert(OidIsValid(relid));
+	if (!used)
+	{
+		MemoryContext	old_mcxt;
 
-	jsonbd_dictionary_reloid = relid;
-	return relid;
+		if (!drop_callback_registered)
+		{
+			RegisterXactCallback(drop_xact_callback, NULL);
+			drop_callback_registered = true;
+		}
+
+		old_mcxt = MemoryContextSwitchTo(TopMemoryContext);
+		dropped_dictionaries = lappend_oid(dropped_dictionaries, acoid);
+		MemoryContextSwitchTo(old_mcxt);
+	}
 }
 
 static char *
 jsonbd_get_dictionary_name(Oid relid)
 {
+	static char	   *result = NULL;
 	HeapTuple	tp;
 	Form_pg_class reltup;
 	char	   *relname;
 	char	   *nspname;
-	char	   *result;
 	MemoryContext	old_mcxt;
+	bool		own_xact = !IsTransactionState();
+
+	if (result != NULL)
+		return result;
+
+	if (own_xact)
+		start_xact_command();
 
 	tp = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
 	if (!HeapTupleIsValid(tp))
@@ -953,5 +2103,72 @@ jsonbd_get_dictionary_name(Oid relid)
 
 	ReleaseSysCache(tp);
 
+	if (own_xact)
+		finish_xact_command();
+
+	return result;
+}
+
+/* Returns qualified name of extension's relation, should be called in transaction */
+static char *
+jsonbd_get_qualified_name(const char *relname)
+{
+	char		   *nspname;
+	char		   *result;
+	MemoryContext	old_mcxt;
+
+	Assert(IsTransactionState());
+	nspname = get_namespace_name(get_jsonbd_schema());
+	if (!nspname)
+		elog(ERROR, "jsonbd: extension schema not found");
+
+	old_mcxt = MemoryContextSwitchTo(TopMemoryContext);
+	result = quote_qualified_identifier(nspname, relname);
+	MemoryContextSwitchTo(old_mcxt);
+
+	return result;
+}
+
+static char *
+jsonbd_get_dictionaries_name(void)
+{
+	static char	   *result = NULL;
+
+	if (result == NULL)
+		result = jsonbd_get_qualified_name(JSONBD_DICTIONARIES_REL);
+
+	return result;
+}
+
+static char *
+jsonbd_get_attachments_name(void)
+{
+	static char	   *result = NULL;
+
+	if (result == NULL)
+		result = jsonbd_get_qualified_name(JSONBD_ATTACHMENTS_REL);
+
+	return result;
+}
+
+static char *
+jsonbd_get_subdocs_name(void)
+{
+	static char	   *result = NULL;
+
+	if (result == NULL)
+		result = jsonbd_get_qualified_name(JSONBD_SUBDOCS_REL);
+
+	return result;
+}
+
+static char *
+jsonbd_get_templates_name(void)
+{
+	static char	   *result = NULL;
+
+	if (result == NULL)
+		result = jsonbd_get_qualified_name(JSONBD_TEMPLATES_REL);
+
 	return result;
 }
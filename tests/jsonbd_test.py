@@ -5,6 +5,10 @@ import random
 import json
 import os.path
 import subprocess
+import threading
+import time
+
+import contextlib
 
 from testgres import get_new_node
 
@@ -78,6 +82,19 @@ def generate_dict(keys):
 
 KEYS = ['pu4rj8cin2vthkzx3gm79q1ea6wlb5sdfy0', 'en4rl5h01mpwocydx9', 'hui0gen37qv1zf5kjw8lp2d6ramst4bx', 'macvjs35y1xneodi', 'r', 'gev6qfyb57dakwhx803umnczi4pj2lrst', 'pzkd5n4ufcaj', 'wubzi', 'h', 'ca6', 'krypftxe8ovbu3i2dh', '5y70', 'of2zcp8rgq0kmntu9yv314eb6ws7jahl', '2yu1iv645cwhepkmasnzfrl7gjq9x8td', 'ysoikbdwj8l7hrv4ag', 'q4s7xugt9bnzkw125vl60rcojayh38dimepf', 'ijbtvadn9x', '0aonrspwhbdvzg2lq8cuef', 'hf2ybkcvl8eaj9m503o4dtnrguxq6w', 'ayr0', 'r612my98ehwsui7bo30vk4c5djlxtazgn', 'ancd7fe8qh65s', 'ghptl062z5mwr7fqae', 'hgf1j7myqo0vrpbd93se4ztu6i28lnxwack5', 'ibx6cje7rlof0ukyh54apvs', 'w1xhvfu', 'nb8zf601tjmi29q5pyexw7gdlk', 'f6v4xjn9ylr2m', 'uoai017bfth4gxwjsep3y28kz', 'pg', 't', '5w61bms8cjoayr93ixtehg4p7uq0n2vf', 'u53k0nfswaoyjx19vdp8it', 'u4rlpft3qh6gjkacs1e28b5wimvx0yz', '0249or1fze', 'd4uey10zbhtf9jla5gqs', '8k0', '21sjt8ap7u5vxhkyeo0zf4ic9gqrw63d', 'pvih7546ea3cbgxuk', 'uarnfycxib74926jt1lgqhm0kw5esp83v', 'zrwmkgs06yv', 'v5igznkpjle8632cuyfdxq1a9mthwsbo704', '5y3ktwe6hxcl9rfdsn4z7uqjg', 'ly3f6centogzb82us9wp', 'o0gqlpn31sw845i9eukv', '1ho5uk97azcd', '8723gtsz6a9fcbo', 'nfxi8sl20r9kbdz6t35meqoapygucvhj4w17', 'dgutb4fj2ceqsyz750o', 'c65', 'do', 'sohb1gfea6cnxyd92qv78p4w0tkuzm5jlr3', 'iedsfb6mgl85zh32krtx1v94', 'igz27dvfwx45qh', '8qxwg3fcm6dba7rk50ntjohslze', '9mj5a1f8rxpb6s30kdlnw7guitcve', '2zlae93nxf480ykuojc1hw7qirmt6', '4abs05mnug7tpvjrlx3q18fc', '57w0g1tsbrun2hk4', 'z2yh7ojkx9p0', 'w', 'bgp3sefz5vrkot87uqh', 'a3h', '4zg9i3bmeqd52vpft0laruj7hksn', 'tkenuwzqy35hv2dbof4clm', 'fydqn290lwxrpus8ka', 'zmg7lx0df1qewt', 'k2cegpz0dq6r4uiwovhmj', 'tci91qj', 's1ug4t85wca0hnmlpfo', 'bca42i1pu7h3dolvkme9yn8fw05qrgx6', 'kw72sdb', 'jc5sa9zqhmb21v36tdpk0f48', 'w8fvk4751xqdyjp6eolcgsamn9z20rb3tu', '64b8mz9017nq3xyec', '5gju7r9ae30xzh8inp6b1', '02zcf94mojtyxk75bs8a', 'n18com3dzihj6upxkb0wgat2sverlqf59y74', 'qbofcwz15h9e24j6mul3rd', '0topwjfmd3z849kenu2vsxqac1yih5gl7rb6', 'i0319k', '40g83qtbdih69vr1ol', '4lpxsfj1q2eztguok3wa6cr9db', '2vl', '2rq1b90zojetxas6v47lkyn38dwgpc5hi', 'f9dcobjw6xy1', 'dhue8c3t0gi4vnz', '7bkxn9po46', 'gj0q4it6d2s7mkzf5xlo1ha9y8pucr3', 'rucdks4w01', 'uo6txm2gwf4k38ijav9150cdhbrlqzpnesy', '0d4gec8txisa2r5f3mwnjhl', 'p8cqeoi071bt4hyw6fzv', '10g3b', 'zhrolvm5c', '2iroh6pz3l5b8vkfens1caym9qg0x', 'sm5wftozqbkd4py132u', 'cvyfqruz', 'bcmq2nag6hu3j0otyk8iz9evp4fr7s5dw1', 'pnqc7xy06bfiv14zg'] 
 
+
+@contextlib.contextmanager
+def jsonbd_node(name, conf='', allow_streaming=False):
+    """ Started node with jsonbd preloaded and the extension created """
+    with get_new_node(name) as node:
+        node.init(allow_streaming=allow_streaming)
+        node.append_conf("postgresql.conf",
+                         "shared_preload_libraries='jsonbd'\n" + conf)
+        node.start()
+        node.psql('postgres', 'create extension jsonbd')
+        yield node
+
+
 class Tests(unittest.TestCase):
     def set_trace(self, con, command="pg_debug"):
         pid = con.execute("select pg_backend_pid()")[0][0]
@@ -107,6 +124,940 @@ class Tests(unittest.TestCase):
             data = node.psql('postgres', "select pg_size_pretty(pg_total_relation_size('t1'))")
             print("Relation size: ", data[1].decode('utf-8'))
 
+    def test_shared_cache_size(self):
+        # much more keys than the cache could take
+        with jsonbd_node('node14', 'jsonbd.shared_cache_size=8\n') as node:
+            node.safe_psql('postgres', 'create table t1(pk serial, a jsonb compression jsonbd);')
+
+            data = []
+            with node.connect('postgres') as con:
+                for i in range(100):
+                    d = generate_dict(KEYS)
+                    data.append(d)
+                    con.execute("insert into t1 (a) values ('%s');" % json.dumps(d))
+                con.commit()
+
+            # new backends take keys from the full cache or from workers
+            for i in range(3):
+                with node.connect('postgres') as con:
+                    res = con.execute('select pk, a from t1 order by pk')
+                    for pk, val in res:
+                        self.assertEqual(val, data[pk - 1])
+
+    def test_shared_dictionary(self):
+        with jsonbd_node('node2') as node:
+            for i in range(3):
+                node.psql('postgres', "create table p%d(pk serial, a jsonb "
+                          "compression jsonbd with (dictionary 'parts'));" % i)
+
+            data = generate_dict(KEYS)
+            with node.connect('postgres') as con:
+                for i in range(3):
+                    con.execute("insert into p%d (a) values ('%s');" % (i, json.dumps(data)))
+                con.commit()
+
+                for i in range(3):
+                    res = con.execute('select a from p%d' % i)
+                    self.assertEqual(res[0][0], data)
+
+                res = con.execute('select count(*) from jsonbd_attachments')
+                self.assertEqual(res[0][0], 3)
+
+                res = con.execute('select count(*) from jsonbd_dictionary')
+                self.assertEqual(res[0][0], len(data))
+
+    def test_inheritance(self):
+        with jsonbd_node('node16') as node:
+            node.safe_psql('postgres', 'create table t1(pk serial, a jsonb compression jsonbd);')
+
+            acoid_sql = ("select attcompression from pg_attribute"
+                         " where attrelid = 't1'::regclass and attname = 'a'")
+            data = [generate_dict(KEYS[:50]), generate_dict(KEYS)]
+            with node.connect('postgres') as con:
+                con.execute("insert into t1 (a) values ('%s');" % json.dumps(data[0]))
+                con.commit()
+                old = con.execute(acoid_sql)[0][0]
+
+            node.safe_psql('postgres', "alter table t1 alter column a set compression"
+                           " jsonbd with (inherit '%d');" % old)
+
+            with node.connect('postgres') as con:
+                new = con.execute(acoid_sql)[0][0]
+                self.assertNotEqual(old, new)
+
+                con.execute("insert into t1 (a) values ('%s');" % json.dumps(data[1]))
+                con.commit()
+
+                res = con.execute('select pk, a from t1 order by pk')
+                for pk, val in res:
+                    self.assertEqual(val, data[pk - 1])
+
+                res = con.execute('select parent from jsonbd_dictionaries'
+                                  ' where dictid = %d' % new)
+                self.assertEqual(res[0][0], old)
+
+                # inherited keys are not added to the new dictionary
+                keys = set(data[0].keys()) | set(data[1].keys())
+                res = con.execute('select count(*) from jsonbd_dictionary')
+                self.assertEqual(res[0][0], len(keys))
+
+    def test_dictionary_indexes(self):
+        with jsonbd_node('node17') as node:
+            node.safe_psql('postgres', 'create table t1(pk serial, a jsonb compression jsonbd);')
+
+            data = generate_dict(KEYS)
+            with node.connect('postgres') as con:
+                con.execute("insert into t1 (a) values ('%s');" % json.dumps(data))
+                con.commit()
+
+                expected = con.execute('select acoid, id, key, keyhash'
+                                       ' from jsonbd_dictionary order by id')
+                self.assertEqual(len(expected), len(data))
+
+                # keys inserted by workers are found through both indexes
+                con.execute('set enable_seqscan = off')
+                con.execute('set enable_bitmapscan = off')
+                for acoid, id, key, keyhash in expected:
+                    res = con.execute('select key from jsonbd_dictionary'
+                                      ' where acoid = %d and id = %d' % (acoid, id))
+                    self.assertEqual(res, [(key, )])
+
+                    res = con.execute('select id from jsonbd_dictionary'
+                                      ' where acoid = %d and keyhash = %d' % (acoid, keyhash))
+                    self.assertEqual(res, [(id, )])
+
+    def test_segments(self):
+        with jsonbd_node('node18') as node:
+            node.safe_psql('postgres', 'create table t1(pk serial, a jsonb compression jsonbd);'
+                           'create table t2(pk serial, a jsonb compression jsonbd);')
+
+            def acoid(con, rel):
+                return con.execute("select attcompression from pg_attribute where"
+                                   " attrelid = '%s'::regclass and attname = 'a'" % rel)[0][0]
+
+            def count(con, rel, acoid):
+                return con.execute('select count(*) from %s where acoid = %d'
+                                   % (rel, acoid))[0][0]
+
+            def segment_exists(con, acoid):
+                return con.execute("select count(*) from pg_class"
+                                   " where relname = 'jsonbd_dictionary_%d'" % acoid)[0][0] == 1
+
+            data = generate_dict(KEYS)
+            with node.connect('postgres') as con, node.connect('postgres') as locker:
+                # the dictionary gets its own partition on the first insert
+                con.execute("insert into t1 (a) values ('%s');" % json.dumps(data))
+                con.commit()
+                acoid1 = acoid(con, 't1')
+                self.assertTrue(segment_exists(con, acoid1))
+                self.assertEqual(count(con, 'jsonbd_dictionary_%d' % acoid1, acoid1), len(data))
+                self.assertEqual(count(con, 'jsonbd_dictionary_default', acoid1), 0)
+
+                # the dictionary table is in use, the default partition is taken
+                locker.execute('lock table jsonbd_dictionary in access share mode')
+                con.execute("insert into t2 (a) values ('%s');" % json.dumps(data))
+                con.commit()
+                locker.rollback()
+
+                # and the dictionary stays there
+                con.execute("insert into t2 (a) values ('%s');" % json.dumps({'new': 1}))
+                con.commit()
+                acoid2 = acoid(con, 't2')
+                self.assertFalse(segment_exists(con, acoid2))
+                self.assertEqual(count(con, 'jsonbd_dictionary_default', acoid2), len(data) + 1)
+
+                res = con.execute('select a from t2 order by pk')
+                self.assertEqual(res[0][0], data)
+
+                # a rolled back drop keeps the dictionary usable
+                con.execute('drop table t2')
+                con.rollback()
+                res = con.execute('select a from t2 order by pk')
+                self.assertEqual(res[0][0], data)
+
+                # dropped options take their dictionaries with them
+                con.execute('drop table t1')
+                con.execute('drop table t2')
+                con.commit()
+                self.assertFalse(segment_exists(con, acoid1))
+                self.assertEqual(count(con, 'jsonbd_dictionary', acoid1), 0)
+                self.assertEqual(count(con, 'jsonbd_dictionary', acoid2), 0)
+
+    def test_standby_reads(self):
+        with jsonbd_node('node20', allow_streaming=True) as node:
+            node.safe_psql('postgres', "create table t1(pk serial, a jsonb "
+                           "compression jsonbd with (dictionary 'shared'));")
+
+            data = generate_dict(KEYS)
+            with node.connect('postgres') as con:
+                con.execute("insert into t1 (a) values ('%s');" % json.dumps(data))
+                con.commit()
+
+            # reads of new backends only find the dictionary
+            with node.connect('postgres') as con:
+                con.execute('set transaction read only')
+                res = con.execute('select a from t1')
+                self.assertEqual(res[0][0], data)
+                con.commit()
+
+                res = con.execute('select count(*) from jsonbd_attachments')
+                self.assertEqual(res[0][0], 1)
+
+            with node.replicate('standby1') as standby:
+                standby.start()
+                standby.catchup()
+
+                with standby.connect('postgres') as con:
+                    res = con.execute('select a from t1')
+                    self.assertEqual(res[0][0], data)
+
+    def test_stream_format(self):
+        with jsonbd_node('node3') as node:
+            node.psql('postgres', "create table s(pk serial, a jsonb "
+                      "compression jsonbd with (format 'stream'));")
+
+            data = generate_dict(KEYS)
+            data['nested'] = generate_dict(KEYS[:10])
+            with node.connect('postgres') as con:
+                con.execute("insert into s (a) values ('%s');" % json.dumps(data))
+                con.commit()
+
+                res = con.execute('select a from s')
+                self.assertEqual(res[0][0], data)
+
+                res = con.execute("select a->'nested' from s")
+                self.assertEqual(res[0][0], data['nested'])
+
+    def test_export_import(self):
+        with jsonbd_node('node12') as node:
+            node.safe_psql('postgres', 'create table ex(pk serial, a jsonb compression jsonbd);'
+                           'create table im(pk serial, a jsonb compression jsonbd);')
+
+            data = [generate_dict(KEYS) for i in range(3)]
+            with node.connect('postgres') as con:
+                for d in data:
+                    con.execute("insert into ex (a) values ('%s');" % json.dumps(d))
+                con.commit()
+
+                acoids = []
+                for rel in ('ex', 'im'):
+                    acoids.append(con.execute("select attcompression from pg_attribute"
+                                              " where attrelid = '%s'::regclass"
+                                              " and attname = 'a'" % rel)[0][0])
+                src, dst = acoids
+
+                con.execute('select jsonbd_import_dictionary(%d, %d, array_agg(id), array_agg(key))'
+                            ' from jsonbd_export_dictionary(%d)' % (src, dst, src))
+                con.execute('insert into im (a) select jsonbd_import(jsonbd_export(a), %d)'
+                            ' from ex order by pk' % dst)
+                con.commit()
+
+                res = con.execute('select a from im order by pk')
+                for i, d in enumerate(data):
+                    self.assertEqual(res[i][0], d)
+
+            # the string of the array points past the end of the datum
+            with self.assertRaises(Exception):
+                node.safe_psql('postgres', "select jsonbd_import("
+                               "'\\x300000000100004064000000'::bytea, %d)" % dst)
+
+            # the target should be jsonbd compression options
+            with self.assertRaises(Exception):
+                node.safe_psql('postgres', "select jsonbd_import(jsonbd_export(a), 0)"
+                               " from ex")
+
+    def test_bulk_load(self):
+        with jsonbd_node('node13') as node:
+            node.safe_psql('postgres', 'create table t1(pk serial, a jsonb compression jsonbd);')
+
+            data = []
+            with node.connect('postgres') as bulk, node.connect('postgres') as con:
+                def insert(c, d):
+                    c.execute("insert into t1 (a) values ('%s');" % json.dumps(d))
+                    data.append(d)
+
+                insert(con, {'k0': 0})
+                con.commit()
+
+                # the dictionary is loaded before the worker adds new keys
+                bulk.execute('set jsonbd.bulk_load = on')
+                insert(bulk, {'k0': 1})
+                insert(con, {'k0': 2, 'w1': 3, 'w2': 4})
+                con.commit()
+                insert(bulk, {'k0': 5, 'b1': 6, 'b2': 7})
+                insert(con, {'w3': 8})
+                con.commit()
+                bulk.commit()
+                insert(con, {'b1': 9, 'w4': 10})
+                con.commit()
+
+                res = con.execute('select count(*), count(distinct id)'
+                                  ' from jsonbd_dictionary')
+                self.assertEqual(res[0][0], res[0][1])
+
+                res = con.execute('select a from t1')
+                self.assertEqual(sorted(json.dumps(r[0], sort_keys=True) for r in res),
+                                 sorted(json.dumps(d, sort_keys=True) for d in data))
+
+    def test_bulk_load_prepared(self):
+        conf = 'max_prepared_transactions = 2\n'
+        with jsonbd_node('node29', conf) as node:
+            node.safe_psql('postgres', 'create table t1(pk serial, a jsonb compression jsonbd);')
+            node.safe_psql('postgres', 'create role loader login; grant all on t1, t1_pk_seq to loader;')
+
+            data = []
+            with node.connect('postgres') as con:
+                con.execute('set jsonbd.bulk_load = on')
+                con.execute("insert into t1 (a) values ('{\"lost\": 1}')")
+                con.execute("prepare transaction 'p1'")
+                con.execute("rollback prepared 'p1'")
+
+                # the keys of the rolled back transaction are not used again
+                for d in ({'lost': 2, 'b': 3}, {'w': 4}):
+                    con.execute("insert into t1 (a) values ('%s')" % json.dumps(d))
+                    data.append(d)
+                con.commit()
+
+            node.safe_psql('postgres', 'vacuum')
+            node.restart()
+
+            # a role without privileges on the dictionary can load
+            node.safe_psql('postgres',
+                           "set jsonbd.bulk_load = on;"
+                           "insert into t1 (a) values ('{\"lost\": 5, \"r\": 6}')",
+                           username='loader')
+            data.append({'lost': 5, 'r': 6})
+
+            with node.connect('postgres') as con:
+                res = con.execute('select a from t1 order by pk')
+                self.assertEqual([r[0] for r in res], data)
+
+                res = con.execute("select count(*) from jsonbd_dictionary"
+                                  " where key = 'lost'")
+                self.assertEqual(res[0][0], 1)
+
+    def test_duplicate_keys(self):
+        with jsonbd_node('node15') as node:
+            node.safe_psql('postgres', 'create table t1(pk serial, a jsonb compression jsonbd);')
+
+            data = []
+            with node.connect('postgres') as bulk, node.connect('postgres') as con:
+                def insert(c, d):
+                    c.execute("insert into t1 (a) values ('%s');" % json.dumps(d))
+                    data.append(d)
+
+                # the key is added by a bulk load and a worker concurrently
+                bulk.execute('set jsonbd.bulk_load = on')
+                insert(bulk, {'dup': 1, 'b': 2})
+                insert(con, {'dup': 3, 'w': 4})
+                con.commit()
+                bulk.commit()
+
+                res = con.execute("select count(distinct id) from jsonbd_dictionary"
+                                  " where key = 'dup'")
+                self.assertEqual(res[0][0], 2)
+
+            # both ids resolve to the key, new documents take any of them
+            for bulk_load in ('off', 'on'):
+                with node.connect('postgres') as con:
+                    con.execute('set jsonbd.bulk_load = %s' % bulk_load)
+                    insert(con, {'dup': 5, 'b': 6, 'w': 7})
+                    con.commit()
+
+            with node.connect('postgres') as con:
+                res = con.execute('select pk, a from t1 order by pk')
+                for pk, val in res:
+                    self.assertEqual(val, data[pk - 1])
+
+    def test_bench(self):
+        with jsonbd_node('node19') as node:
+            node.safe_psql('postgres', 'create table t1(pk serial, a jsonb compression jsonbd);')
+
+            data = generate_dict(KEYS)
+            with node.connect('postgres') as con:
+                acoid = con.execute("select attcompression from pg_attribute where"
+                                    " attrelid = 't1'::regclass and attname = 'a'")[0][0]
+                res = con.execute("select stage, total_ms from jsonbd_bench("
+                                  "array['%s'::jsonb], 10, %d)" % (json.dumps(data), acoid))
+                stages = dict(res)
+                for stage in ('keys', 'encode', 'decode', 'build'):
+                    self.assertIn(stage, stages)
+                    self.assertGreaterEqual(stages[stage], 0)
+
+            with self.assertRaises(Exception):
+                node.safe_psql('postgres', "select * from jsonbd_bench("
+                               "array['{}'::jsonb], 1, 0)")
+
+            node.safe_psql('postgres', 'create role nobody login')
+            with self.assertRaises(Exception):
+                node.safe_psql('postgres', "select * from jsonbd_bench("
+                               "array['{}'::jsonb], 1, %d)" % acoid, username='nobody')
+
+    def test_client_decode(self):
+        client_dir = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'client')
+        subprocess.check_call(['make', '-s', '-C', client_dir, 'jsonbd_decode'])
+        decoder = os.path.join(client_dir, 'jsonbd_decode')
+
+        with jsonbd_node('node21') as node:
+            options = [
+                "",
+                "with (format 'stream')",
+                "with (elide_nulls 'on', paths 'on')",
+                "with (elide_nulls 'on', paths 'on', format 'stream')",
+            ]
+            for i, opts in enumerate(options):
+                node.safe_psql('postgres', 'create table c%d(pk serial, a jsonb '
+                               'compression jsonbd %s);' % (i, opts))
+
+            sparse = dict((k, None) for k in KEYS[:20])
+            sparse.update(generate_dict(KEYS[20:]))
+            data = [
+                generate_dict(KEYS),
+                {'nested': {'inner': generate_dict(KEYS[:10]), 'list': [1, {'x': None}]}},
+                sparse,
+                {'data': {'attributes': {'payload': {'value': 1}}}},
+                {'a': {'a': {'a': [{'b': {'c': None}}]}}, 'b': [sparse, None]},
+                {'single': 1},
+                {},
+                [1, 'text', None, {'k': [True, False]}],
+            ]
+
+            dict_path = os.path.join(node.base_dir, 'dictionary')
+            with node.connect('postgres') as con:
+                for i in range(len(options)):
+                    for d in data:
+                        con.execute("insert into c%d (a) values ('%s');" % (i, json.dumps(d)))
+                con.commit()
+
+                for i in range(len(options)):
+                    acoid = con.execute("select attcompression from pg_attribute where"
+                                        " attrelid = 'c%d'::regclass and attname = 'a'" % i)[0][0]
+                    keys = con.execute("select id, encode(convert_to(key, 'UTF8'), 'hex')"
+                                       " from jsonbd_export_dictionary(%d)" % acoid)
+                    with open(dict_path, 'w') as f:
+                        for id, key in keys:
+                            f.write('%d %s\n' % (id, key))
+
+                    datums = con.execute("select encode(jsonbd_export(a), 'hex')"
+                                         " from c%d order by pk" % i)
+                    out = subprocess.check_output([decoder, dict_path],
+                        input=''.join(d[0] + '\n' for d in datums).encode())
+
+                    lines = out.decode('utf-8').splitlines()
+                    self.assertEqual(len(lines), len(data))
+                    for line, d in zip(lines, data):
+                        self.assertEqual(json.loads(line), d, options[i])
+
+    def test_freeze(self):
+        with jsonbd_node('node4') as node:
+            node.psql('postgres', 'create table f(pk serial, a jsonb compression jsonbd);')
+
+            data = generate_dict(KEYS)
+            with node.connect('postgres') as con:
+                con.execute("insert into f (a) values ('%s');" % json.dumps(data))
+                con.commit()
+
+                acoid = con.execute('select distinct acoid from jsonbd_dictionary')[0][0]
+                res = con.execute('select jsonbd_freeze(%d)' % acoid)
+                self.assertEqual(res[0][0], len(data))
+
+                # frozen keys and keys of the overlay
+                data2 = dict(data)
+                data2['not_frozen_key'] = 1
+                con.execute("insert into f (a) values ('%s');" % json.dumps(data2))
+                con.commit()
+
+                res = con.execute('select a from f order by pk')
+                self.assertEqual(res[0][0], data)
+                self.assertEqual(res[1][0], data2)
+
+            # only privileged roles freeze, and only jsonbd options
+            with self.assertRaises(Exception):
+                node.safe_psql('postgres', 'select jsonbd_freeze(0)')
+
+            node.safe_psql('postgres', 'create role nobody login')
+            with self.assertRaises(Exception):
+                node.safe_psql('postgres', 'select jsonbd_freeze(%d)' % acoid,
+                               username='nobody')
+
+            # files of a dropped database are removed
+            node.safe_psql('postgres', 'create database db2')
+            node.safe_psql('db2', 'create extension jsonbd;'
+                           'create table f(a jsonb compression jsonbd);'
+                           "insert into f values ('{\"k\": 1}');")
+            dboid = node.execute('postgres', "select oid from pg_database"
+                                 " where datname = 'db2'")[0][0]
+            node.safe_psql('db2', 'select jsonbd_freeze(acoid)'
+                           ' from jsonbd_dictionary limit 1')
+
+            frozen_dir = os.path.join(node.data_dir, 'pg_jsonbd', str(dboid))
+            self.assertTrue(os.listdir(frozen_dir))
+            node.safe_psql('postgres', 'drop database db2')
+            self.assertFalse(os.path.exists(frozen_dir))
+
+    def test_freeze_restart(self):
+        with jsonbd_node('node10') as node:
+            node.psql('postgres', 'create table fr(pk serial, a jsonb compression jsonbd);')
+
+            data = generate_dict(KEYS)
+            with node.connect('postgres') as con:
+                con.execute("insert into fr (a) values ('%s');" % json.dumps(data))
+                con.commit()
+
+                acoid = con.execute('select distinct acoid from jsonbd_dictionary')[0][0]
+                res = con.execute('select jsonbd_freeze(%d)' % acoid)
+                self.assertEqual(res[0][0], len(data))
+
+            frozen_dir = os.path.join(node.data_dir, 'pg_jsonbd')
+            self.assertTrue(os.listdir(frozen_dir))
+            node.restart()
+
+            with node.connect('postgres') as con, node.connect('postgres') as locker:
+                # workers can't read the dictionary, lookups would wait for them
+                locker.execute('lock table jsonbd_dictionary in access exclusive mode')
+                con.execute("set statement_timeout = '10s'")
+
+                # keys are resolved through the mapped file
+                res = con.execute('select a from fr')
+                self.assertEqual(res[0][0], data)
+
+                # and found by the perfect hash, no keys are added
+                con.execute("insert into fr (a) values ('%s');" % json.dumps(data))
+                con.commit()
+                locker.rollback()
+
+                res = con.execute('select count(*) from jsonbd_dictionary')
+                self.assertEqual(res[0][0], len(data))
+
+                res = con.execute('select a from fr order by pk')
+                self.assertEqual(res[1][0], data)
+
+    def test_statistics(self):
+        with jsonbd_node('node5') as node:
+            node.psql('postgres', 'create table st(pk serial, a jsonb compression jsonbd);')
+
+            with node.connect('postgres') as con:
+                for i in range(10):
+                    con.execute("insert into st (a) values ('%s');" %
+                                json.dumps({'common': i % 2, 'nested': {'inner': 1}}))
+                con.commit()
+
+                con.execute('analyze st')
+                con.commit()
+
+                res = con.execute('select key, frequency, ndistinct from jsonbd_statistics'
+                                  ' order by key')
+                self.assertEqual(res, [('common', 1.0, 2.0), ('inner', 1.0, 1.0),
+                                       ('nested', 1.0, 1.0)])
+
+    def test_statistics_commands(self):
+        with jsonbd_node('node11') as node:
+            node.safe_psql('postgres', 'create role alice login')
+            node.safe_psql('postgres', 'create table sv(pk serial, a jsonb compression jsonbd);'
+                           'create table sa(pk serial, a jsonb compression jsonbd);'
+                           'alter table sa owner to alice;'
+                           "insert into sv (a) values ('{\"v\": 1}');"
+                           "insert into sa (a) values ('{\"a\": 1}');")
+
+            # VACUUM ANALYZE commits its own transactions
+            node.safe_psql('postgres', 'vacuum analyze sv')
+            res = node.execute('postgres', 'select key from jsonbd_statistics')
+            self.assertEqual(res, [('v', )])
+
+            # relations the role does not own are skipped, like ANALYZE does
+            node.safe_psql('postgres', 'delete from jsonbd_statistics')
+            node.safe_psql('postgres', 'analyze', username='alice')
+            res = node.execute('postgres', 'select key from jsonbd_statistics')
+            self.assertEqual(res, [('a', )])
+
+            # the whole database
+            node.safe_psql('postgres', 'analyze')
+            res = node.execute('postgres', 'select key from jsonbd_statistics order by key')
+            self.assertEqual(res, [('a', ), ('v', )])
+
+            # functions of the role are not used instead of the system ones
+            node.safe_psql('postgres', 'create schema s authorization alice;'
+                           'alter role alice set search_path = s, pg_catalog, public')
+            node.safe_psql('postgres', "create aggregate s.count(*) (sfunc = int8inc,"
+                           " stype = int8, initcond = '1000')", username='alice')
+            node.safe_psql('postgres', 'analyze sa', username='alice')
+            res = node.execute('postgres', 'select key, frequency from jsonbd_statistics'
+                               ' where relid = \'sa\'::regclass')
+            self.assertEqual(res, [('a', 1.0)])
+
+    def test_dedup(self):
+        with jsonbd_node('node6') as node:
+            node.psql('postgres', "create table dd(pk serial, a jsonb "
+                      "compression jsonbd with (dedup '256'));")
+
+            catalog = generate_dict(KEYS)
+            data = [{'id': i, 'catalog': catalog} for i in range(5)]
+            with node.connect('postgres') as con:
+                for d in data:
+                    con.execute("insert into dd (a) values ('%s');" % json.dumps(d))
+                con.commit()
+
+                res = con.execute('select count(*) from jsonbd_subdocs')
+                self.assertEqual(res[0][0], 1)
+
+                res = con.execute('select a from dd order by pk')
+                for i, d in enumerate(data):
+                    self.assertEqual(res[i][0], d)
+
+            # sessions see subtrees seen by others
+            other = generate_dict(KEYS[:50])
+            for i in range(2):
+                with node.connect('postgres') as con:
+                    con.execute("insert into dd (a) values ('%s');" %
+                                json.dumps({'other': other}))
+                    con.commit()
+
+            with node.connect('postgres') as con:
+                res = con.execute('select count(*) from jsonbd_subdocs')
+                self.assertEqual(res[0][0], 2)
+
+                exported = con.execute('select jsonbd_export(a) from dd where pk = 2')[0][0]
+                con.execute('delete from dd where pk <= %d' % len(data))
+                con.commit()
+
+                # only the referenced subdocument is kept
+                res = con.execute('select jsonbd_gc_subdocs()')
+                self.assertEqual(res[0][0], 1)
+                con.commit()
+
+                res = con.execute('select a from dd order by pk')
+                self.assertEqual([r[0] for r in res], [{'other': other}] * 2)
+
+                # the reference of the imported datum is checked
+                con.execute('create table im(a jsonb compression jsonbd)')
+                src, dst = [con.execute("select attcompression from pg_attribute"
+                                        " where attrelid = '%s'::regclass"
+                                        " and attname = 'a'" % rel)[0][0]
+                            for rel in ('dd', 'im')]
+                con.execute('select jsonbd_import_dictionary(%d, %d, array_agg(id), array_agg(key))'
+                            ' from jsonbd_export_dictionary(%d)' % (src, dst, src))
+                with self.assertRaises(Exception):
+                    con.execute("select jsonbd_import('\\x%s'::bytea, %d)" %
+                                (bytes(exported).hex(), dst))
+
+    def test_templates(self):
+        with jsonbd_node('node7') as node:
+            node.psql('postgres', "create table tp(pk serial, a jsonb "
+                      "compression jsonbd with (templates 'on'));")
+
+            base = generate_dict(KEYS)
+            data = []
+            for i in range(5):
+                d = dict(base)
+                d['id'] = i
+                data.append(d)
+
+            removed = dict(base)
+            del removed[next(iter(base))]
+            data.append(removed)
+
+            with node.connect('postgres') as con:
+                con.execute("insert into tp (a) values ('%s');" % json.dumps(base))
+                con.commit()
+
+                acoid = con.execute('select distinct acoid from jsonbd_dictionary')[0][0]
+                res = con.execute("select jsonbd_learn_template(%d, array['%s'::jsonb])" %
+                                  (acoid, json.dumps(base)))
+                self.assertEqual(res[0][0], 1)
+                con.commit()
+
+                for d in data:
+                    con.execute("insert into tp (a) values ('%s');" % json.dumps(d))
+                con.commit()
+
+                res = con.execute('select a from tp order by pk')
+                self.assertEqual(res[0][0], base)
+                for i, d in enumerate(data):
+                    self.assertEqual(res[i + 1][0], d)
+
+                # template ids differ between options, such datums are not exported
+                with self.assertRaises(Exception):
+                    con.execute('select jsonbd_export(a) from tp where pk = 2')
+                con.rollback()
+
+            # concurrent adds wait for each other and take the next ids
+            ids = []
+            with node.connect('postgres') as con1, node.connect('postgres') as con2:
+                def add(c):
+                    ids.append(c.execute("select jsonbd_add_template(%d, '{\"t\": 1}')" %
+                                         acoid)[0][0])
+                    c.commit()
+
+                t = threading.Thread(target=add, args=(con2,))
+                ids.append(con1.execute("select jsonbd_add_template(%d, '{\"t\": 0}')" %
+                                        acoid)[0][0])
+                t.start()
+                time.sleep(1)
+                con1.commit()
+                t.join()
+            self.assertEqual(sorted(ids), [2, 3])
+
+            # only the owner of the table adds templates
+            node.safe_psql('postgres', 'create role nobody login;'
+                           'grant execute on function jsonbd_add_template(oid, jsonb)'
+                           ' to nobody')
+            with self.assertRaises(Exception):
+                node.safe_psql('postgres', "select jsonbd_add_template(%d, '{}')" % acoid,
+                               username='nobody')
+            with self.assertRaises(Exception):
+                node.safe_psql('postgres', "select jsonbd_add_template(0, '{}')")
+
+    def test_elide_nulls(self):
+        with jsonbd_node('node8') as node:
+            node.psql('postgres', "create table en(pk serial, a jsonb "
+                      "compression jsonbd with (elide_nulls 'on'));")
+
+            sparse = dict((k, None) for k in KEYS[:50])
+            sparse.update(generate_dict(KEYS[50:]))
+            data = [
+                sparse,
+                {'nested': sparse, 'list': [sparse, None]},
+                dict((k, None) for k in KEYS[:20]),
+                {'no_nulls': 1},
+            ]
+
+            with node.connect('postgres') as con:
+                for d in data:
+                    con.execute("insert into en (a) values ('%s');" % json.dumps(d))
+                con.commit()
+
+                res = con.execute('select a from en order by pk')
+                for i, d in enumerate(data):
+                    self.assertEqual(res[i][0], d)
+
+                res = con.execute("select a->'nested' ? '%s' from en where pk = 2" %
+                                  KEYS[0])
+                self.assertTrue(res[0][0])
+
+    def test_paths(self):
+        with jsonbd_node('node9') as node:
+            node.psql('postgres', "create table pt(pk serial, a jsonb "
+                      "compression jsonbd with (paths 'on', format 'stream'));")
+
+            payload = generate_dict(KEYS)
+            data = [
+                {'data': {'attributes': {'payload': payload}}},
+                {'id': 1, 'data': {'attributes': {'value': 1}}},
+                {'a': {'a': {'a': [{'b': {'c': None}}]}}},
+                {'single': 1},
+            ]
+
+            with node.connect('postgres') as con:
+                for d in data:
+                    con.execute("insert into pt (a) values ('%s');" % json.dumps(d))
+                con.commit()
+
+                res = con.execute('select a from pt order by pk')
+                for i, d in enumerate(data):
+                    self.assertEqual(res[i][0], d)
+
+                res = con.execute("select a#>'{data,attributes,payload}' from pt where pk = 1")
+                self.assertEqual(res[0][0], payload)
+
+
+    def test_spins(self):
+        with jsonbd_node('node22') as node:
+            node.safe_psql('postgres', 'create table t1(pk serial, a jsonb compression jsonbd);')
+
+            # responses are waited on the latch only, or mostly by spinning
+            data = []
+            for max_spins in (0, 1000000):
+                with node.connect('postgres') as con:
+                    con.execute('set jsonbd.max_spins = %d' % max_spins)
+                    for i in range(20):
+                        d = generate_dict(generate_keys(10))
+                        data.append(d)
+                        con.execute("insert into t1 (a) values ('%s');" % json.dumps(d))
+                    con.commit()
+
+                with node.connect('postgres') as con:
+                    con.execute('set jsonbd.max_spins = %d' % max_spins)
+                    res = con.execute('select pk, a from t1 order by pk')
+                    for pk, val in res:
+                        self.assertEqual(val, data[pk - 1])
+
+    def test_routing(self):
+        with jsonbd_node('node23', 'jsonbd.workers_count=3\n') as node:
+            for i in range(6):
+                node.safe_psql('postgres', 'create table r%d(pk serial, a jsonb '
+                               'compression jsonbd);' % i)
+
+            # several backends load their dictionaries through three workers
+            data = [[generate_dict(generate_keys(20)) for j in range(20)] for i in range(6)]
+
+            def load(num):
+                with node.connect('postgres') as con:
+                    for j, d in enumerate(data[num]):
+                        con.execute("insert into r%d (a) values ('%s');"
+                                    % ((num + j) % 6, json.dumps(d)))
+                        con.commit()
+
+            threads = [threading.Thread(target=load, args=(i, )) for i in range(6)]
+            for t in threads:
+                t.start()
+            for t in threads:
+                t.join()
+
+            expected = [[] for i in range(6)]
+            for num in range(6):
+                for j, d in enumerate(data[num]):
+                    expected[(num + j) % 6].append(json.dumps(d, sort_keys=True))
+
+            with node.connect('postgres') as con:
+                for i in range(6):
+                    res = con.execute('select a from r%d' % i)
+                    self.assertEqual(sorted(json.dumps(r[0], sort_keys=True) for r in res),
+                                     sorted(expected[i]))
+
+                res = con.execute('select count(*), count(distinct (acoid, id)),'
+                                  ' count(distinct (acoid, key)) from jsonbd_dictionary')
+                self.assertEqual(res[0][0], res[0][1])
+                self.assertEqual(res[0][0], res[0][2])
+
+    def test_worker_read_xact(self):
+        with jsonbd_node('node24') as node:
+            node.safe_psql('postgres', 'create table t1(pk serial, a jsonb compression jsonbd);')
+
+            data = generate_dict(KEYS)
+            workers_sql = ("select count(*) from pg_stat_activity"
+                           " where backend_type = 'background worker' and %s")
+            with node.connect('postgres') as con:
+                con.execute("insert into t1 (a) values ('%s');" % json.dumps(data))
+                con.commit()
+
+            with node.connect('postgres') as con:
+                res = con.execute('select a from t1')
+                self.assertEqual(res[0][0], data)
+
+                # the open read transaction doesn't hold back xmin
+                res = con.execute(workers_sql % 'backend_xmin is not null')
+                self.assertEqual(res[0][0], 0)
+                con.commit()
+
+                # idle workers close it
+                time.sleep(2)
+                res = con.execute(workers_sql % 'xact_start is not null')
+                self.assertEqual(res[0][0], 0)
+
+                # catalog changes are seen by the next request
+                con.execute('drop table t1')
+                con.execute('create table t2(pk serial, a jsonb compression jsonbd)')
+                con.execute("insert into t2 (a) values ('%s');" % json.dumps(data))
+                con.commit()
+
+            with node.connect('postgres') as con:
+                res = con.execute('select a from t2')
+                self.assertEqual(res[0][0], data)
+
+    def test_key_encoding(self):
+        with jsonbd_node('node25') as node:
+            node.safe_psql('postgres', 'create table t1(pk serial, a jsonb compression jsonbd);')
+
+            # keys are sent to workers right from the source document
+            data = [
+                {'ключ': 1, '键': 2, 'emoji \U0001F600': 3},
+                {'quote "key"': 1, 'back\\slash': 2, 'new\nline': 3, 'tab\tkey': 4},
+                {'': 1, ' ': 2, 'a' * 300: 3},
+                {'same': {'same': {'same': 1}}, 'list': [{'same': 2}, {'other': 3}]},
+            ]
+
+            with node.connect('postgres') as con:
+                for d in data:
+                    con.execute("insert into t1 (a) values ('%s');" %
+                                json.dumps(d).replace("'", "''"))
+                con.commit()
+
+            with node.connect('postgres') as con:
+                res = con.execute('select pk, a from t1 order by pk')
+                for pk, val in res:
+                    self.assertEqual(val, data[pk - 1])
+
+    def test_large_messages(self):
+        with jsonbd_node('node26') as node:
+            node.safe_psql('postgres', 'create table t1(pk serial, a jsonb compression jsonbd);')
+
+            # keys and ids of the documents don't fit into the 1kB queue
+            data = [
+                dict(('%s_%d' % (k, i), i) for i, k in enumerate(generate_keys(2000))),
+                {'nested': dict(('long_key_%d_%s' % (i, 'x' * 200), i) for i in range(100))},
+            ]
+
+            with node.connect('postgres') as con:
+                for d in data:
+                    con.execute("insert into t1 (a) values ('%s');" % json.dumps(d))
+                con.commit()
+
+            # keys of new backends come from workers in large responses too
+            with node.connect('postgres') as con:
+                res = con.execute('select pk, a from t1 order by pk')
+                for pk, val in res:
+                    self.assertEqual(val, data[pk - 1])
+
+    def test_concurrent_lookups(self):
+        with jsonbd_node('node27') as node:
+            node.safe_psql('postgres', 'create table t1(pk serial, a jsonb compression jsonbd);')
+
+            data = [generate_dict(KEYS) for i in range(10)]
+            with node.connect('postgres') as con:
+                for d in data:
+                    con.execute("insert into t1 (a) values ('%s');" % json.dumps(d))
+                con.commit()
+
+            # the shared cache is empty, backends ask for the same keys at once
+            node.restart()
+            errors = []
+
+            def read():
+                try:
+                    with node.connect('postgres') as con:
+                        res = con.execute('select pk, a from t1 order by pk')
+                        for pk, val in res:
+                            if val != data[pk - 1]:
+                                errors.append(pk)
+                except Exception as e:
+                    errors.append(e)
+
+            threads = [threading.Thread(target=read) for i in range(8)]
+            for t in threads:
+                t.start()
+            for t in threads:
+                t.join()
+
+            self.assertEqual(errors, [])
+
+    def test_shapes(self):
+        with jsonbd_node('node28') as node:
+            node.safe_psql('postgres', 'create table t1(pk serial, a jsonb compression jsonbd);')
+
+            keys = generate_keys(100)
+            data = []
+            # repeated shapes with different values
+            for i in range(200):
+                data.append({'id': i, 'name': 'n%d' % i, 'tags': {'a': i, 'b': None}})
+            # subsets of one set of keys, wide objects that are not cached
+            for i in range(1, 80):
+                data.append(dict((k, i) for k in keys[:i]))
+            # more shapes than the cache keeps
+            for i in range(1500):
+                data.append({'k%d' % (i % 40): i, 'k%d' % (i % 37 + 40): None,
+                             'k%d' % (i % 31 + 80): [i]})
+
+            with node.connect('postgres') as con:
+                for d in data:
+                    con.execute("insert into t1 (a) values ('%s');" % json.dumps(d))
+                con.commit()
+
+            # read twice, the second time objects come from cached shapes
+            with node.connect('postgres') as con:
+                for i in range(2):
+                    res = con.execute('select pk, a from t1 order by pk')
+                    for pk, val in res:
+                        self.assertEqual(val, data[pk - 1])
 
 if __name__ == "__main__":
     unittest.main()